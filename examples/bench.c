@@ -0,0 +1,1083 @@
+/* -*- c-basic-offset: 8; -*-
+ * bench.c: Benchmarks of libshout against a local dummy server.
+ * $Id$
+ *
+ * The dummy server speaks the xaudiocast protocol on 127.0.0.1 and throws
+ * away whatever it is sent. Every test prints one line per measurement.
+ *
+ * Usage: bench fds [descriptors [rounds]]
+ *   Opens descriptors files first (10000 by default) so the connection
+ *   socket is far above FD_SETSIZE, then times rounds connection setups
+ *   in blocking and in nonblocking mode.
+ *
+ * Usage: bench queue [pages]
+ *   Appends 4 KiB blocks to a connection whose server does not read,
+ *   until pages blocks (16384 by default) are queued. Prints the time per
+ *   append for every 1024 blocks as the queue grows.
+ *
+ * Usage: bench zerocopy [megabytes [chunk]]
+ *   Streams megabytes (1024 by default) in writes of chunk bytes (65536 by
+ *   default), once copying and once with SHOUT_CONTROL_SET_ZEROCOPY.
+ *   Prints the throughput and the CPU time per byte of the sender.
+ *
+ * Usage: bench ktls cert key [megabytes [chunk]]
+ *   Like zerocopy, but over TLS, once encrypting with OpenSSL and once
+ *   with SHOUT_CONTROL_SET_KTLS. cert must be for localhost, e.g.:
+ *   openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost \
+ *       -keyout key.pem -out cert.pem
+ *
+ * Usage: bench dns [host [connections]]
+ *   Opens connections (32 by default) to host (localhost by default) at
+ *   once in nonblocking mode, twice so the second round finds the name in
+ *   the cache. Prints the time until all are connected and the longest
+ *   time a single call blocked the caller. host must resolve to 127.0.0.1.
+ *
+ * Usage: bench loop [streams [megabytes [chunk]]]
+ *   Connects streams (64 by default) in a single shout_loop_t and sends
+ *   megabytes (64 by default) on each in writes of chunk bytes (16384 by
+ *   default). Prints the setup time, the throughput and the CPU time per
+ *   byte. Run it against builds with and without --enable-io-uring to
+ *   compare the io_uring backend with the socket path.
+ *
+ * Usage: bench mp3 [file [megabytes]]
+ *   Sends megabytes (64 by default) of MP3 with shout_send(): the frames
+ *   of file repeated, or made up ones without a file, then the same
+ *   frames in between long runs of garbage, then in between ID3v2 and APE
+ *   tags that are stripped. Prints the throughput and the CPU time per
+ *   byte. Run it against a build with CPPFLAGS=-DLIBSHOUT_MP3_SCAN_SCALAR
+ *   to compare the SIMD sync scanner with the plain one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+int main()
+{
+    printf("The benchmarks need a POSIX system\n");
+    return 1;
+}
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <shout/shout.h>
+
+#if SHOUT_TLS
+#include <openssl/ssl.h>
+#endif
+
+typedef struct {
+    pid_t   pid;
+    int     port;
+} server_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ssize_t server_read(int fd, void *ssl, void *buff, size_t len)
+{
+#if SHOUT_TLS
+    if (ssl)
+        return SSL_read(ssl, buff, len);
+#endif
+    return read(fd, buff, len);
+}
+
+static ssize_t server_write(int fd, void *ssl, const void *buff, size_t len)
+{
+#if SHOUT_TLS
+    if (ssl)
+        return SSL_write(ssl, buff, len);
+#endif
+    return write(fd, buff, len);
+}
+
+/* Reads the request up to the empty line and accepts it. */
+static int server_handshake(int fd, void *ssl)
+{
+    char buff[4096];
+    size_t len = 0;
+    ssize_t ret;
+
+    while (len < sizeof(buff) - 1) {
+        ret = server_read(fd, ssl, &buff[len], 1);
+        if (ret <= 0)
+            return -1;
+        len++;
+        if (len >= 2 && buff[len - 1] == '\n' && buff[len - 2] == '\n')
+            return server_write(fd, ssl, "OK\n", 3) == 3 ? 0 : -1;
+    }
+
+    return -1;
+}
+
+/* Serves a client. With stall set nothing is read after the handshake. */
+static void server_client(int fd, int stall, void *tls)
+{
+    char buff[65536];
+    void *ssl = NULL;
+
+#if SHOUT_TLS
+    if (tls) {
+        ssl = SSL_new(tls);
+        if (!ssl || !SSL_set_fd(ssl, fd) || SSL_accept(ssl) != 1)
+            return;
+    }
+#else
+    (void)tls;
+#endif
+
+    if (server_handshake(fd, ssl) != 0)
+        return;
+
+    if (stall) {
+        pause();
+        return;
+    }
+
+    while (server_read(fd, ssl, buff, sizeof(buff)) > 0);
+}
+
+/* Forks the server, every client is served by a process of its own.
+ * tls is the SSL_CTX to accept clients with, NULL for plain TCP.
+ */
+static int server_start(server_t *server, int stall, void *tls)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        return -1;
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 128) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) != 0) {
+        close(listener);
+        return -1;
+    }
+    server->port = ntohs(addr.sin_port);
+
+    server->pid = fork();
+    if (server->pid < 0) {
+        close(listener);
+        return -1;
+    }
+
+    if (server->pid == 0) {
+        /* the clients are killed together with the server */
+        setpgid(0, 0);
+        signal(SIGCHLD, SIG_IGN);
+        while ((fd = accept(listener, NULL, NULL)) >= 0) {
+            if (fork() == 0) {
+                close(listener);
+                server_client(fd, stall, tls);
+                _exit(0);
+            }
+            close(fd);
+        }
+        _exit(0);
+    }
+
+    setpgid(server->pid, server->pid);
+    close(listener);
+
+    return 0;
+}
+
+static void server_stop(server_t *server)
+{
+    kill(-server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+           ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+static shout_t *bench_shout_new(const char *host, int port, int nonblocking)
+{
+    shout_t *shout;
+
+    if (!(shout = shout_new())) {
+        printf("Could not allocate shout_t\n");
+        return NULL;
+    }
+
+    if (shout_set_host(shout, host) != SHOUTERR_SUCCESS ||
+        shout_set_port(shout, port) != SHOUTERR_SUCCESS ||
+        shout_set_protocol(shout, SHOUT_PROTOCOL_XAUDIOCAST) != SHOUTERR_SUCCESS ||
+        shout_set_format(shout, SHOUT_FORMAT_MP3) != SHOUTERR_SUCCESS ||
+        shout_set_password(shout, "hackme") != SHOUTERR_SUCCESS ||
+        shout_set_mount(shout, "/bench.mp3") != SHOUTERR_SUCCESS ||
+#if SHOUT_TLS
+        shout_set_tls(shout, SHOUT_TLS_DISABLED) != SHOUTERR_SUCCESS ||
+#endif
+        shout_set_nonblocking(shout, nonblocking) != SHOUTERR_SUCCESS) {
+        printf("Error setting up: %s\n", shout_get_error(shout));
+        shout_free(shout);
+        return NULL;
+    }
+
+    return shout;
+}
+
+/* Waits until libshout can make progress and lets it do so. */
+static int process(shout_t *shout)
+{
+    struct pollfd pfd;
+    uint64_t timeout;
+    int ret;
+
+    ret = shout_get_pollfd(shout, &pfd.fd, &pfd.events, &timeout);
+    if (ret != SHOUTERR_SUCCESS)
+        return ret;
+
+    pfd.revents = 0;
+    if (poll(&pfd, pfd.events ? 1 : 0, timeout == SHOUT_POLL_TIMEOUT_NONE ? -1 : (int)timeout) < 0)
+        return SHOUTERR_SOCKET;
+
+    return shout_process(shout, pfd.revents);
+}
+
+/* Opens the connection, driving it to the end in nonblocking mode. */
+static int bench_open(shout_t *shout)
+{
+    int ret;
+
+    ret = shout_open(shout);
+    if (ret == SHOUTERR_SUCCESS)
+        return SHOUTERR_SUCCESS;
+
+    while (ret == SHOUTERR_BUSY || ret == SHOUTERR_RETRY)
+        ret = process(shout);
+
+    return ret == SHOUTERR_CONNECTED ? SHOUTERR_SUCCESS : ret;
+}
+
+static void print_times(const char *name, uint64_t *times, unsigned int count)
+{
+    uint64_t min = ~(uint64_t)0;
+    uint64_t max = 0;
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (times[i] < min)
+            min = times[i];
+        if (times[i] > max)
+            max = times[i];
+        sum += times[i];
+    }
+
+    printf("%-24s min %8llu us  avg %8llu us  max %8llu us\n", name,
+           (unsigned long long)(min / 1000), (unsigned long long)(sum / count / 1000),
+           (unsigned long long)(max / 1000));
+}
+
+/* Connection setup with the socket above FD_SETSIZE. select() can not
+ * wait for such a socket at all.
+ */
+static int bench_fds(int argc, char *argv[])
+{
+    unsigned int descriptors = argc > 0 ? atoi(argv[0]) : 10000;
+    unsigned int rounds = argc > 1 ? atoi(argv[1]) : 100;
+    struct rlimit limit;
+    server_t server;
+    uint64_t *times;
+    unsigned int i;
+    int nonblocking;
+    int ret = 0;
+
+    if (!rounds)
+        return 1;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < descriptors + 64) {
+        limit.rlim_cur = descriptors + 64;
+        if (limit.rlim_cur > limit.rlim_max)
+            limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* before the descriptors are opened, so the server does not inherit them */
+    if (server_start(&server, 0, NULL) != 0) {
+        printf("Could not start the server\n");
+        return 1;
+    }
+
+    times = calloc(rounds, sizeof(*times));
+    if (!times) {
+        server_stop(&server);
+        return 1;
+    }
+
+    for (i = 0; i < descriptors; i++) {
+        if (open("/dev/null", O_RDONLY) < 0) {
+            printf("Could only open %u descriptors\n", i);
+            break;
+        }
+    }
+
+    printf("%u descriptors open, FD_SETSIZE is %u\n", i, (unsigned int)FD_SETSIZE);
+
+    for (nonblocking = 0; nonblocking < 2 && !ret; nonblocking++) {
+        for (i = 0; i < rounds; i++) {
+            shout_t *shout = bench_shout_new("127.0.0.1", server.port, nonblocking);
+            uint64_t start;
+
+            if (!shout) {
+                ret = 1;
+                break;
+            }
+
+            start = now_ns();
+            if (bench_open(shout) != SHOUTERR_SUCCESS) {
+                printf("Error connecting: %s\n", shout_get_error(shout));
+                shout_free(shout);
+                ret = 1;
+                break;
+            }
+            times[i] = now_ns() - start;
+
+            shout_close(shout);
+            shout_free(shout);
+        }
+
+        if (!ret)
+            print_times(nonblocking ? "setup, nonblocking" : "setup, blocking", times, rounds);
+    }
+
+    free(times);
+    server_stop(&server);
+
+    return ret;
+}
+
+/* Appends to a write queue that is never drained. */
+static int bench_queue(int argc, char *argv[])
+{
+    unsigned int pages = argc > 0 ? atoi(argv[0]) : 16384;
+    unsigned char buff[4096];
+    server_t server;
+    shout_t *shout;
+    uint64_t start;
+    unsigned int i;
+    unsigned int j;
+    int ret = 0;
+
+    if (server_start(&server, 1, NULL) != 0) {
+        printf("Could not start the server\n");
+        return 1;
+    }
+
+    if (!(shout = bench_shout_new("127.0.0.1", server.port, 1))) {
+        server_stop(&server);
+        return 1;
+    }
+
+    if (bench_open(shout) != SHOUTERR_SUCCESS) {
+        printf("Error connecting: %s\n", shout_get_error(shout));
+        shout_free(shout);
+        server_stop(&server);
+        return 1;
+    }
+
+    memset(buff, 0, sizeof(buff));
+    for (i = 0; i < pages && !ret; i += 1024) {
+        start = now_ns();
+        for (j = 0; j < 1024; j++) {
+            if (shout_send_raw(shout, buff, sizeof(buff)) < 0) {
+                printf("Error sending: %s\n", shout_get_error(shout));
+                ret = 1;
+                break;
+            }
+        }
+        if (!ret) {
+            printf("queue %10lld bytes  %6llu ns per append\n", (long long)shout_queuelen(shout),
+                   (unsigned long long)((now_ns() - start) / 1024));
+        }
+    }
+
+    shout_close(shout);
+    shout_free(shout);
+    server_stop(&server);
+
+    return ret;
+}
+
+/* Streams megabytes in chunk sized writes, keeping the queue short. */
+static int bench_stream(shout_t *shout, const char *name, unsigned int megabytes, size_t chunk)
+{
+    uint64_t total = (uint64_t)megabytes << 20;
+    uint64_t sent = 0;
+    uint64_t start;
+    uint64_t cpu;
+    unsigned char *buff;
+    int ret = SHOUTERR_SUCCESS;
+
+    if (bench_open(shout) != SHOUTERR_SUCCESS) {
+        printf("Error connecting: %s\n", shout_get_error(shout));
+        return 1;
+    }
+
+    if (!(buff = calloc(1, chunk)))
+        return 1;
+
+    start = now_ns();
+    cpu = cpu_ns();
+    while (sent < total || shout_queuelen(shout) > 0) {
+        if (sent < total && shout_queuelen(shout) < (4 << 20)) {
+            if (shout_send_raw(shout, buff, chunk) < 0) {
+                ret = SHOUTERR_SOCKET;
+                break;
+            }
+            sent += chunk;
+            continue;
+        }
+
+        ret = process(shout);
+        if (ret != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY && ret != SHOUTERR_RETRY)
+            break;
+        ret = SHOUTERR_SUCCESS;
+    }
+    cpu = cpu_ns() - cpu;
+    start = now_ns() - start;
+
+    free(buff);
+
+    if (ret != SHOUTERR_SUCCESS) {
+        printf("Error sending: %s\n", shout_get_error(shout));
+        return 1;
+    }
+
+    printf("%-24s %8.1f MB/s  %6.3f ns CPU per byte\n", name,
+           (double)sent / (1 << 20) / ((double)start / 1000000000),
+           (double)cpu / sent);
+
+    return 0;
+}
+
+/* Copying writes against MSG_ZEROCOPY over loopback. */
+static int bench_zerocopy(int argc, char *argv[])
+{
+    unsigned int megabytes = argc > 0 ? atoi(argv[0]) : 1024;
+    size_t chunk = argc > 1 ? (size_t)atoi(argv[1]) : 65536;
+    server_t server;
+    shout_t *shout;
+    int zerocopy;
+    int ret = 0;
+
+    if (!megabytes || !chunk)
+        return 1;
+
+    if (server_start(&server, 0, NULL) != 0) {
+        printf("Could not start the server\n");
+        return 1;
+    }
+
+    for (zerocopy = 0; zerocopy < 2 && !ret; zerocopy++) {
+        if (!(shout = bench_shout_new("127.0.0.1", server.port, 1))) {
+            ret = 1;
+            break;
+        }
+
+        if (zerocopy && shout_control(shout, SHOUT_CONTROL_SET_ZEROCOPY, 1) != SHOUTERR_SUCCESS) {
+            printf("%-24s not supported\n", "zerocopy");
+        } else {
+            ret = bench_stream(shout, zerocopy ? "zerocopy" : "copy", megabytes, chunk);
+        }
+
+        shout_close(shout);
+        shout_free(shout);
+    }
+
+    server_stop(&server);
+
+    return ret;
+}
+
+/* Encryption by OpenSSL against kernel TLS over loopback. */
+static int bench_ktls(int argc, char *argv[])
+{
+#if SHOUT_TLS
+    unsigned int megabytes = argc > 2 ? atoi(argv[2]) : 1024;
+    size_t chunk = argc > 3 ? (size_t)atoi(argv[3]) : 65536;
+    server_t server;
+    shout_t *shout;
+    SSL_CTX *tls;
+    int ktls;
+    int ret = 0;
+
+    if (argc < 2 || !megabytes || !chunk) {
+        printf("A certificate and a key are needed\n");
+        return 1;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_library_init();
+    tls = SSL_CTX_new(SSLv23_server_method());
+#else
+    tls = SSL_CTX_new(TLS_server_method());
+#endif
+    if (!tls || SSL_CTX_use_certificate_chain_file(tls, argv[0]) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls, argv[1], SSL_FILETYPE_PEM) != 1) {
+        printf("Could not load %s and %s\n", argv[0], argv[1]);
+        SSL_CTX_free(tls);
+        return 1;
+    }
+
+    ret = server_start(&server, 0, tls);
+    SSL_CTX_free(tls);
+    if (ret != 0) {
+        printf("Could not start the server\n");
+        return 1;
+    }
+
+    for (ktls = 0; ktls < 2 && !ret; ktls++) {
+        if (!(shout = bench_shout_new("localhost", server.port, 1))) {
+            ret = 1;
+            break;
+        }
+
+        if (shout_set_tls(shout, SHOUT_TLS_RFC2818) != SHOUTERR_SUCCESS ||
+            shout_set_ca_file(shout, argv[0]) != SHOUTERR_SUCCESS) {
+            printf("Error setting up TLS: %s\n", shout_get_error(shout));
+            ret = 1;
+        } else if (ktls && shout_control(shout, SHOUT_CONTROL_SET_KTLS, 1) != SHOUTERR_SUCCESS) {
+            printf("%-24s not supported\n", "ktls");
+        } else {
+            ret = bench_stream(shout, ktls ? "ktls" : "openssl", megabytes, chunk);
+        }
+
+        shout_close(shout);
+        shout_free(shout);
+    }
+
+    server_stop(&server);
+
+    return ret;
+#else
+    (void)argc;
+    (void)argv;
+    printf("libshout was built without TLS\n");
+    return 1;
+#endif
+}
+
+static uint64_t max_ns(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+/* Many connections to a name resolved in the background. */
+static int bench_dns(int argc, char *argv[])
+{
+    const char *host = argc > 0 ? argv[0] : "localhost";
+    unsigned int count = argc > 1 ? atoi(argv[1]) : 32;
+    shout_t **shouts;
+    struct pollfd *pfds;
+    unsigned int *index;
+    server_t server;
+    uint64_t start;
+    uint64_t stall;
+    uint64_t t;
+    unsigned int left;
+    unsigned int round;
+    unsigned int i;
+    unsigned int n;
+    int timeout;
+    int ret = 0;
+
+    if (!count)
+        return 1;
+
+    shouts = calloc(count, sizeof(*shouts));
+    pfds = calloc(count, sizeof(*pfds));
+    index = calloc(count, sizeof(*index));
+    if (!shouts || !pfds || !index || server_start(&server, 0, NULL) != 0) {
+        free(shouts);
+        free(pfds);
+        free(index);
+        return 1;
+    }
+
+    for (round = 0; round < 2 && !ret; round++) {
+        left = 0;
+        stall = 0;
+        start = now_ns();
+
+        for (i = 0; i < count; i++) {
+            if (!(shouts[i] = bench_shout_new(host, server.port, 1))) {
+                ret = 1;
+                break;
+            }
+
+            t = now_ns();
+            ret = shout_open(shouts[i]);
+            stall = max_ns(stall, now_ns() - t);
+
+            if (ret == SHOUTERR_BUSY || ret == SHOUTERR_RETRY) {
+                left++;
+            } else if (ret != SHOUTERR_SUCCESS) {
+                printf("Error connecting: %s\n", shout_get_error(shouts[i]));
+                shout_free(shouts[i]);
+                shouts[i] = NULL;
+                ret = 1;
+                break;
+            }
+            ret = 0;
+        }
+
+        while (left && !ret) {
+            uint64_t timeout_ms;
+
+            n = 0;
+            timeout = -1;
+            for (i = 0; i < count; i++) {
+                if (shout_get_connected(shouts[i]) == SHOUTERR_CONNECTED)
+                    continue;
+                if (shout_get_pollfd(shouts[i], &pfds[n].fd, &pfds[n].events, &timeout_ms) != SHOUTERR_SUCCESS)
+                    continue;
+                if (timeout_ms != SHOUT_POLL_TIMEOUT_NONE && (timeout < 0 || timeout_ms < (uint64_t)timeout))
+                    timeout = timeout_ms;
+                pfds[n].revents = 0;
+                index[n++] = i;
+            }
+
+            if (poll(pfds, n, timeout) < 0) {
+                ret = 1;
+                break;
+            }
+
+            for (i = 0; i < n; i++) {
+                int rc;
+
+                t = now_ns();
+                rc = shout_process(shouts[index[i]], pfds[i].revents);
+                stall = max_ns(stall, now_ns() - t);
+
+                if (rc == SHOUTERR_CONNECTED) {
+                    left--;
+                } else if (rc != SHOUTERR_BUSY && rc != SHOUTERR_RETRY && rc != SHOUTERR_SUCCESS) {
+                    printf("Error connecting: %s\n", shout_get_error(shouts[index[i]]));
+                    ret = 1;
+                    break;
+                }
+            }
+        }
+
+        if (!ret) {
+            printf("%-24s all connected after %8llu us  longest call %8llu us\n",
+                   round ? "cached" : "resolved", (unsigned long long)((now_ns() - start) / 1000),
+                   (unsigned long long)(stall / 1000));
+        }
+
+        for (i = 0; i < count; i++) {
+            if (!shouts[i])
+                continue;
+            shout_close(shouts[i]);
+            shout_free(shouts[i]);
+            shouts[i] = NULL;
+        }
+    }
+
+    server_stop(&server);
+    free(shouts);
+    free(pfds);
+    free(index);
+
+    return ret;
+}
+
+/* MPEG 1 layer III, 128 kbit/s, 44.1 kHz: 417 bytes without padding */
+#define BENCH_MP3_FRAME     417
+
+/* Makes up a frame with random contents. */
+static size_t bench_mp3_frame(unsigned char *p, size_t len)
+{
+    size_t i;
+
+    if (len < BENCH_MP3_FRAME)
+        return 0;
+
+    p[0] = 0xFF;
+    p[1] = 0xFB;
+    p[2] = 0x90;
+    p[3] = 0x00;
+    for (i = 4; i < BENCH_MP3_FRAME; i++)
+        p[i] = rand();
+
+    return BENCH_MP3_FRAME;
+}
+
+/* Fills buff with frames taken from file or made up, separated by
+ * garbage or tags if asked for.
+ */
+static void bench_mp3_fill(unsigned char *buff, size_t len, const unsigned char *file, size_t file_len, int kind)
+{
+    /* ID3v2.4, 16384 bytes after the header */
+    static const unsigned char id3[10] = {'I', 'D', '3', 4, 0, 0, 0, 1, 0, 0};
+    /* APEv2 header, 8192 bytes of items and footer follow */
+    static const unsigned char ape[24] = {'A', 'P', 'E', 'T', 'A', 'G', 'E', 'X',
+        0xD0, 0x07, 0, 0, 0x00, 0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xA0};
+    size_t pos = 0;
+    size_t file_pos = 0;
+    size_t frames = 0;
+    size_t n;
+    size_t i;
+
+    while (pos < len) {
+        if (kind == 1 && frames % 4 == 3) {
+            /* garbage that is not worth a second look, 0xFF once in a while */
+            n = len - pos < 16384 ? len - pos : 16384;
+            for (i = 0; i < n; i++)
+                buff[pos + i] = rand() % 251;
+            pos += n;
+        } else if (kind == 2 && frames % 16 == 15) {
+            /* an ID3v2 tag of 16 KiB or an APE tag of 8 KiB */
+            if (frames % 32 == 15) {
+                n = 10 + 16384;
+                if (n > len - pos)
+                    break;
+                memset(&buff[pos], 0, n);
+                memcpy(&buff[pos], id3, sizeof(id3));
+            } else {
+                n = 32 + 8192;
+                if (n > len - pos)
+                    break;
+                memset(&buff[pos], 0, n);
+                memcpy(&buff[pos], ape, sizeof(ape));
+            }
+            for (i = 32; i < n; i++)
+                buff[pos + i] = rand();
+            pos += n;
+        }
+
+        if (file_len) {
+            n = file_len - file_pos < len - pos ? file_len - file_pos : len - pos;
+            memcpy(&buff[pos], &file[file_pos], n);
+            file_pos = (file_pos + n) % file_len;
+        } else {
+            n = bench_mp3_frame(&buff[pos], len - pos);
+            if (!n)
+                break;
+        }
+        pos += n;
+        frames++;
+    }
+
+    /* whatever is too short for a frame */
+    if (pos < len)
+        memset(&buff[pos], 0, len - pos);
+}
+
+/* MP3 parsing on clean, garbage heavy and tag heavy streams. */
+static int bench_mp3(int argc, char *argv[])
+{
+    static const char *names[3] = {"mp3 frames", "mp3 garbage", "mp3 tags"};
+    unsigned int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    size_t len = (size_t)megabytes << 20;
+    size_t chunk = 4096;
+    unsigned char *file = NULL;
+    size_t file_len = 0;
+    unsigned char *buff;
+    server_t server;
+    shout_t *shout;
+    uint64_t start;
+    uint64_t cpu;
+    size_t pos;
+    FILE *fh;
+    int kind;
+    int ret = 0;
+    int rc;
+
+    if (!megabytes)
+        return 1;
+
+    if (argc > 0) {
+        if (!(fh = fopen(argv[0], "rb"))) {
+            printf("Could not open %s\n", argv[0]);
+            return 1;
+        }
+        file = malloc(len);
+        if (file)
+            file_len = fread(file, 1, len, fh);
+        fclose(fh);
+        if (!file_len) {
+            printf("Could not read %s\n", argv[0]);
+            free(file);
+            return 1;
+        }
+    }
+
+    if (!(buff = malloc(len)) || server_start(&server, 0, NULL) != 0) {
+        free(file);
+        free(buff);
+        return 1;
+    }
+
+    srand(1);
+    for (kind = 0; kind < 3 && !ret; kind++) {
+        bench_mp3_fill(buff, len, file, file_len, kind);
+
+        if (!(shout = bench_shout_new("127.0.0.1", server.port, 1))) {
+            ret = 1;
+            break;
+        }
+
+        if (shout_control(shout, SHOUT_CONTROL_SET_STRIP_TAGS, 1) != SHOUTERR_SUCCESS ||
+            bench_open(shout) != SHOUTERR_SUCCESS) {
+            printf("Error connecting: %s\n", shout_get_error(shout));
+            shout_free(shout);
+            ret = 1;
+            break;
+        }
+
+        start = now_ns();
+        cpu = cpu_ns();
+        for (pos = 0; pos < len || shout_queuelen(shout) > 0; ) {
+            if (pos < len && shout_queuelen(shout) < (4 << 20)) {
+                rc = shout_send(shout, buff + pos, len - pos < chunk ? len - pos : chunk);
+                pos += chunk;
+            } else {
+                rc = process(shout);
+            }
+            if (rc != SHOUTERR_SUCCESS && rc != SHOUTERR_BUSY && rc != SHOUTERR_RETRY) {
+                printf("Error sending: %s\n", shout_get_error(shout));
+                ret = 1;
+                break;
+            }
+        }
+        cpu = cpu_ns() - cpu;
+        start = now_ns() - start;
+
+        if (!ret) {
+            printf("%-24s %8.1f MB/s  %6.3f ns CPU per byte\n", names[kind],
+                   (double)len / (1 << 20) / ((double)start / 1000000000),
+                   (double)cpu / len);
+        }
+
+        shout_close(shout);
+        shout_free(shout);
+    }
+
+    server_stop(&server);
+    free(file);
+    free(buff);
+
+    return ret;
+}
+
+typedef struct {
+    shout_t    *shout;
+    uint64_t    sent;
+    int         connected;
+    int         failed;
+} bench_loop_stream_t;
+
+static void bench_loop_callback(shout_loop_t *loop, shout_t *shout, int status, void *userdata)
+{
+    bench_loop_stream_t *stream = userdata;
+
+    (void)loop;
+    (void)shout;
+
+    if (status == SHOUTERR_CONNECTED) {
+        stream->connected = 1;
+    } else if (status != SHOUTERR_SUCCESS) {
+        stream->failed = 1;
+    }
+}
+
+/* Many streams driven by one event loop. */
+static int bench_loop(int argc, char *argv[])
+{
+    unsigned int count = argc > 0 ? atoi(argv[0]) : 64;
+    unsigned int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    size_t chunk = argc > 2 ? (size_t)atoi(argv[2]) : 16384;
+    uint64_t total = (uint64_t)megabytes << 20;
+    bench_loop_stream_t *streams;
+    unsigned char *buff;
+    shout_loop_t *loop;
+    server_t server;
+    uint64_t start;
+    uint64_t cpu;
+    unsigned int left;
+    unsigned int i;
+    int ret = 0;
+    int rc;
+
+    if (!count || !megabytes || !chunk)
+        return 1;
+
+    streams = calloc(count, sizeof(*streams));
+    buff = calloc(1, chunk);
+    if (!streams || !buff || server_start(&server, 0, NULL) != 0) {
+        free(streams);
+        free(buff);
+        return 1;
+    }
+
+    if (!(loop = shout_loop_new())) {
+        printf("%-24s not supported\n", "loop");
+        server_stop(&server);
+        free(streams);
+        free(buff);
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < count && !ret; i++) {
+        if (!(streams[i].shout = bench_shout_new("127.0.0.1", server.port, 1)) ||
+            shout_loop_add(loop, streams[i].shout, bench_loop_callback, &streams[i]) != SHOUTERR_SUCCESS) {
+            ret = 1;
+            break;
+        }
+        rc = shout_open(streams[i].shout);
+        if (rc == SHOUTERR_SUCCESS) {
+            streams[i].connected = 1;
+        } else if (rc != SHOUTERR_BUSY && rc != SHOUTERR_RETRY) {
+            printf("Error connecting: %s\n", shout_get_error(streams[i].shout));
+            ret = 1;
+        }
+    }
+
+    for (left = count; left && !ret; ) {
+        if (shout_loop_iter(loop, 1000) < 0) {
+            ret = 1;
+            break;
+        }
+        for (left = 0, i = 0; i < count; i++) {
+            if (streams[i].failed) {
+                printf("Error connecting: %s\n", shout_get_error(streams[i].shout));
+                ret = 1;
+                break;
+            }
+            if (!streams[i].connected)
+                left++;
+        }
+    }
+
+    if (!ret)
+        printf("%-24s %8llu us for %u connections\n", "setup", (unsigned long long)((now_ns() - start) / 1000), count);
+
+    start = now_ns();
+    cpu = cpu_ns();
+    for (left = count; left && !ret; ) {
+        left = 0;
+        for (i = 0; i < count; i++) {
+            /* keep a few writes queued per stream, the loop does the rest */
+            while (streams[i].sent < total && shout_queuelen(streams[i].shout) < (ssize_t)(4 * chunk)) {
+                if (shout_send_raw(streams[i].shout, buff, chunk) < 0) {
+                    streams[i].failed = 1;
+                    break;
+                }
+                streams[i].sent += chunk;
+            }
+            if (streams[i].failed) {
+                printf("Error sending: %s\n", shout_get_error(streams[i].shout));
+                ret = 1;
+                break;
+            }
+            if (streams[i].sent < total || shout_queuelen(streams[i].shout) > 0)
+                left++;
+        }
+
+        if (left && !ret && shout_loop_iter(loop, 1000) < 0)
+            ret = 1;
+    }
+    cpu = cpu_ns() - cpu;
+    start = now_ns() - start;
+
+    if (!ret) {
+        printf("%-24s %8.1f MB/s  %6.3f ns CPU per byte\n", "streaming",
+               (double)total * count / (1 << 20) / ((double)start / 1000000000),
+               (double)cpu / ((double)total * count));
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!streams[i].shout)
+            continue;
+        shout_loop_remove(loop, streams[i].shout);
+        shout_close(streams[i].shout);
+        shout_free(streams[i].shout);
+    }
+
+    shout_loop_free(loop);
+    server_stop(&server);
+    free(streams);
+    free(buff);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (argc < 2) {
+        printf("Usage: %s fds [descriptors [rounds]]\n", argv[0]);
+        printf("       %s queue [pages]\n", argv[0]);
+        printf("       %s zerocopy [megabytes [chunk]]\n", argv[0]);
+        printf("       %s ktls cert key [megabytes [chunk]]\n", argv[0]);
+        printf("       %s dns [host [connections]]\n", argv[0]);
+        printf("       %s loop [streams [megabytes [chunk]]]\n", argv[0]);
+        printf("       %s mp3 [file [megabytes]]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    shout_init();
+
+    if (strcmp(argv[1], "fds") == 0) {
+        ret = bench_fds(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "queue") == 0) {
+        ret = bench_queue(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "zerocopy") == 0) {
+        ret = bench_zerocopy(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "ktls") == 0) {
+        ret = bench_ktls(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "dns") == 0) {
+        ret = bench_dns(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "loop") == 0) {
+        ret = bench_loop(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "mp3") == 0) {
+        ret = bench_mp3(argc - 2, argv + 2);
+    } else {
+        printf("Unknown benchmark %s\n", argv[1]);
+        ret = 1;
+    }
+
+    shout_shutdown();
+
+    return ret;
+}
+#endif
@@ -9,11 +9,34 @@
 #include <unistd.h>
 
 #if !(defined(WIN32) && !defined(__MINGW64__) && !defined(__MINGW32__))
-#include <time.h>
+#include <poll.h>
 #endif
 
 #include <shout/shout.h>
 
+/* Waits until libshout can make progress and lets it do so. */
+static int process(shout_t *shout)
+{
+#if !(defined(WIN32) && !defined(__MINGW64__) && !defined(__MINGW32__))
+    struct pollfd pfd;
+    uint64_t timeout;
+    int ret;
+
+    ret = shout_get_pollfd(shout, &pfd.fd, &pfd.events, &timeout);
+    if (ret != SHOUTERR_SUCCESS)
+        return ret;
+
+    pfd.revents = 0;
+    if (poll(&pfd, pfd.events ? 1 : 0, timeout == SHOUT_POLL_TIMEOUT_NONE ? -1 : (int)timeout) < 0)
+        return SHOUTERR_SOCKET;
+
+    return shout_process(shout, pfd.revents);
+#else
+    usleep(10000);
+    return shout_get_connected(shout);
+#endif
+}
+
 int main()
 {
     shout_t *shout;
@@ -74,15 +97,8 @@ int main()
     if (ret == SHOUTERR_BUSY)
         printf("Connection pending...\n");
 
-    while (ret == SHOUTERR_BUSY || ret == SHOUTERR_RETRY) {
-#if !(defined(WIN32) && !defined(__MINGW64__) && !defined(__MINGW32__))
-        static const struct timespec ts = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
-        nanosleep(&ts, NULL);
-#else
-        usleep(10000);
-#endif
-        ret = shout_get_connected(shout);
-    }
+    while (ret == SHOUTERR_BUSY || ret == SHOUTERR_RETRY)
+        ret = process(shout);
 
     if (ret == SHOUTERR_CONNECTED) {
         printf("Connected to server...\n");
@@ -22,6 +22,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #ifdef HAVE_INTTYPES_H
 #   include <inttypes.h>
@@ -35,9 +37,58 @@
 #   include <unistd.h>
 #endif
 
+#ifdef HAVE_POLL_H
+#   include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#   include <sys/uio.h>
+#endif
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <linux/errqueue.h>
+#   if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#       define SHOUT_HAVE_ZEROCOPY
+#   endif
+#endif
+
 #include <shout/shout.h>
 #include "shout_private.h"
 
+static int shout_connection_emit(shout_connection_t *con, shout_event_t event, ...)
+{
+    va_list ap;
+    int ret;
+
+    if (!con->callback)
+        return SHOUT_CALLBACK_PASS;
+
+    va_start(ap, event);
+    ret = con->callback(con, event, con->callback_userdata, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+/* Emits SHOUT_EVENT_QUEUE_HIGH/LOW when the write queue crosses a watermark.
+ * The low watermark is below the high one so the events do not flap.
+ */
+static void shout_connection__check_watermarks(shout_connection_t *con)
+{
+    if (!con->queue_high)
+        return;
+
+    if (!con->queue_above_high && con->wqueue.len >= con->queue_high) {
+        con->queue_above_high = 1;
+        shout_connection_emit(con, SHOUT_EVENT_QUEUE_HIGH, con->wqueue.len);
+    } else if (con->queue_above_high && con->wqueue.len <= con->queue_low) {
+        con->queue_above_high = 0;
+        shout_connection_emit(con, SHOUT_EVENT_QUEUE_LOW, con->wqueue.len);
+    }
+}
+
 #ifdef HAVE_OPENSSL
 static int shout_cb_tls_callback(shout_tls_t *tls, shout_event_t event, void *userdata, va_list ap)
 {
@@ -64,6 +115,7 @@ shout_connection_t *shout_connection_new(shout_t *self, const shout_protocol_imp
     con->refc = 1;
     con->socket = SOCK_ERROR;
     con->selected_tls_mode = SHOUT_TLS_AUTO;
+    con->transport = shout_transport_socket;
     con->impl = impl;
     con->plan = plan;
     con->error = SHOUTERR_SUCCESS;
@@ -96,62 +148,343 @@ int                 shout_connection_unref(shout_connection_t *con)
 
     shout_connection_disconnect(con);
 
+    shout_queue_free(&(con->rqueue));
+    shout_queue_free(&(con->wqueue));
+    free(con->frames);
+
     free(con);
 
     return SHOUTERR_SUCCESS;
 }
 
-static struct timeval shout_connection_iter__wait_for_io__get_timeout(shout_connection_t *con, shout_t *shout, uint64_t timeout)
+/* Timeout for a single wait in [ms]. */
+static int shout_connection_iter__wait_for_io__get_timeout(shout_connection_t *con, shout_t *shout, uint64_t timeout)
 {
-    static const struct timeval tv_blocking = {
-        .tv_sec = 8,
-        .tv_usec = 0
-    };
-    static const struct timeval tv_nonblocking = {
-        .tv_sec = 0,
-        .tv_usec = 1000
-    };
-
     if (timeout) {
-        struct timeval tv = {
-            .tv_sec = timeout / 1000,
-            .tv_usec = (timeout % 1000) * 1000
-        };
-        return tv;
+        return timeout > INT_MAX ? INT_MAX : (int)timeout;
     } else if (con->nonblocking == SHOUT_BLOCKING_NONE) {
-        return tv_nonblocking;
+        return 1;
     } else {
-        return tv_blocking;
+        return 8000;
     }
 }
 
-static shout_connection_return_state_t shout_connection_iter__wait_for_io(shout_connection_t *con, shout_t *shout, int for_read, int for_write, uint64_t timeout)
+/* Wait backends.
+ * They all follow the same contract: Return SHOUT_RS_DONE if the socket is ready
+ * (or has an error pending, which the caller will see on the next read or write),
+ * SHOUT_RS_TIMEOUT if the timeout expired and SHOUT_RS_ERROR on failure.
+ * poll() is used where available as select() can not handle descriptors
+ * at or above FD_SETSIZE. Many connections at once are best served by
+ * shout_loop_t which uses epoll where available.
+ */
+#ifdef HAVE_POLL_H
+static shout_connection_return_state_t shout_connection_iter__wait_for_io__backend(sock_t socket, int for_read, int for_write, int timeout)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = socket;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (for_read)
+        pfd.events |= POLLIN;
+    if (for_write)
+        pfd.events |= POLLOUT;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret > 0 && !(pfd.revents & POLLNVAL)) {
+        return SHOUT_RS_DONE;
+    } else if (ret == 0) {
+        return SHOUT_RS_TIMEOUT;
+    } else {
+        return SHOUT_RS_ERROR;
+    }
+}
+#else
+static shout_connection_return_state_t shout_connection_iter__wait_for_io__backend(sock_t socket, int for_read, int for_write, int timeout)
 {
-    struct timeval tv = shout_connection_iter__wait_for_io__get_timeout(con, shout, timeout);
+    struct timeval tv = {
+        .tv_sec = timeout / 1000,
+        .tv_usec = (timeout % 1000) * 1000
+    };
     fd_set fhset_r;
     fd_set fhset_w;
     fd_set fhset_e;
     int ret;
 
+#ifndef _WIN32
+    /* FD_SET() on such a descriptor would write past the end of the set */
+    if (socket >= FD_SETSIZE)
+        return SHOUT_RS_ERROR;
+#endif
+
     FD_ZERO(&fhset_r);
     FD_ZERO(&fhset_w);
     FD_ZERO(&fhset_e);
-    FD_SET(con->socket, &fhset_r);
-    FD_SET(con->socket, &fhset_w);
-    FD_SET(con->socket, &fhset_e);
+    FD_SET(socket, &fhset_r);
+    FD_SET(socket, &fhset_w);
+    FD_SET(socket, &fhset_e);
 
-    ret = select(con->socket + 1, (for_read) ? &fhset_r : NULL, (for_write) ? &fhset_w : NULL, &fhset_e, &tv);
+    ret = select(socket + 1, (for_read) ? &fhset_r : NULL, (for_write) ? &fhset_w : NULL, &fhset_e, &tv);
 
-    if (ret > 0 && (FD_ISSET(con->socket, &fhset_r) || FD_ISSET(con->socket, &fhset_w) || FD_ISSET(con->socket, &fhset_e))) {
+    if (ret > 0 && (FD_ISSET(socket, &fhset_r) || FD_ISSET(socket, &fhset_w) || FD_ISSET(socket, &fhset_e))) {
         return SHOUT_RS_DONE;
     } else if (ret == 0) {
-        shout_connection_set_error(con, SHOUTERR_RETRY);
         return SHOUT_RS_TIMEOUT;
     } else {
-        shout_connection_set_error(con, SHOUTERR_SOCKET);
         return SHOUT_RS_ERROR;
     }
 }
+#endif
+
+static shout_connection_return_state_t shout_connection_iter__wait_for_io(shout_connection_t *con, shout_t *shout, int for_read, int for_write, uint64_t timeout)
+{
+    shout_connection_return_state_t ret;
+    int timeout_ms;
+
+    if (con->io_external) {
+        /* The event loop already waited for us. Do not block here but
+         * tell the caller to come back once the loop reports readiness.
+         */
+        int want = SHOUT_IO_ERROR;
+
+        if (for_read)
+            want |= SHOUT_IO_READ;
+        if (for_write)
+            want |= SHOUT_IO_WRITE;
+
+        if (con->io_ready & want) {
+            con->io_ready &= ~want;
+            return SHOUT_RS_DONE;
+        }
+
+        shout_connection_set_error(con, SHOUTERR_RETRY);
+        return SHOUT_RS_NOTNOW;
+    }
+
+    timeout_ms = shout_connection_iter__wait_for_io__get_timeout(con, shout, timeout);
+    if (timeout_ms) {
+        uint64_t start = timing_get_time();
+        ret = shout_connection_iter__wait_for_io__backend(con->socket, for_read, for_write, timeout_ms);
+        con->wait_time += timing_get_time() - start;
+    } else {
+        ret = shout_connection_iter__wait_for_io__backend(con->socket, for_read, for_write, 0);
+    }
+    switch (ret) {
+        case SHOUT_RS_TIMEOUT:
+            shout_connection_set_error(con, SHOUTERR_RETRY);
+        break;
+        case SHOUT_RS_ERROR:
+            shout_connection_set_error(con, SHOUTERR_SOCKET);
+        break;
+        default:
+        break;
+    }
+
+    return ret;
+}
+
+static int shout_connection__port(shout_connection_t *con, shout_t *shout)
+{
+    if (con->impl == shout_icy_impl)
+        return shout->port + 1;
+    return shout->port;
+}
+
+/* Happy eyeballs (RFC 8305): if a host has several addresses, connection
+ * attempts are started SHOUT_RACE_DELAY apart, or as soon as the previous
+ * one failed. The first attempt to complete wins, the others are closed.
+ */
+#define SHOUT_RACE_DELAY    250 /* [ms] */
+
+static void shout_connection_race__stop(shout_connection_t *con, sock_t keep)
+{
+    size_t i;
+
+    if (!con->race_addrs)
+        return;
+
+    for (i = 0; i < SHOUT_RACE_MAX; i++) {
+        if (con->race_socket[i] != SOCK_ERROR && con->race_socket[i] != keep)
+            sock_close(con->race_socket[i]);
+        con->race_socket[i] = SOCK_ERROR;
+    }
+
+    shout_dns_result_unref(con->race_addrs);
+    con->race_addrs = NULL;
+}
+
+/* The attempt to wait for, the newest one still running. */
+static sock_t shout_connection_race__socket(shout_connection_t *con)
+{
+    size_t i;
+
+    if (con->race_socket[con->race_newest] != SOCK_ERROR)
+        return con->race_socket[con->race_newest];
+
+    for (i = 0; i < SHOUT_RACE_MAX; i++) {
+        if (con->race_socket[i] != SOCK_ERROR)
+            return con->race_socket[i];
+    }
+
+    return SOCK_ERROR;
+}
+
+/* Time until the race needs attention again in [ms]. Older attempts are
+ * only checked then, so this is bound by SHOUT_RACE_DELAY.
+ */
+static int shout_connection_race__timeout(shout_connection_t *con)
+{
+    uint64_t now = timing_get_time();
+
+    if (con->race_next < con->race_addrs->count && con->race_next_start < now + SHOUT_RACE_DELAY)
+        return con->race_next_start > now ? (int)(con->race_next_start - now) : 0;
+
+    return SHOUT_RACE_DELAY;
+}
+
+static shout_connection_return_state_t shout_connection_iter__race(shout_connection_t *con, shout_t *shout)
+{
+    uint64_t now = timing_get_time();
+    sock_t winner = SOCK_ERROR;
+    sock_t sock;
+    size_t running = 0;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < SHOUT_RACE_MAX; i++) {
+        if (con->race_socket[i] == SOCK_ERROR)
+            continue;
+
+        rc = sock_connected(con->race_socket[i], 0);
+        if (rc == 1) {
+            winner = con->race_socket[i];
+            break;
+        } else if (rc == SOCK_ERROR) {
+            sock_close(con->race_socket[i]);
+            con->race_socket[i] = SOCK_ERROR;
+            con->race_next_start = now;
+        } else {
+            running++;
+        }
+    }
+
+    if (winner != SOCK_ERROR) {
+        shout_connection_race__stop(con, winner);
+        con->socket = winner;
+        if (con->nonblocking != SHOUT_BLOCKING_NONE)
+            sock_set_blocking(con->socket, SOCK_BLOCK);
+        /* sock_connected() already confirmed the connection */
+        con->current_socket_state = SHOUT_SOCKSTATE_CONNECTED;
+
+        if (con->selected_tls_mode == SHOUT_TLS_RFC2818) {
+            rc = shout_connection_starttls(con, shout);
+            if (rc != SHOUTERR_SUCCESS) {
+                shout_connection_set_error(con, rc);
+                return SHOUT_RS_ERROR;
+            }
+        }
+        return SHOUT_RS_DONE;
+    }
+
+    while (con->race_next < con->race_addrs->count && con->race_next_start <= now) {
+        for (i = 0; i < SHOUT_RACE_MAX && con->race_socket[i] != SOCK_ERROR; i++);
+        if (i == SHOUT_RACE_MAX)
+            break;
+
+        sock = sock_connect_non_blocking(con->race_addrs->addr[con->race_next++].host, shout_connection__port(con, shout));
+        if (sock < 0) {
+            /* failed right away, go on with the next address */
+            continue;
+        }
+
+        con->race_socket[i] = sock;
+        con->race_newest = i;
+        con->race_next_start = now + SHOUT_RACE_DELAY;
+        running++;
+    }
+
+    if (!running && con->race_next >= con->race_addrs->count) {
+        shout_connection_race__stop(con, SOCK_ERROR);
+        shout_connection_set_error(con, SHOUTERR_NOCONNECT);
+        return SHOUT_RS_ERROR;
+    }
+
+    if (con->nonblocking != SHOUT_BLOCKING_NONE && !con->io_external && running) {
+        uint64_t start = timing_get_time();
+        shout_connection_iter__wait_for_io__backend(shout_connection_race__socket(con), 0, 1, shout_connection_race__timeout(con));
+        con->wait_time += timing_get_time() - start;
+    }
+
+    shout_connection_set_error(con, SHOUTERR_RETRY);
+    return SHOUT_RS_NOTNOW;
+}
+
+/* Connects to the resolved addresses, racing them if there are several. */
+static int shout_connection_connect__addr(shout_connection_t *con, shout_t *shout, shout_dns_result_t *result)
+{
+    int port;
+    size_t i;
+
+#ifdef HAVE_LIBURING
+    /* MSG_ZEROCOPY completions are only handled by the socket transport */
+    if (con->uring && con->zerocopy == SHOUT_ZEROCOPY_OFF)
+        con->transport = shout_transport_uring;
+#endif
+
+    if (result->count > 1) {
+        shout_dns_result_ref(result);
+        con->race_addrs = result;
+        con->race_next = 0;
+        con->race_next_start = 0;
+        con->race_newest = 0;
+        for (i = 0; i < SHOUT_RACE_MAX; i++)
+            con->race_socket[i] = SOCK_ERROR;
+
+        con->current_socket_state = SHOUT_SOCKSTATE_RACING;
+        con->target_socket_state = SHOUT_SOCKSTATE_CONNECTED;
+        if (con->target_message_state != SHOUT_MSGSTATE_IDLE)
+            con->current_message_state = SHOUT_MSGSTATE_CREATING0;
+
+        return SHOUTERR_SUCCESS;
+    }
+
+    port = shout_connection__port(con, shout);
+
+    for (i = 0; i < result->count; i++) {
+#ifdef HAVE_LIBURING
+        if (con->uring) {
+            con->socket = shout_uring_connect(con, result->addr[i].host, port);
+        } else
+#endif
+        if (con->nonblocking == SHOUT_BLOCKING_NONE) {
+            con->socket = sock_connect_non_blocking(result->addr[i].host, port);
+        } else {
+            con->socket = sock_connect(result->addr[i].host, port);
+        }
+
+        if (con->socket >= 0)
+            break;
+    }
+
+    if (con->socket < 0) {
+        con->socket = SOCK_ERROR;
+        return SHOUTERR_NOCONNECT;
+    }
+
+    con->current_socket_state = SHOUT_SOCKSTATE_CONNECTING;
+    con->target_socket_state = SHOUT_SOCKSTATE_CONNECTED;
+    if (con->target_message_state != SHOUT_MSGSTATE_IDLE)
+        con->current_message_state = SHOUT_MSGSTATE_CREATING0;
+
+    if (con->selected_tls_mode == SHOUT_TLS_RFC2818)
+        return shout_connection_starttls(con, shout);
+
+    return SHOUTERR_SUCCESS;
+}
 
 static shout_connection_return_state_t shout_connection_iter__socket(shout_connection_t *con, shout_t *shout)
 {
@@ -162,11 +495,49 @@ static shout_connection_return_state_t shout_connection_iter__socket(shout_conne
         case SHOUT_SOCKSTATE_UNCONNECTED:
             shout_connection_set_error(con, shout_connection_connect(con, shout));
             if (shout_connection_get_error(con) == SHOUTERR_SUCCESS) {
-                con->current_socket_state = SHOUT_SOCKSTATE_CONNECTING;
+                /* the state is CONNECTING, or RESOLVING while the name is looked up */
                 return SHOUT_RS_DONE;
             }
         break;
+        case SHOUT_SOCKSTATE_RESOLVING: {
+            shout_dns_result_t *result;
+
+            rc = shout_dns_request_get_result(con->dns, &result);
+            if (rc == SHOUTERR_BUSY) {
+                shout_connection_set_error(con, SHOUTERR_RETRY);
+                return SHOUT_RS_NOTNOW;
+            }
+
+            shout_dns_request_free(con->dns);
+            con->dns = NULL;
+            /* readiness of the resolver is no readiness of the socket */
+            con->io_ready = 0;
+
+            if (rc != SHOUTERR_SUCCESS) {
+                shout_connection_set_error(con, SHOUTERR_NOCONNECT);
+                return SHOUT_RS_ERROR;
+            }
+
+            rc = shout_connection_connect__addr(con, shout, result);
+            shout_dns_result_unref(result);
+            if (rc != SHOUTERR_SUCCESS) {
+                shout_connection_set_error(con, rc);
+                return SHOUT_RS_ERROR;
+            }
+            return SHOUT_RS_DONE;
+        }
+        break;
+        case SHOUT_SOCKSTATE_RACING:
+            return shout_connection_iter__race(con, shout);
+        break;
         case SHOUT_SOCKSTATE_CONNECTING:
+#ifdef HAVE_LIBURING
+            if (con->uring_connecting) {
+                /* the completion wakes the event loop up */
+                shout_connection_set_error(con, SHOUTERR_RETRY);
+                return SHOUT_RS_NOTNOW;
+            }
+#endif
             if (con->nonblocking == SHOUT_BLOCKING_NONE) {
                 ret = shout_connection_iter__wait_for_io(con, shout, 1, 1, 0);
                 if (ret != SHOUT_RS_DONE) {
@@ -190,6 +561,13 @@ static shout_connection_return_state_t shout_connection_iter__socket(shout_conne
             rc = shout_tls_try_connect(con->tls);
             if (rc == SHOUTERR_SUCCESS) {
                 con->current_socket_state = SHOUT_SOCKSTATE_TLS_VERIFIED;
+#ifdef SHOUT_HAVE_KTLS
+                if (shout_tls_ktls_send(con->tls)) {
+                    con->transport = shout_transport_ktls;
+                    /* the TLS layer of the kernel does not support MSG_ZEROCOPY */
+                    con->zerocopy = SHOUT_ZEROCOPY_OFF;
+                }
+#endif
                 return SHOUT_RS_DONE;
             } else if (rc == SHOUTERR_BUSY) {
                 return SHOUT_RS_NOTNOW;
@@ -212,30 +590,68 @@ static shout_connection_return_state_t shout_connection_iter__socket(shout_conne
     return SHOUT_RS_ERROR;
 }
 
-ssize_t shout_connection__read(shout_connection_t *con, shout_t *shout, void *buf, size_t len)
+/* plain socket transport */
+static ssize_t shout_transport_socket__read(shout_connection_t *con, void *buf, size_t len)
 {
-#ifdef HAVE_OPENSSL
-    if (con->tls)
-        return shout_tls_read(con->tls, buf, len);
-#endif
     return sock_read_bytes(con->socket, buf, len);
 }
 
-ssize_t shout_connection__write(shout_connection_t *con, shout_t *shout, const void *buf, size_t len)
+static ssize_t shout_transport_socket__write(shout_connection_t *con, const void *buf, size_t len)
 {
-#ifdef HAVE_OPENSSL
-    if (con->tls)
-        return shout_tls_write(con->tls, buf, len);
-#endif
     return sock_write_bytes(con->socket, buf, len);
 }
-int shout_connection__recoverable(shout_connection_t *con, shout_t *shout)
+
+static int shout_transport_socket__recoverable(shout_connection_t *con)
 {
+    return sock_recoverable(sock_error());
+}
+
 #ifdef HAVE_OPENSSL
-    if (con->tls)
-        return shout_tls_recoverable(con->tls);
+/* TLS transport, used once shout_connection_starttls() was called */
+static ssize_t shout_transport_tls__read(shout_connection_t *con, void *buf, size_t len)
+{
+    return shout_tls_read(con->tls, buf, len);
+}
+
+static ssize_t shout_transport_tls__write(shout_connection_t *con, const void *buf, size_t len)
+{
+    return shout_tls_write(con->tls, buf, len);
+}
+
+static int shout_transport_tls__recoverable(shout_connection_t *con)
+{
+    return shout_tls_recoverable(con->tls);
+}
+
+static const shout_transport_t shout_transport_tls_real = {
+    .name = "tls",
+    .read = shout_transport_tls__read,
+    .write = shout_transport_tls__write,
+    .recoverable = shout_transport_tls__recoverable,
+    /* SSL_write() has no vectored form, pages are written one by one */
+    .flush = NULL
+};
+const shout_transport_t * shout_transport_tls = &shout_transport_tls_real;
 #endif
-    return sock_recoverable(sock_error());
+
+ssize_t shout_connection__read(shout_connection_t *con, shout_t *shout, void *buf, size_t len)
+{
+    return con->transport->read(con, buf, len);
+}
+
+ssize_t shout_connection__write(shout_connection_t *con, shout_t *shout, const void *buf, size_t len)
+{
+    ssize_t ret = con->transport->write(con, buf, len);
+
+    con->write_calls++;
+    if (ret > 0)
+        con->bytes_written += ret;
+
+    return ret;
+}
+int shout_connection__recoverable(shout_connection_t *con, shout_t *shout)
+{
+    return con->transport->recoverable(con);
 }
 
 static ssize_t try_write(shout_connection_t *con, shout_t *shout, const void *data_p, size_t len)
@@ -253,6 +669,7 @@ static ssize_t try_write(shout_connection_t *con, shout_t *shout, const void *da
 
     if (ret < 0) {
         if (shout_connection__recoverable(con, shout)) {
+            con->write_busy++;
             shout_connection_set_error(con, SHOUTERR_BUSY);
             return pos;
         }
@@ -262,50 +679,264 @@ static ssize_t try_write(shout_connection_t *con, shout_t *shout, const void *da
     return pos;
 }
 
-static shout_connection_return_state_t shout_connection_iter__message__send_queue(shout_connection_t *con, shout_t *shout)
-{
-    shout_buf_t *buf;
-    int          ret;
-
-    if (!con->wqueue.len)
-        return SHOUT_RS_DONE;
+#ifdef HAVE_SYS_UIO_H
+/* max number of pages handed to a single writev() */
+#if defined(IOV_MAX) && IOV_MAX < 128
+#define SHOUT_WRITEV_MAX    IOV_MAX
+#else
+#define SHOUT_WRITEV_MAX    128
+#endif
 
-    buf = con->wqueue.head;
-    while (buf) {
-        ret = try_write(con, shout, buf->data + buf->pos, buf->len - buf->pos);
-        if (ret < 0) {
-            if (shout_connection_get_error(con) == SHOUTERR_BUSY) {
-                return SHOUT_RS_NOTNOW;
-            } else {
-                return SHOUT_RS_ERROR;
-            }
-        }
+#ifdef SHOUT_HAVE_ZEROCOPY
+/* writes smaller than this are cheaper to copy than to pin */
+#define SHOUT_ZEROCOPY_MIN  (16*1024)
 
-        buf->pos += ret;
-        con->wqueue.len -= ret;
-        if (buf->pos == buf->len) {
-            con->wqueue.head = buf->next;
-            free(buf);
-            buf = con->wqueue.head;
-            if (buf)
-                buf->prev = NULL;
-        } else {
-            /* incomplete write */
-            return SHOUT_RS_NOTNOW;
+/* Collects MSG_ZEROCOPY completions from the socket's error queue and
+ * releases the buffers the kernel no longer references.
+ */
+static void shout_connection_zerocopy_reap(shout_connection_t *con)
+{
+    char                        control[128];
+    struct msghdr               msg;
+    struct cmsghdr             *cm;
+    struct sock_extended_err   *serr;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(con->socket, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* the kernel had to copy anyway, so pinning is pure overhead */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                con->zerocopy = SHOUT_ZEROCOPY_OFF;
+
+            /* TCP completes in order, ee_data is the last id of the range */
+            if ((int32_t)(serr->ee_data + 1 - con->zerocopy_done) > 0)
+                con->zerocopy_done = serr->ee_data + 1;
         }
     }
-    return SHOUT_RS_DONE;
+
+    shout_queue_complete(&(con->wqueue), con->zerocopy_done);
 }
 
-static shout_connection_return_state_t shout_connection_iter__message__recv(shout_connection_t *con, shout_t *shout)
+static ssize_t shout_connection_zerocopy_writev(shout_connection_t *con, struct iovec *iov, size_t count)
 {
-    char buf[1024];
-    ssize_t rc;
-    int ret;
+    struct msghdr   msg;
+    shout_buf_t    *buf;
+    size_t          left;
+    size_t          chunk;
+    ssize_t         ret;
 
-    rc = shout_connection__read(con, shout, buf, sizeof(buf));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
 
-    if (rc < 0 && shout_connection__recoverable(con, shout))
+    ret = sendmsg(con->socket, &msg, MSG_ZEROCOPY|MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (ret < 0 && errno == ENOBUFS) {
+        /* out of option memory for notifications, fall back to copying */
+        return sendmsg(con->socket, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    }
+
+    if (ret <= 0)
+        return ret;
+
+    /* the kernel may now read from every buffer it accepted data from */
+    for (left = ret, buf = con->wqueue.head; left; left -= chunk, buf = buf->next) {
+        chunk = buf->len - buf->pos;
+        if (chunk > left)
+            chunk = left;
+        buf->zerocopy_pending = 1;
+        buf->zerocopy_id = con->zerocopy_next;
+    }
+    con->zerocopy_next++;
+
+    return ret;
+}
+#endif
+
+/* Writes as many pages as possible with a single call on plain sockets. */
+static shout_connection_return_state_t shout_transport_socket__flush(shout_connection_t *con)
+{
+    struct iovec    iov[SHOUT_WRITEV_MAX];
+    shout_buf_t    *buf;
+    size_t          count;
+    size_t          total;
+    size_t          left;
+    size_t          chunk;
+    ssize_t         ret;
+
+#ifdef SHOUT_HAVE_ZEROCOPY
+    if (con->wqueue.inflight)
+        shout_connection_zerocopy_reap(con);
+
+    if (con->zerocopy == SHOUT_ZEROCOPY_WANTED) {
+        int one = 1;
+
+        if (setsockopt(con->socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+            con->zerocopy = SHOUT_ZEROCOPY_ACTIVE;
+        } else {
+            con->zerocopy = SHOUT_ZEROCOPY_OFF;
+        }
+    }
+#endif
+
+    while (con->wqueue.len) {
+        total = 0;
+        for (count = 0, buf = con->wqueue.head; buf && count < SHOUT_WRITEV_MAX; buf = buf->next, count++) {
+            iov[count].iov_base = buf->data + buf->pos;
+            iov[count].iov_len = buf->len - buf->pos;
+            total += iov[count].iov_len;
+        }
+
+#ifdef SHOUT_HAVE_ZEROCOPY
+        if (con->zerocopy == SHOUT_ZEROCOPY_ACTIVE && total >= SHOUT_ZEROCOPY_MIN) {
+            ret = shout_connection_zerocopy_writev(con, iov, count);
+        } else
+#endif
+        ret = sock_writev(con->socket, iov, count);
+        con->write_calls++;
+        if (ret < 0) {
+            if (sock_recoverable(sock_error())) {
+                con->write_busy++;
+                shout_connection_set_error(con, SHOUTERR_BUSY);
+                return SHOUT_RS_NOTNOW;
+            }
+            shout_connection_set_error(con, SHOUTERR_SOCKET);
+            return SHOUT_RS_ERROR;
+        }
+
+        for (left = ret; left; left -= chunk) {
+            buf = con->wqueue.head;
+            chunk = buf->len - buf->pos;
+            if (chunk > left)
+                chunk = left;
+            shout_queue_advance(&(con->wqueue), chunk);
+        }
+
+        con->bytes_written += ret;
+        if ((size_t)ret < total) {
+            /* incomplete write */
+            return SHOUT_RS_NOTNOW;
+        }
+    }
+
+    return SHOUT_RS_DONE;
+}
+#endif
+
+static const shout_transport_t shout_transport_socket_real = {
+    .name = "socket",
+    .read = shout_transport_socket__read,
+    .write = shout_transport_socket__write,
+    .recoverable = shout_transport_socket__recoverable,
+#ifdef HAVE_SYS_UIO_H
+    .flush = shout_transport_socket__flush
+#else
+    .flush = NULL
+#endif
+};
+const shout_transport_t * shout_transport_socket = &shout_transport_socket_real;
+
+#ifdef SHOUT_HAVE_KTLS
+/* kTLS transport: the kernel encrypts whatever is written to the socket,
+ * so writes take the plain socket paths. Reads still go through OpenSSL.
+ */
+static ssize_t shout_transport_ktls__read(shout_connection_t *con, void *buf, size_t len)
+{
+    con->ktls_reading = 1;
+    return shout_tls_read(con->tls, buf, len);
+}
+
+static ssize_t shout_transport_ktls__write(shout_connection_t *con, const void *buf, size_t len)
+{
+    con->ktls_reading = 0;
+    return sock_write_bytes(con->socket, buf, len);
+}
+
+static int shout_transport_ktls__recoverable(shout_connection_t *con)
+{
+    if (con->ktls_reading)
+        return shout_tls_recoverable(con->tls);
+    return sock_recoverable(sock_error());
+}
+
+#ifdef HAVE_SYS_UIO_H
+static shout_connection_return_state_t shout_transport_ktls__flush(shout_connection_t *con)
+{
+    con->ktls_reading = 0;
+    return shout_transport_socket__flush(con);
+}
+#endif
+
+static const shout_transport_t shout_transport_ktls_real = {
+    .name = "ktls",
+    .read = shout_transport_ktls__read,
+    .write = shout_transport_ktls__write,
+    .recoverable = shout_transport_ktls__recoverable,
+#ifdef HAVE_SYS_UIO_H
+    .flush = shout_transport_ktls__flush
+#else
+    .flush = NULL
+#endif
+};
+const shout_transport_t * shout_transport_ktls = &shout_transport_ktls_real;
+#endif
+
+static shout_connection_return_state_t shout_connection_iter__message__send_queue(shout_connection_t *con, shout_t *shout)
+{
+    shout_buf_t *buf;
+    int          ret;
+
+    if (!con->wqueue.len)
+        return SHOUT_RS_DONE;
+
+    if (con->transport->flush)
+        return con->transport->flush(con);
+
+    buf = con->wqueue.head;
+    while (buf) {
+        ret = try_write(con, shout, buf->data + buf->pos, buf->len - buf->pos);
+        if (ret < 0) {
+            if (shout_connection_get_error(con) == SHOUTERR_BUSY) {
+                return SHOUT_RS_NOTNOW;
+            } else {
+                return SHOUT_RS_ERROR;
+            }
+        }
+
+        if ((size_t)ret < (buf->len - buf->pos)) {
+            /* incomplete write */
+            shout_queue_advance(&(con->wqueue), ret);
+            return SHOUT_RS_NOTNOW;
+        }
+
+        shout_queue_advance(&(con->wqueue), ret);
+        buf = con->wqueue.head;
+    }
+    return SHOUT_RS_DONE;
+}
+
+static shout_connection_return_state_t shout_connection_iter__message__recv(shout_connection_t *con, shout_t *shout)
+{
+    char buf[1024];
+    ssize_t rc;
+    int ret;
+
+    rc = shout_connection__read(con, shout, buf, sizeof(buf));
+
+    if (rc < 0 && shout_connection__recoverable(con, shout))
         return SHOUT_RS_NOTNOW;
 
     if (rc > 0) {
@@ -348,7 +979,9 @@ static shout_connection_return_state_t shout_connection_iter__message(shout_conn
         break;
         case SHOUT_MSGSTATE_SENDING1:
             if (con->wqueue.len) {
-                return shout_connection_iter__message__send_queue(con, shout);
+                ret = shout_connection_iter__message__send_queue(con, shout);
+                shout_connection__check_watermarks(con);
+                return ret;
             } else {
                 shout_connection_set_error(con, SHOUTERR_SUCCESS);
                 return SHOUT_RS_ERROR;
@@ -438,22 +1071,87 @@ static shout_connection_return_state_t shout_connection_iter__protocol(shout_con
     return ret;
 }
 
-int                 shout_connection_iter(shout_connection_t *con, shout_t *shout)
+static shout_connection_phase_t shout_connection__phase(shout_connection_t *con)
 {
-    int found;
-    int retry;
+    if (con->current_socket_state != con->target_socket_state) {
+        if (con->current_socket_state >= SHOUT_SOCKSTATE_CONNECTED)
+            return SHOUT_PHASE_TLS;
+        return SHOUT_PHASE_CONNECTING;
+    }
 
-    if (!con || !shout)
-        return SHOUTERR_INSANE;
+    if (con->current_message_state == SHOUT_MSGSTATE_SENDING1)
+        return SHOUT_PHASE_STREAMING;
 
-    if (con->socket == SOCK_ERROR)
-        return SHOUTERR_NOCONNECT;
+    return SHOUT_PHASE_HANDSHAKE;
+}
+
+/* Timestamps state transitions and folds the time spent in each setup
+ * phase into the process wide latency histograms. */
+static void shout_connection__track(shout_connection_t *con)
+{
+    uint64_t now;
+
+    if (con->tracked_socket_state == con->current_socket_state &&
+        con->tracked_message_state == con->current_message_state)
+        return;
+
+    now = timing_get_time();
+
+    if (con->tracked_socket_state != con->current_socket_state) {
+        if (con->tracked_socket_state < SHOUT_SOCKSTATE_CONNECTED &&
+            con->current_socket_state >= SHOUT_SOCKSTATE_CONNECTED && con->latency_connect)
+            shout_latency_record(SHOUT_LATENCY_CONNECT, now - con->latency_connect);
+        if (con->current_socket_state == SHOUT_SOCKSTATE_TLS_CONNECTING)
+            con->latency_tls = now;
+        if (con->current_socket_state == SHOUT_SOCKSTATE_TLS_VERIFIED && con->latency_tls) {
+            shout_latency_record(SHOUT_LATENCY_TLS, now - con->latency_tls);
+            con->latency_tls = 0;
+        }
+        /* a later upgrade to TLS is part of the protocol handshake */
+        if (con->current_socket_state == con->target_socket_state && !con->latency_handshake)
+            con->latency_handshake = now;
+        con->tracked_socket_state = con->current_socket_state;
+    }
+
+    if (con->tracked_message_state != con->current_message_state) {
+        switch (con->current_message_state) {
+            case SHOUT_MSGSTATE_SENDING0:
+                con->latency_request = now;
+            break;
+            case SHOUT_MSGSTATE_RECEIVED0:
+            case SHOUT_MSGSTATE_RECEIVED1:
+                if (con->latency_request) {
+                    shout_latency_record(SHOUT_LATENCY_REQUEST, now - con->latency_request);
+                    con->latency_request = 0;
+                }
+            break;
+            case SHOUT_MSGSTATE_SENDING1:
+                /* only the first time, later rounds are not part of the setup */
+                if (con->latency_handshake && !con->latency_done) {
+                    shout_latency_record(SHOUT_LATENCY_HANDSHAKE, now - con->latency_handshake);
+                    if (con->latency_connect)
+                        shout_latency_record(SHOUT_LATENCY_TOTAL, now - con->latency_connect);
+                    con->latency_done = 1;
+                }
+            break;
+            default:
+            break;
+        }
+        con->tracked_message_state = con->current_message_state;
+    }
+}
+
+static int shout_connection_iter__run(shout_connection_t *con, shout_t *shout)
+{
+    int found;
+    int retry;
 
 
 #define __iter(what) \
     while (!retry && con->target_ ## what ## _state != con->current_ ## what ## _state) { \
         found = 1; \
         shout_connection_return_state_t ret = shout_connection_iter__ ## what (con, shout); \
+        shout_connection__track(con); \
         switch (ret) { \
             case SHOUT_RS_DONE: \
                 continue; \
@@ -481,6 +1179,32 @@ int                 shout_connection_iter(shout_connection_t *con, shout_t *shou
     return SHOUTERR_SUCCESS;
 }
 
+int                 shout_connection_iter(shout_connection_t *con, shout_t *shout)
+{
+    uint64_t now;
+    int ret;
+
+    if (!con || !shout)
+        return SHOUTERR_INSANE;
+
+    if (con->socket == SOCK_ERROR &&
+        con->current_socket_state != SHOUT_SOCKSTATE_RESOLVING &&
+        con->current_socket_state != SHOUT_SOCKSTATE_RACING)
+        return SHOUTERR_NOCONNECT;
+
+    ret = shout_connection_iter__run(con, shout);
+
+    /* The time since the last call is accounted to the phase the
+     * connection was left in, including the time spent in this call. */
+    now = timing_get_time();
+    if (con->phase_since)
+        con->phase_time[con->phase] += now - con->phase_since;
+    con->phase_since = now;
+    con->phase = shout_connection__phase(con);
+
+    return ret;
+}
+
 int                 shout_connection_select_tlsmode(shout_connection_t *con, int tlsmode)
 {
     if (!con)
@@ -555,7 +1279,8 @@ int                 shout_connection_get_wait_timeout_happened(shout_connection_
 
 int                 shout_connection_connect(shout_connection_t *con, shout_t *shout)
 {
-    int port;
+    shout_dns_result_t *result;
+    int ret;
 
     if (!con || !shout)
         return SHOUTERR_INSANE;
@@ -566,41 +1291,59 @@ int                 shout_connection_connect(shout_connection_t *con, shout_t *s
     if (con->nonblocking != SHOUT_BLOCKING_DEFAULT)
         shout_connection_set_nonblocking(con, shout_get_nonblocking(shout));
 
-    port = shout->port;
-    if (con->impl == shout_icy_impl)
-        port++;
+    con->latency_connect = timing_get_time();
 
     if (con->nonblocking == SHOUT_BLOCKING_NONE) {
-        con->socket = sock_connect_non_blocking(shout->host, port);
+        /* do not block on the resolver, unless the name is cached */
+        con->dns = shout_dns_request_new(shout->host);
+        if (!con->dns)
+            return SHOUTERR_MALLOC;
+
+        ret = shout_dns_request_get_result(con->dns, &result);
+        if (ret == SHOUTERR_BUSY) {
+            con->current_socket_state = SHOUT_SOCKSTATE_RESOLVING;
+            con->target_socket_state = SHOUT_SOCKSTATE_CONNECTED;
+            return SHOUTERR_SUCCESS;
+        }
+
+        shout_dns_request_free(con->dns);
+        con->dns = NULL;
     } else {
-        con->socket = sock_connect(shout->host, port);
+        ret = shout_dns_lookup(shout->host, &result);
     }
 
-    if (con->socket < 0) {
-        con->socket = SOCK_ERROR;
+    if (ret != SHOUTERR_SUCCESS)
         return SHOUTERR_NOCONNECT;
-    }
-
-    con->current_socket_state = SHOUT_SOCKSTATE_CONNECTING;
-    con->target_socket_state = SHOUT_SOCKSTATE_CONNECTED;
-    if (con->target_message_state != SHOUT_MSGSTATE_IDLE)
-        con->current_message_state = SHOUT_MSGSTATE_CREATING0;
 
-    if (con->selected_tls_mode == SHOUT_TLS_RFC2818)
-        return shout_connection_starttls(con, shout);
+    ret = shout_connection_connect__addr(con, shout, result);
+    shout_dns_result_unref(result);
 
-    return SHOUTERR_SUCCESS;
+    return ret;
 }
+
 int                 shout_connection_disconnect(shout_connection_t *con)
 {
     if (!con)
         return SHOUTERR_INSANE;
 
+    if (con->dns)
+        shout_dns_request_free(con->dns);
+    con->dns = NULL;
+    shout_connection_race__stop(con, SOCK_ERROR);
+
+#ifdef HAVE_LIBURING
+    /* the kernel must be done with the socket and the pages first */
+    if (con->uring)
+        shout_uring_cancel(con);
+    con->uring_error = SHOUTERR_SUCCESS;
+#endif
+
 #ifdef HAVE_OPENSSL
     if (con->tls)
         shout_tls_close(con->tls);
     con->tls = NULL;
 #endif
+    con->transport = shout_transport_socket;
 
     if (con->socket != SOCK_ERROR)
         sock_close(con->socket);
@@ -611,8 +1354,200 @@ int                 shout_connection_disconnect(shout_connection_t *con)
 
     return SHOUTERR_SUCCESS;
 }
+/* True if len bytes may be written from the caller's buffer. A blocked
+ * SSL_write() must be retried with at least the same length, which the queue
+ * pages that would hold the rest can not guarantee. So TLS writes always go
+ * through the queue, unless the kernel does the encryption. Large writes with
+ * MSG_ZEROCOPY go through the queue as well, as the kernel may still read the
+ * pages after the call returned.
+ */
+static int shout_connection_send__direct(shout_connection_t *con, size_t len)
+{
+#if defined(HAVE_SYS_UIO_H) && defined(SHOUT_HAVE_ZEROCOPY)
+    /* the flush only reaps while there is something to write */
+    if (con->wqueue.inflight && !con->wqueue.len)
+        shout_connection_zerocopy_reap(con);
+
+    /* also when only wanted, the flush turns it on */
+    if (con->zerocopy != SHOUT_ZEROCOPY_OFF && len >= SHOUT_ZEROCOPY_MIN)
+        return 0;
+#endif
+
+    if (con->wqueue.len || con->error == SHOUTERR_SOCKET)
+        return 0;
+
+#ifdef HAVE_OPENSSL
+    if (con->transport == shout_transport_tls)
+        return 0;
+#endif
+
+    return 1;
+}
+
+/* Writes data straight away if nothing is pending and queues the rest. */
+static int shout_connection_send__emit(shout_connection_t *con, shout_t *shout, const unsigned char *data, size_t len)
+{
+    ssize_t written = 0;
+    int ret;
+
+    if (!len)
+        return SHOUTERR_SUCCESS;
+
+    if (shout_connection_send__direct(con, len)) {
+        /* Nothing is pending, so try to write straight from the caller's
+         * buffer and only queue what the socket did not take. */
+        written = try_write(con, shout, data, len);
+        if (written < 0) {
+            /* queue it anyway, shout_connection_salvage() may still want it */
+            written = 0;
+        } else {
+            con->direct_bytes += written;
+        }
+    }
+
+    if ((size_t)written < len) {
+        ret = shout_queue_data(&(con->wqueue), data + written, len - written);
+        if (ret != SHOUTERR_SUCCESS) {
+            shout_connection_set_error(con, ret);
+            return ret;
+        }
+        con->bytes_queued += len - written;
+        if (con->wqueue.len > con->queue_peak)
+            con->queue_peak = con->wqueue.len;
+    }
+
+    con->queue_offset += len;
+
+    return SHOUTERR_SUCCESS;
+}
+
+static inline shout_frame_t *shout_connection__frame(shout_connection_t *con, size_t index)
+{
+    return &(con->frames[(con->frames_head + index) & (con->frames_size - 1)]);
+}
+
+/* Forgets about frames that have been fully written or dropped. */
+static void shout_connection__frames_update(shout_connection_t *con)
+{
+    uint64_t head = con->queue_offset - con->wqueue.len;
+    shout_frame_t *frame;
+    uint64_t end;
+    int have_end;
+
+    while (con->frames_passed) {
+        frame = shout_connection__frame(con, 0);
+        have_end = con->frames_passed > 1;
+        end = have_end ? shout_connection__frame(con, 1)->offset : con->queue_offset;
+
+        /* still has data in the queue */
+        if (end > head)
+            break;
+
+        if (frame->accounted) {
+            con->queued_duration -= frame->duration;
+            frame->accounted = 0;
+        }
+
+        /* more data of the latest frame may still come in */
+        if (!have_end)
+            break;
+
+        con->frames_head = (con->frames_head + 1) & (con->frames_size - 1);
+        con->frames_len--;
+        con->frames_passed--;
+    }
+}
+
+static int shout_connection__queue_over_limit(shout_connection_t *con)
+{
+    if (!con->queue_limit)
+        return 0;
+
+    if (con->queue_limit_unit == SHOUT_QUEUE_UNIT_MS)
+        return con->queued_duration >= (uint64_t)con->queue_limit * 1000;
+
+    return con->wqueue.len >= con->queue_limit;
+}
+
+/* Cuts the oldest droppable frame no byte of which has been written yet.
+ * Returns true if a frame was dropped.
+ */
+static int shout_connection__drop_oldest(shout_connection_t *con)
+{
+    uint64_t head = con->queue_offset - con->wqueue.len;
+    /* never touch the page currently being written, TLS may retry it */
+    uint64_t first = head + (con->wqueue.head ? con->wqueue.head->len - con->wqueue.head->pos : 0);
+    shout_frame_t *frame;
+    uint64_t len;
+    size_t i, j;
+
+    /* the latest passed frame is skipped as its end is not yet known */
+    for (i = 0; i + 1 < con->frames_passed; i++) {
+        frame = shout_connection__frame(con, i);
+        if (frame->state != SHOUT_FRAME_QUEUED || !frame->droppable || frame->offset < first)
+            continue;
+
+        len = shout_connection__frame(con, i + 1)->offset - frame->offset;
+        if (!len || shout_queue_cut(&(con->wqueue), frame->offset - head, len) != SHOUTERR_SUCCESS)
+            continue;
+
+        for (j = i + 1; j < con->frames_passed; j++)
+            shout_connection__frame(con, j)->offset -= len;
+        con->queue_offset -= len;
+
+        frame->state = SHOUT_FRAME_DROPPED;
+        if (frame->accounted) {
+            con->queued_duration -= frame->duration;
+            frame->accounted = 0;
+        }
+
+        con->dropped_bytes += len;
+        con->dropped_frames++;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Called once the data passed to shout_connection_send() reaches the
+ * start of the oldest pending frame. Decides whether it is queued or dropped.
+ */
+static void shout_connection__frame_arrive(shout_connection_t *con)
+{
+    shout_frame_t *frame = shout_connection__frame(con, con->frames_passed);
+    int over;
+
+    shout_connection__frames_update(con);
+
+    over = shout_connection__queue_over_limit(con);
+    if (over && con->queue_limit_policy == SHOUT_QUEUE_POLICY_DROP_OLDEST) {
+        while ((over = shout_connection__queue_over_limit(con)) && shout_connection__drop_oldest(con));
+    }
+
+    con->frames_passed++;
+    frame->offset = con->queue_offset;
+
+    if (over && con->queue_limit_policy == SHOUT_QUEUE_POLICY_DROP_NEWEST && frame->droppable) {
+        frame->state = SHOUT_FRAME_DROPPED;
+        con->frames_dropping = 1;
+        con->dropped_frames++;
+        return;
+    }
+
+    frame->state = SHOUT_FRAME_QUEUED;
+    frame->accounted = 1;
+    con->queued_duration += frame->duration;
+    con->frames_dropping = 0;
+}
+
 ssize_t             shout_connection_send(shout_connection_t *con, shout_t *shout, const void *buf, size_t len)
 {
+    const unsigned char *data = buf;
+    shout_frame_t *frame;
+    size_t pos = 0;
+    size_t run = 0;
+    size_t end;
     int ret;
 
     if (!con || !shout)
@@ -624,15 +1559,290 @@ ssize_t             shout_connection_send(shout_connection_t *con, shout_t *shou
     if (con->error == SHOUTERR_SOCKET)
         return -1;
 
-    ret = shout_queue_data(&(con->wqueue), buf, len);
+    /* Walk the frames starting within this data. Data of dropped frames
+     * is skipped, everything else is sent in as few runs as possible.
+     */
+    while (pos < len) {
+        frame = NULL;
+        end = len;
+        if (con->frames_passed < con->frames_len) {
+            frame = shout_connection__frame(con, con->frames_passed);
+            if (frame->offset < con->stream_offset + pos) {
+                /* marked for data this connection never got, the marks
+                 * left can not be trusted either */
+                con->frames_len = con->frames_passed;
+                frame = NULL;
+            } else if (frame->offset < con->stream_offset + len) {
+                end = frame->offset - con->stream_offset;
+            } else {
+                frame = NULL;
+            }
+        }
+
+        if (con->frames_dropping)
+            con->dropped_bytes += end - pos;
+        pos = end;
+
+        if (!frame)
+            break;
+
+        /* the queue must be up to date before deciding about the frame */
+        if (!con->frames_dropping) {
+            ret = shout_connection_send__emit(con, shout, data + run, pos - run);
+            if (ret != SHOUTERR_SUCCESS)
+                return -1;
+        }
+
+        shout_connection__frame_arrive(con);
+        run = pos;
+    }
+
+    if (!con->frames_dropping) {
+        ret = shout_connection_send__emit(con, shout, data + run, len - run);
+        if (ret != SHOUTERR_SUCCESS)
+            return -1;
+    }
+
+    con->stream_offset += len;
+
+    if (con->frames_passed)
+        shout_connection__frames_update(con);
+
+    if (con->error == SHOUTERR_SOCKET)
+        return -1;
+
+    if (con->wqueue.len) {
+        shout_connection_iter(con, shout);
+    } else {
+        shout_connection__check_watermarks(con);
+    }
+
+    return len;
+}
+
+int                 shout_connection_send_ref(shout_connection_t *con, shout_t *shout, const void *buf, size_t len, shout_release_t release, void *userdata)
+{
+    const unsigned char *data = buf;
+    ssize_t written;
+    int ret;
+
+    /* on SHOUTERR_SOCKET the buffer stays with the caller, who may still
+     * keep a copy for a reconnect. On other errors it has been released */
+    if (!con || !shout) {
+        if (release)
+            release(userdata);
+        return SHOUTERR_INSANE;
+    }
+
+    if (con->current_message_state != SHOUT_MSGSTATE_SENDING1) {
+        if (release)
+            release(userdata);
+        return SHOUTERR_UNCONNECTED;
+    }
+
+    if (con->error == SHOUTERR_SOCKET)
+        return SHOUTERR_SOCKET;
+
+    if (shout_connection_send__direct(con, len)) {
+        written = try_write(con, shout, data, len);
+        if (written < 0)
+            return SHOUTERR_SOCKET;
+        con->direct_bytes += written;
+        data += written;
+        if ((size_t)written == len) {
+            con->stream_offset += len;
+            con->queue_offset += len;
+            if (release)
+                release(userdata);
+            return SHOUTERR_SUCCESS;
+        }
+    }
+
+    ret = shout_queue_ref(&(con->wqueue), data, len - (data - (const unsigned char*)buf), release, userdata);
     if (ret != SHOUTERR_SUCCESS) {
         shout_connection_set_error(con, ret);
-        return -1;
+        return ret;
     }
 
+    con->bytes_queued += len - (data - (const unsigned char*)buf);
+    if (con->wqueue.len > con->queue_peak)
+        con->queue_peak = con->wqueue.len;
+
+    con->stream_offset += len;
+    con->queue_offset += len;
+
     shout_connection_iter(con, shout);
 
-    return len;
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_set_queue_limit(shout_connection_t *con, size_t limit, unsigned int unit, unsigned int policy)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    con->queue_limit = limit;
+    con->queue_limit_unit = unit;
+    con->queue_limit_policy = policy;
+
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_get_stats(shout_connection_t *con, shout_stats_t *stats)
+{
+    if (!con || !stats)
+        return SHOUTERR_INSANE;
+
+    stats->bytes_queued = con->bytes_queued;
+    stats->bytes_written = con->bytes_written;
+    stats->bytes_direct = con->direct_bytes;
+    stats->bytes_dropped = con->dropped_bytes;
+    stats->frames_dropped = con->dropped_frames;
+    stats->write_calls = con->write_calls;
+    stats->write_busy = con->write_busy;
+    stats->queue_len = con->wqueue.len;
+    stats->queue_peak = con->queue_peak;
+    stats->wait_time = con->wait_time;
+    stats->time_connecting = con->phase_time[SHOUT_PHASE_CONNECTING];
+    stats->time_tls = con->phase_time[SHOUT_PHASE_TLS];
+    stats->time_handshake = con->phase_time[SHOUT_PHASE_HANDSHAKE];
+    stats->time_streaming = con->phase_time[SHOUT_PHASE_STREAMING];
+
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_set_queue_watermarks(shout_connection_t *con, size_t high, size_t low)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    con->queue_high = high;
+    con->queue_low = low;
+    con->queue_above_high = 0;
+    shout_connection__check_watermarks(con);
+
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_queue_full(shout_connection_t *con)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    if (con->frames_passed)
+        shout_connection__frames_update(con);
+
+    return shout_connection__queue_over_limit(con);
+}
+
+/* Blocks until the write queue is below its limit, even in nonblocking mode. */
+int                 shout_connection_wait_queue(shout_connection_t *con, shout_t *shout)
+{
+    sock_t socket;
+    int events;
+    int timeout;
+    int ret;
+
+    if (!con || !shout)
+        return SHOUTERR_INSANE;
+
+    while (shout_connection_queue_full(con) > 0) {
+        ret = shout_connection_iter(con, shout);
+        if (ret != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY && ret != SHOUTERR_RETRY)
+            return ret;
+
+        if (shout_connection_queue_full(con) <= 0)
+            break;
+
+        /* never sleep on behalf of a caller that drives other connections too */
+        if (con->nonblocking == SHOUT_BLOCKING_NONE || con->io_external) {
+            shout_connection__check_watermarks(con);
+            return SHOUTERR_BUSY;
+        }
+
+        ret = shout_connection_get_pollinfo(con, shout, &socket, &events, &timeout);
+        if (ret != SHOUTERR_SUCCESS)
+            return ret;
+
+        if (events) {
+            if (shout_connection_iter__wait_for_io__backend(socket, events & SHOUT_IO_READ, events & SHOUT_IO_WRITE, 1000) == SHOUT_RS_ERROR)
+                return SHOUTERR_SOCKET;
+        }
+    }
+
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_mark_frame(shout_connection_t *con, size_t at, uint64_t duration, int droppable)
+{
+    shout_frame_t *frame;
+
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    /* frames are only tracked while a limit is set or for a reconnect */
+    if (!con->queue_limit && !con->salvage)
+        return SHOUTERR_SUCCESS;
+
+    /* while reconnecting the data goes to the reconnect buffer instead */
+    if (con->current_message_state != SHOUT_MSGSTATE_SENDING1)
+        return SHOUTERR_SUCCESS;
+
+    if (con->frames_len == con->frames_size) {
+        size_t size = con->frames_size ? con->frames_size * 2 : 64;
+        shout_frame_t *frames = malloc(size * sizeof(*frames));
+        size_t i;
+
+        if (!frames)
+            return SHOUTERR_MALLOC;
+
+        for (i = 0; i < con->frames_len; i++)
+            frames[i] = *shout_connection__frame(con, i);
+
+        free(con->frames);
+        con->frames = frames;
+        con->frames_size = size;
+        con->frames_head = 0;
+    }
+
+    frame = shout_connection__frame(con, con->frames_len++);
+    frame->state = SHOUT_FRAME_PENDING;
+    frame->offset = con->stream_offset + at;
+    frame->duration = duration;
+    frame->droppable = droppable;
+    frame->accounted = 0;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* Forgets the frames marked for data not sent yet. */
+int                 shout_connection_drop_pending_frames(shout_connection_t *con)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    con->frames_len = con->frames_passed;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* Adds to the duration of the latest frame, for formats that learn it late. */
+int                 shout_connection_extend_frame(shout_connection_t *con, uint64_t duration)
+{
+    shout_frame_t *frame;
+
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    if (!con->frames_len)
+        return SHOUTERR_SUCCESS;
+
+    frame = shout_connection__frame(con, con->frames_len - 1);
+    frame->duration += duration;
+    if (frame->accounted)
+        con->queued_duration += duration;
+
+    return SHOUTERR_SUCCESS;
 }
 
 ssize_t             shout_connection_get_sendq(shout_connection_t *con, shout_t *shout)
@@ -643,6 +1853,65 @@ ssize_t             shout_connection_get_sendq(shout_connection_t *con, shout_t
     return con->wqueue.len;
 }
 
+int                 shout_connection_set_salvage(shout_connection_t *con, int salvage)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    con->salvage = salvage;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* Copies the stream data not yet written to queue, for a reconnect.
+ * It starts at the first frame boundary so no partial frame is sent
+ * twice. Without frame marks nothing is copied, as there is no way to
+ * tell where the next frame starts: page boundaries are not frame
+ * boundaries either.
+ */
+int                 shout_connection_salvage(shout_connection_t *con, shout_queue_t *queue)
+{
+    uint64_t head;
+    uint64_t skip;
+    shout_buf_t *buf;
+    size_t avail;
+    size_t i;
+    int ret;
+
+    if (!con || !queue)
+        return SHOUTERR_INSANE;
+
+    if (!con->frames_passed)
+        return SHOUTERR_SUCCESS;
+
+    shout_connection__frames_update(con);
+    head = con->queue_offset - con->wqueue.len;
+
+    /* the frame being written, if any, is lost */
+    skip = con->wqueue.len;
+    for (i = 0; i < con->frames_passed; i++) {
+        if (shout_connection__frame(con, i)->offset >= head) {
+            skip = shout_connection__frame(con, i)->offset - head;
+            break;
+        }
+    }
+
+    for (buf = con->wqueue.head; buf; buf = buf->next) {
+        avail = buf->len - buf->pos;
+        if (skip >= avail) {
+            skip -= avail;
+            continue;
+        }
+
+        ret = shout_queue_data(queue, buf->data + buf->pos + skip, avail - skip);
+        if (ret != SHOUTERR_SUCCESS)
+            return ret;
+        skip = 0;
+    }
+
+    return SHOUTERR_SUCCESS;
+}
+
 int                 shout_connection_starttls(shout_connection_t *con, shout_t *shout)
 {
 #ifdef HAVE_OPENSSL
@@ -657,6 +1926,7 @@ int                 shout_connection_starttls(shout_connection_t *con, shout_t *
         return SHOUTERR_MALLOC;
 
     shout_tls_set_callback(con->tls, shout_cb_tls_callback, con);
+    con->transport = shout_transport_tls;
 
     con->target_socket_state = SHOUT_SOCKSTATE_TLS_VERIFIED;
 
@@ -731,6 +2001,49 @@ int                 shout_connection_control(shout_connection_t *con, shout_cont
             ret = SHOUTERR_UNSUPPORTED;
         break;
 #endif
+        case SHOUT_CONTROL_GET_DIRECT_WRITE_BYTES: {
+            uint64_t *bytes = va_arg(ap, uint64_t *);
+
+            if (bytes) {
+                *bytes = con->direct_bytes;
+                ret = SHOUTERR_SUCCESS;
+            } else {
+                ret = SHOUTERR_INSANE;
+            }
+        }
+        break;
+        case SHOUT_CONTROL_SET_ZEROCOPY:
+#ifdef SHOUT_HAVE_ZEROCOPY
+#ifdef SHOUT_HAVE_KTLS
+            if (con->transport == shout_transport_ktls) {
+                ret = SHOUTERR_UNSUPPORTED;
+                break;
+            }
+#endif
+            if (va_arg(ap, int)) {
+#ifdef HAVE_LIBURING
+                if (con->transport == shout_transport_uring) {
+                    shout_uring_cancel(con);
+                    con->transport = shout_transport_socket;
+                }
+#endif
+                if (con->zerocopy == SHOUT_ZEROCOPY_OFF)
+                    con->zerocopy = SHOUT_ZEROCOPY_WANTED;
+            } else {
+                /* completions of earlier sends are still reaped */
+                con->zerocopy = SHOUT_ZEROCOPY_OFF;
+            }
+            ret = SHOUTERR_SUCCESS;
+#else
+            ret = SHOUTERR_UNSUPPORTED;
+#endif
+        break;
+        case SHOUT_CONTROL_SET_KTLS:
+        case SHOUT_CONTROL_SET_STRIP_TAGS:
+        case SHOUT_CONTROL_GET_DURATION:
+            /* settings of the shout_t, see shout_control() */
+            ret = SHOUTERR_INSANE;
+        break;
         case SHOUT_CONTROL__MIN:
         case SHOUT_CONTROL__MAX:
             ret = SHOUTERR_INSANE;
@@ -752,3 +2065,163 @@ int                 shout_connection_set_callback(shout_connection_t *con, shout
 
     return SHOUTERR_SUCCESS;
 }
+
+int                 shout_connection_set_external_io(shout_connection_t *con, int external)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    con->io_external = external ? 1 : 0;
+    con->io_ready = 0;
+
+    return SHOUTERR_SUCCESS;
+}
+
+int                 shout_connection_set_io_ready(shout_connection_t *con, int events)
+{
+    if (!con || !con->io_external)
+        return SHOUTERR_INSANE;
+
+    con->io_ready = events;
+
+    return SHOUTERR_SUCCESS;
+}
+
+#ifdef HAVE_LIBURING
+/* Lets the connection submit to the ring of an event loop, or detaches
+ * it with uring NULL. Data whose send was cancelled stays in the queue
+ * for the socket transport.
+ */
+int                 shout_connection_set_uring(shout_connection_t *con, shout_uring_t *uring)
+{
+    if (!con)
+        return SHOUTERR_INSANE;
+
+    if (con->uring == uring)
+        return SHOUTERR_SUCCESS;
+
+    if (con->uring)
+        shout_uring_cancel(con);
+    con->uring = uring;
+
+    if (!uring) {
+        if (con->transport == shout_transport_uring)
+            con->transport = shout_transport_socket;
+    } else if (con->transport == shout_transport_socket && con->zerocopy == SHOUT_ZEROCOPY_OFF && !con->wqueue.inflight) {
+        con->transport = shout_transport_uring;
+    }
+
+    return SHOUTERR_SUCCESS;
+}
+#endif
+
+static inline void shout_connection_get_pollinfo__wait_timeout(shout_connection_t *con, int *timeout)
+{
+    uint64_t now;
+
+    if (!con->wait_timeout)
+        return;
+
+    now = timing_get_time();
+    if (now >= con->wait_timeout) {
+        *timeout = 0;
+    } else {
+        *timeout = con->wait_timeout - now;
+    }
+}
+
+/* Tells which events the state machine is waiting for.
+ * *timeout is 0 if the connection should be iterated right away
+ * and -1 if there is no timeout.
+ */
+int                 shout_connection_get_pollinfo(shout_connection_t *con, shout_t *shout, sock_t *socket, int *events, int *timeout)
+{
+    if (!con || !shout || !socket || !events || !timeout)
+        return SHOUTERR_INSANE;
+
+    *socket = con->socket;
+    *events = 0;
+    *timeout = -1;
+
+    if (con->current_socket_state == SHOUT_SOCKSTATE_RESOLVING) {
+        *socket = shout_dns_request_get_fd(con->dns);
+        if (*socket == SOCK_ERROR) {
+            *timeout = 0;
+        } else {
+            *events = SHOUT_IO_READ;
+        }
+        return SHOUTERR_SUCCESS;
+    }
+
+    if (con->current_socket_state == SHOUT_SOCKSTATE_RACING) {
+        *socket = shout_connection_race__socket(con);
+        *timeout = shout_connection_race__timeout(con);
+        if (*socket != SOCK_ERROR)
+            *events = SHOUT_IO_WRITE;
+        return SHOUTERR_SUCCESS;
+    }
+
+    if (con->socket == SOCK_ERROR)
+        return SHOUTERR_NOCONNECT;
+
+    if (con->target_socket_state != con->current_socket_state) {
+        switch (con->current_socket_state) {
+            case SHOUT_SOCKSTATE_CONNECTING:
+                *events = SHOUT_IO_WRITE;
+#ifdef HAVE_LIBURING
+                /* the completion of the connect wakes the loop up */
+                if (con->uring_connecting)
+                    *events = 0;
+#endif
+            break;
+#ifdef HAVE_OPENSSL
+            case SHOUT_SOCKSTATE_TLS_CONNECTING:
+            case SHOUT_SOCKSTATE_TLS_CONNECTED:
+                *events = shout_tls_get_want(con->tls);
+            break;
+#endif
+            default:
+                *timeout = 0;
+            break;
+        }
+        return SHOUTERR_SUCCESS;
+    }
+
+    if (con->target_message_state != con->current_message_state) {
+        switch (con->current_message_state) {
+            case SHOUT_MSGSTATE_SENDING0:
+                *events = SHOUT_IO_WRITE;
+#ifdef HAVE_LIBURING
+                /* so does the completion of the last send */
+                if (con->uring_sends)
+                    *events = 0;
+#endif
+            break;
+            case SHOUT_MSGSTATE_SENDING1:
+                /* nothing to do while there is nothing to send */
+                if (con->wqueue.len)
+                    *events = SHOUT_IO_WRITE;
+#ifdef HAVE_LIBURING
+                if (con->uring_sends)
+                    *events = 0;
+#endif
+            break;
+            case SHOUT_MSGSTATE_WAITING0:
+            case SHOUT_MSGSTATE_WAITING1:
+            case SHOUT_MSGSTATE_RECEIVING0:
+            case SHOUT_MSGSTATE_RECEIVING1:
+                *events = SHOUT_IO_READ;
+                shout_connection_get_pollinfo__wait_timeout(con, timeout);
+            break;
+            default:
+                *timeout = 0;
+            break;
+        }
+        return SHOUTERR_SUCCESS;
+    }
+
+    if (con->target_protocol_state != con->current_protocol_state)
+        *timeout = 0;
+
+    return SHOUTERR_SUCCESS;
+}
@@ -0,0 +1,611 @@
+/* -*- c-basic-offset: 8; -*- */
+/* dns.c: asynchronous and cached name resolution
+ *
+ *  Copyright (C) 2026 the Icecast team <team@icecast.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this library; if not, write to the Free
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#   include <winsock2.h>
+#   include <ws2tcpip.h>
+#else
+#   include <sys/types.h>
+#   include <sys/socket.h>
+#   include <netdb.h>
+#   include <unistd.h>
+#   include <fcntl.h>
+#endif
+
+#if !defined(NO_THREAD) && !defined(_WIN32)
+#   include <pthread.h>
+#   define SHOUT_DNS_ASYNC
+#endif
+
+#include <shout/shout.h>
+#include "shout_private.h"
+
+/* getaddrinfo() does not tell the TTL of the records, so use a fixed one */
+#define SHOUT_DNS_TTL           (60*1000) /* [ms] */
+#define SHOUT_DNS_CACHE_MAX     64
+/* lookups beyond this many wait in the queue */
+#define SHOUT_DNS_WORKERS       4
+
+typedef struct shout_dns_cache_tag shout_dns_cache_t;
+struct shout_dns_cache_tag {
+    char                *host;
+    shout_dns_result_t  *result;
+    uint64_t             expires;
+    shout_dns_cache_t   *next;
+};
+
+#ifdef SHOUT_DNS_ASYNC
+typedef struct shout_dns_lookup_tag shout_dns_lookup_t;
+#endif
+
+struct shout_dns_request_tag {
+    shout_dns_result_t  *result;
+    int                  error;
+    int                  done;
+#ifdef SHOUT_DNS_ASYNC
+    int                  pipe[2];
+    /* the lookup this request waits for, NULL once done */
+    shout_dns_lookup_t  *lookup;
+    shout_dns_request_t *next;
+#endif
+};
+
+#ifdef SHOUT_DNS_ASYNC
+/* A lookup queued or running for a host. All the requests for the host
+ * wait for the same lookup.
+ */
+struct shout_dns_lookup_tag {
+    char                *host;
+    int                  running;
+    shout_dns_request_t *waiters;
+    shout_dns_lookup_t  *next;
+};
+#endif
+
+static shout_dns_cache_t   *shout_dns_cache;
+static size_t               shout_dns_cache_len;
+static shout_dns_resolver_t shout_dns_resolver;
+/* also the mutex of shout_dns_cond */
+static _shout_util_mutex_t  shout_dns_lock = _SHOUT_UTIL_MUTEX_INITIALIZER;
+#ifdef SHOUT_DNS_ASYNC
+static pthread_cond_t       shout_dns_cond = PTHREAD_COND_INITIALIZER;
+static shout_dns_lookup_t  *shout_dns_pending;
+static pthread_t            shout_dns_worker_thread[SHOUT_DNS_WORKERS];
+static size_t               shout_dns_workers;
+static size_t               shout_dns_idle;
+static int                  shout_dns_stopping;
+#endif
+
+void shout_dns_result_ref(shout_dns_result_t *result)
+{
+    _shout_util_mutex_lock(&shout_dns_lock);
+    result->refc++;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+}
+
+void shout_dns_result_unref(shout_dns_result_t *result)
+{
+    int refc;
+
+    if (!result)
+        return;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    refc = --result->refc;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    if (!refc)
+        free(result);
+}
+
+/* Reorders the addresses so the families alternate, keeping the order
+ * within each family (RFC 8305, section 4). This way a connection race
+ * tries the other family second if the preferred one is broken.
+ */
+static void shout_dns_interleave(shout_dns_result_t *result)
+{
+    shout_dns_addr_t tmp;
+    size_t i;
+    size_t j;
+
+    for (i = 1; i < result->count; i++) {
+        if (result->addr[i].family != result->addr[i - 1].family)
+            continue;
+
+        for (j = i + 1; j < result->count && result->addr[j].family == result->addr[i - 1].family; j++);
+        if (j == result->count)
+            return;
+
+        tmp = result->addr[j];
+        memmove(&(result->addr[i + 1]), &(result->addr[i]), (j - i) * sizeof(result->addr[0]));
+        result->addr[i] = tmp;
+    }
+}
+
+/* Resolves host, blocking the caller. */
+static int shout_dns_resolve(const char *host, int flags, shout_dns_result_t **result)
+{
+    struct addrinfo     hints;
+    struct addrinfo    *head;
+    struct addrinfo    *ai;
+    shout_dns_result_t *res;
+    shout_dns_resolver_t resolver;
+    size_t              count = 0;
+
+    if (!(flags & AI_NUMERICHOST)) {
+        _shout_util_mutex_lock(&shout_dns_lock);
+        resolver = shout_dns_resolver;
+        _shout_util_mutex_unlock(&shout_dns_lock);
+        if (resolver)
+            return resolver(host, result);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    if (getaddrinfo(host, NULL, &hints, &head) != 0)
+        return SHOUTERR_NOCONNECT;
+
+    for (ai = head; ai; ai = ai->ai_next)
+        count++;
+
+    res = calloc(1, sizeof(*res) + count * sizeof(res->addr[0]));
+    if (!res) {
+        freeaddrinfo(head);
+        return SHOUTERR_MALLOC;
+    }
+
+    res->refc = 1;
+    for (ai = head; ai; ai = ai->ai_next) {
+        if (getnameinfo(ai->ai_addr, ai->ai_addrlen, res->addr[res->count].host, sizeof(res->addr[0].host), NULL, 0, NI_NUMERICHOST) != 0)
+            continue;
+        res->addr[res->count].family = ai->ai_family;
+        res->count++;
+    }
+    freeaddrinfo(head);
+
+    if (!res->count) {
+        free(res);
+        return SHOUTERR_NOCONNECT;
+    }
+
+    shout_dns_interleave(res);
+
+    *result = res;
+    return SHOUTERR_SUCCESS;
+}
+
+/* Returns a new reference to a cached result for host, if any. */
+static shout_dns_result_t *shout_dns_cache_get(const char *host)
+{
+    shout_dns_cache_t **next;
+    shout_dns_cache_t *entry;
+    shout_dns_result_t *result = NULL;
+    uint64_t now = timing_get_time();
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    for (next = &shout_dns_cache; (entry = *next); ) {
+        if (entry->expires <= now) {
+            *next = entry->next;
+            shout_dns_cache_len--;
+            /* can not call shout_dns_result_unref() with the lock held */
+            if (!--entry->result->refc)
+                free(entry->result);
+            free(entry->host);
+            free(entry);
+            continue;
+        }
+        if (strcmp(entry->host, host) == 0) {
+            result = entry->result;
+            result->refc++;
+            break;
+        }
+        next = &(entry->next);
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    return result;
+}
+
+static void shout_dns_cache_put(const char *host, shout_dns_result_t *result)
+{
+    shout_dns_cache_t *entry;
+    shout_dns_cache_t **next;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return;
+    entry->host = strdup(host);
+    if (!entry->host) {
+        free(entry);
+        return;
+    }
+    entry->result = result;
+    entry->expires = timing_get_time() + SHOUT_DNS_TTL;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    result->refc++;
+    entry->next = shout_dns_cache;
+    shout_dns_cache = entry;
+    shout_dns_cache_len++;
+
+    /* drop the oldest entry, which is the last one */
+    if (shout_dns_cache_len > SHOUT_DNS_CACHE_MAX) {
+        for (next = &shout_dns_cache; (*next)->next; next = &((*next)->next)) ;
+        entry = *next;
+        *next = NULL;
+        shout_dns_cache_len--;
+    } else {
+        entry = NULL;
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    if (entry) {
+        shout_dns_result_unref(entry->result);
+        free(entry->host);
+        free(entry);
+    }
+}
+
+/* Resolves host using the cache, blocking the caller on a miss. */
+int shout_dns_lookup(const char *host, shout_dns_result_t **result)
+{
+    int ret;
+
+    if (!host || !result)
+        return SHOUTERR_INSANE;
+
+    /* numeric addresses never block, there is no point in caching them */
+    if (shout_dns_resolve(host, AI_NUMERICHOST, result) == SHOUTERR_SUCCESS)
+        return SHOUTERR_SUCCESS;
+
+    *result = shout_dns_cache_get(host);
+    if (*result)
+        return SHOUTERR_SUCCESS;
+
+    ret = shout_dns_resolve(host, 0, result);
+    if (ret == SHOUTERR_SUCCESS)
+        shout_dns_cache_put(host, *result);
+
+    return ret;
+}
+
+#ifdef SHOUT_DNS_ASYNC
+/* Detaches req from its lookup and wakes it up, called with the lock held. */
+static void shout_dns_request_finish(shout_dns_request_t *req, shout_dns_result_t *result, int error)
+{
+    if (result)
+        result->refc++;
+    req->result = result;
+    req->error = error;
+    req->done = 1;
+    req->lookup = NULL;
+
+    /* wake up whoever polls the request */
+    if (write(req->pipe[1], "", 1) < 0) {
+        /* nothing we can do, the result is checked on every iteration anyway */
+    }
+}
+
+/* Hands the outcome of a lookup to all the requests waiting for it and
+ * frees the lookup, called with the lock held.
+ */
+static void shout_dns_lookup_finish(shout_dns_lookup_t *lookup, shout_dns_result_t *result, int error)
+{
+    shout_dns_lookup_t **next;
+    shout_dns_request_t *req;
+
+    for (next = &shout_dns_pending; *next != lookup; next = &((*next)->next));
+    *next = lookup->next;
+
+    while ((req = lookup->waiters)) {
+        lookup->waiters = req->next;
+        shout_dns_request_finish(req, result, error);
+    }
+
+    free(lookup->host);
+    free(lookup);
+}
+
+static void *shout_dns_worker(void *arg)
+{
+    shout_dns_lookup_t *lookup;
+    shout_dns_result_t *result;
+    int error;
+
+    (void)arg;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    while (1) {
+        for (lookup = shout_dns_pending; lookup && lookup->running; lookup = lookup->next);
+
+        if (!lookup) {
+            if (shout_dns_stopping)
+                break;
+            shout_dns_idle++;
+            pthread_cond_wait(&shout_dns_cond, &shout_dns_lock);
+            shout_dns_idle--;
+            continue;
+        }
+
+        /* the lookup stays on the list so new requests for the host join it */
+        lookup->running = 1;
+        _shout_util_mutex_unlock(&shout_dns_lock);
+
+        result = NULL;
+        error = shout_dns_resolve(lookup->host, 0, &result);
+        if (error == SHOUTERR_SUCCESS)
+            shout_dns_cache_put(lookup->host, result);
+
+        _shout_util_mutex_lock(&shout_dns_lock);
+        shout_dns_lookup_finish(lookup, result, error);
+        /* the waiters and the cache hold their own references */
+        if (result && !--result->refc)
+            free(result);
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    return NULL;
+}
+
+/* Queues a lookup for host, called with the lock held. A worker is started
+ * unless one is idle or there are SHOUT_DNS_WORKERS already.
+ */
+static shout_dns_lookup_t *shout_dns_lookup_queue(const char *host)
+{
+    shout_dns_lookup_t *lookup;
+    shout_dns_lookup_t **next;
+
+    if (shout_dns_stopping)
+        return NULL;
+
+    if (!shout_dns_idle && shout_dns_workers < SHOUT_DNS_WORKERS) {
+        if (pthread_create(&(shout_dns_worker_thread[shout_dns_workers]), NULL, shout_dns_worker, NULL) == 0)
+            shout_dns_workers++;
+    }
+
+    if (!shout_dns_workers)
+        return NULL;
+
+    lookup = calloc(1, sizeof(*lookup));
+    if (!lookup)
+        return NULL;
+    lookup->host = strdup(host);
+    if (!lookup->host) {
+        free(lookup);
+        return NULL;
+    }
+
+    /* first come, first served */
+    for (next = &shout_dns_pending; *next; next = &((*next)->next));
+    *next = lookup;
+
+    pthread_cond_signal(&shout_dns_cond);
+
+    return lookup;
+}
+#endif
+
+/* Starts resolving host. The result is ready right away for numeric and
+ * cached names. Otherwise the request joins the lookup already running for
+ * the host, or a new one is queued for the workers.
+ */
+shout_dns_request_t *shout_dns_request_new(const char *host)
+{
+    shout_dns_request_t *req;
+#ifdef SHOUT_DNS_ASYNC
+    shout_dns_lookup_t *lookup;
+#endif
+
+    if (!host)
+        return NULL;
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return NULL;
+
+#ifdef SHOUT_DNS_ASYNC
+    req->pipe[0] = -1;
+    req->pipe[1] = -1;
+#endif
+
+    if (shout_dns_resolve(host, AI_NUMERICHOST, &(req->result)) == SHOUTERR_SUCCESS ||
+        (req->result = shout_dns_cache_get(host))) {
+        req->done = 1;
+        return req;
+    }
+
+#ifdef SHOUT_DNS_ASYNC
+    if (pipe(req->pipe) != 0) {
+        shout_dns_request_free(req);
+        return NULL;
+    }
+    fcntl(req->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(req->pipe[1], F_SETFD, FD_CLOEXEC);
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    for (lookup = shout_dns_pending; lookup; lookup = lookup->next) {
+        if (strcmp(lookup->host, host) == 0)
+            break;
+    }
+    if (!lookup)
+        lookup = shout_dns_lookup_queue(host);
+    if (lookup) {
+        req->lookup = lookup;
+        req->next = lookup->waiters;
+        lookup->waiters = req;
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    if (lookup)
+        return req;
+
+    /* no worker, resolve here */
+#endif
+
+    req->error = shout_dns_resolve(host, 0, &(req->result));
+    if (req->error == SHOUTERR_SUCCESS)
+        shout_dns_cache_put(host, req->result);
+    req->done = 1;
+
+    return req;
+}
+
+/* Abandons the request. A lookup nobody waits for any more is dropped
+ * unless it is running already, then it still finishes and fills the cache.
+ */
+void shout_dns_request_free(shout_dns_request_t *req)
+{
+#ifdef SHOUT_DNS_ASYNC
+    shout_dns_request_t **next;
+    shout_dns_lookup_t *lookup;
+#endif
+
+    if (!req)
+        return;
+
+#ifdef SHOUT_DNS_ASYNC
+    _shout_util_mutex_lock(&shout_dns_lock);
+    lookup = req->lookup;
+    if (lookup) {
+        for (next = &(lookup->waiters); *next != req; next = &((*next)->next));
+        *next = req->next;
+        if (!lookup->waiters && !lookup->running)
+            shout_dns_lookup_finish(lookup, NULL, SHOUTERR_NOCONNECT);
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    if (req->pipe[0] != -1)
+        close(req->pipe[0]);
+    if (req->pipe[1] != -1)
+        close(req->pipe[1]);
+#endif
+    shout_dns_result_unref(req->result);
+    free(req);
+}
+
+/* Returns the descriptor that becomes readable once the result is ready,
+ * or SOCK_ERROR if it is ready already.
+ */
+sock_t shout_dns_request_get_fd(shout_dns_request_t *req)
+{
+#ifdef SHOUT_DNS_ASYNC
+    int done;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    done = req->done;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    if (!done)
+        return req->pipe[0];
+#endif
+    (void)req;
+
+    return SOCK_ERROR;
+}
+
+/* Returns SHOUTERR_BUSY while the lookup is still running. On success
+ * result is set to a new reference to the addresses found.
+ */
+int shout_dns_request_get_result(shout_dns_request_t *req, shout_dns_result_t **result)
+{
+    int ret;
+
+    if (!req || !result)
+        return SHOUTERR_INSANE;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    if (!req->done) {
+        ret = SHOUTERR_BUSY;
+    } else if (req->result) {
+        req->result->refc++;
+        *result = req->result;
+        ret = SHOUTERR_SUCCESS;
+    } else {
+        ret = req->error;
+    }
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    return ret;
+}
+
+/* Replaces getaddrinfo() for names that are not numeric, so tests can use
+ * a local stub resolver. NULL restores the system resolver.
+ */
+void shout_dns_set_resolver(shout_dns_resolver_t resolver)
+{
+    _shout_util_mutex_lock(&shout_dns_lock);
+    shout_dns_resolver = resolver;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+}
+
+/* Stops the workers and frees the cache, called by shout_shutdown().
+ * Queued lookups fail right away, running ones are waited for.
+ */
+void shout_dns_cache_free(void)
+{
+    shout_dns_cache_t *entry;
+#ifdef SHOUT_DNS_ASYNC
+    shout_dns_lookup_t *lookup;
+    shout_dns_lookup_t *next;
+    size_t i;
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    shout_dns_stopping = 1;
+    for (lookup = shout_dns_pending; lookup; lookup = next) {
+        next = lookup->next;
+        if (!lookup->running)
+            shout_dns_lookup_finish(lookup, NULL, SHOUTERR_NOCONNECT);
+    }
+    pthread_cond_broadcast(&shout_dns_cond);
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    for (i = 0; i < shout_dns_workers; i++)
+        pthread_join(shout_dns_worker_thread[i], NULL);
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    shout_dns_workers = 0;
+    shout_dns_stopping = 0;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+#endif
+
+    _shout_util_mutex_lock(&shout_dns_lock);
+    entry = shout_dns_cache;
+    shout_dns_cache = NULL;
+    shout_dns_cache_len = 0;
+    _shout_util_mutex_unlock(&shout_dns_lock);
+
+    while (entry) {
+        shout_dns_cache_t *next = entry->next;
+        shout_dns_result_unref(entry->result);
+        free(entry->host);
+        free(entry);
+        entry = next;
+    }
+}
@@ -0,0 +1,270 @@
+/* -*- c-basic-offset: 8; -*- */
+/* adts.c: libshout AAC (ADTS) format handler
+ * $Id$
+ *
+ *  Copyright (C) 2002-2026 the Icecast team <team@icecast.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this library; if not, write to the Free
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <shout/shout.h>
+#include "shout_private.h"
+
+/* the frame length field has 13 bits */
+#define ADTS_FRAME_MAX      8191
+#define ADTS_HEADER_SIZE    7
+
+/* -- local datatypes -- */
+typedef struct {
+    unsigned int    frames;
+    /* part of a microsecond not yet added to senttime, in 1/samplerate */
+    unsigned int    time_rest;
+    /* samplerate of the last frame */
+    unsigned int    samplerate;
+    /* size of the frame being held, 0 while its header is incomplete */
+    size_t          frame_size;
+    /* bytes of the frame being held */
+    size_t          frame_len;
+    /* start of a frame that did not end in the last buffer */
+    unsigned char   frame[ADTS_FRAME_MAX];
+} adts_data_t;
+
+typedef struct {
+    unsigned int samplerate;
+    unsigned int samples;
+    size_t       framesize;
+} adts_header_t;
+
+/* -- const data -- */
+static const unsigned int samplerate[16] =
+{
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+    16000, 12000, 11025, 8000, 7350, 0, 0, 0
+};
+
+/* -- static prototypes -- */
+static int  send_adts(shout_t *self, const unsigned char *data, size_t len);
+static void close_adts(shout_t *self);
+
+static int  adts_header(const unsigned char *p, adts_header_t *ah);
+static int  adts_send_frames(shout_t *self, adts_data_t *adts_data, const unsigned char *p, size_t len);
+static void add_time(shout_t *self, adts_data_t *adts_data, const adts_header_t *ah);
+
+int shout_open_adts(shout_t *self)
+{
+    adts_data_t *adts_data;
+
+    if (!(adts_data = (adts_data_t *)calloc(1, sizeof(adts_data_t))))
+        return SHOUTERR_MALLOC;
+
+    self->format_data = adts_data;
+    self->send        = send_adts;
+    self->close       = close_adts;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* Only whole frames are sent. A frame that does not end in the buffer is
+ * held until the rest of it arrives, data that is not a frame is dropped.
+ */
+static int send_adts(shout_t *self, const unsigned char *buff, size_t len)
+{
+    adts_data_t    *adts_data = (adts_data_t *)self->format_data;
+    adts_header_t   ah;
+    size_t          pos, start, n;
+    const unsigned char *p;
+
+    pos = 0;
+
+    /* finish the held frame */
+    if (adts_data->frame_len) {
+        if (!adts_data->frame_size) {
+            n = ADTS_HEADER_SIZE - adts_data->frame_len;
+            if (n > len)
+                n = len;
+            memcpy(&adts_data->frame[adts_data->frame_len], buff, n);
+            adts_data->frame_len += n;
+            pos = n;
+
+            if (adts_data->frame_len < ADTS_HEADER_SIZE)
+                return self->error = SHOUTERR_SUCCESS;
+
+            if (adts_header(adts_data->frame, &ah)) {
+                adts_data->frame_size = ah.framesize;
+            } else {
+                /* it was not a frame after all, the bytes taken from buff
+                 * to complete the header may hold the next sync word */
+                adts_data->frame_len = 0;
+                pos = 0;
+            }
+        }
+
+        if (adts_data->frame_size) {
+            n = adts_data->frame_size - adts_data->frame_len;
+            if (n > len - pos)
+                n = len - pos;
+            memcpy(&adts_data->frame[adts_data->frame_len], &buff[pos], n);
+            adts_data->frame_len += n;
+            pos += n;
+
+            if (adts_data->frame_len < adts_data->frame_size)
+                return self->error = SHOUTERR_SUCCESS;
+
+            n = adts_data->frame_size;
+            adts_data->frame_len = 0;
+            adts_data->frame_size = 0;
+            if (adts_send_frames(self, adts_data, adts_data->frame, n) != SHOUTERR_SUCCESS)
+                return self->error;
+        }
+    }
+
+    /* send the whole frames in a row together */
+    start = pos;
+    while (pos < len) {
+        if (len - pos >= ADTS_HEADER_SIZE && adts_header(&buff[pos], &ah)) {
+            if (len - pos >= ah.framesize) {
+                pos += ah.framesize;
+                continue;
+            }
+
+            /* keep the start of the frame */
+            if (adts_send_frames(self, adts_data, &buff[start], pos - start) != SHOUTERR_SUCCESS)
+                return self->error;
+
+            memcpy(adts_data->frame, &buff[pos], len - pos);
+            adts_data->frame_len = len - pos;
+            adts_data->frame_size = ah.framesize;
+            return self->error = SHOUTERR_SUCCESS;
+        }
+
+        /* the header may be cut off by the end of the buffer */
+        if (len - pos < ADTS_HEADER_SIZE && buff[pos] == 0xFF && (len - pos == 1 || (buff[pos + 1] & 0xF6) == 0xF0)) {
+            if (adts_send_frames(self, adts_data, &buff[start], pos - start) != SHOUTERR_SUCCESS)
+                return self->error;
+
+            memcpy(adts_data->frame, &buff[pos], len - pos);
+            adts_data->frame_len = len - pos;
+            adts_data->frame_size = 0;
+            return self->error = SHOUTERR_SUCCESS;
+        }
+
+        /* lost sync, send what we have and look for the next sync word */
+        if (adts_send_frames(self, adts_data, &buff[start], pos - start) != SHOUTERR_SUCCESS)
+            return self->error;
+
+        pos++;
+        while (pos < len) {
+            p = memchr(&buff[pos], 0xFF, len - pos);
+            if (!p) {
+                pos = len;
+                break;
+            }
+            pos = p - buff;
+            if (pos + 1 == len || (buff[pos + 1] & 0xF6) == 0xF0)
+                break;
+            pos++;
+        }
+        start = pos;
+    }
+
+    return adts_send_frames(self, adts_data, &buff[start], pos - start);
+}
+
+/* Sends a run of whole frames, marking each of them and adding up their time */
+static int adts_send_frames(shout_t *self, adts_data_t *adts_data, const unsigned char *p, size_t len)
+{
+    adts_header_t   ah;
+    size_t          pos = 0;
+    ssize_t         ret;
+
+    if (!len)
+        return self->error = SHOUTERR_SUCCESS;
+
+    while (pos < len) {
+        adts_header(&p[pos], &ah);
+
+        /* every frame can be dropped on its own */
+        shout_connection_mark_frame(self->connection, pos, (uint64_t)ah.samples * 1000000 / ah.samplerate, 1);
+        add_time(self, adts_data, &ah);
+        adts_data->frames++;
+        pos += ah.framesize;
+    }
+
+    ret = shout_send_raw(self, p, len);
+    if (ret != (ssize_t)len)
+        return self->error = SHOUTERR_SOCKET;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+/* Adds the duration of a frame to senttime. The remainder is carried over
+ * so there is no drift however long the stream runs.
+ */
+static void add_time(shout_t *self, adts_data_t *adts_data, const adts_header_t *ah)
+{
+    uint64_t usec;
+
+    if (ah->samplerate != adts_data->samplerate) {
+        adts_data->samplerate = ah->samplerate;
+        adts_data->time_rest = 0;
+    }
+
+    usec = (uint64_t)ah->samples * 1000000 + adts_data->time_rest;
+
+    self->senttime        += usec / ah->samplerate;
+    adts_data->time_rest   = usec % ah->samplerate;
+}
+
+/* Parses the fixed and variable header, p must have ADTS_HEADER_SIZE bytes.
+ * For HE-AAC the header gives the rate of the AAC core. SBR doubles both the
+ * rate and the samples, so the duration of the frame is the same.
+ */
+static int adts_header(const unsigned char *p, adts_header_t *ah)
+{
+    unsigned int header_size;
+
+    /* syncword and layer, which is always 0 */
+    if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0)
+        return 0;
+
+    ah->samplerate = samplerate[(p[2] >> 2) & 0x0F];
+    if (!ah->samplerate)
+        return 0;
+
+    /* a CRC follows unless protection_absent is set */
+    header_size = (p[1] & 0x01) ? ADTS_HEADER_SIZE : ADTS_HEADER_SIZE + 2;
+
+    ah->framesize = ((size_t)(p[3] & 0x03) << 11) | ((size_t)p[4] << 3) | (p[5] >> 5);
+    if (ah->framesize < header_size)
+        return 0;
+
+    /* each raw data block holds 1024 samples */
+    ah->samples = 1024 * ((p[6] & 0x03) + 1);
+
+    return 1;
+}
+
+static void close_adts(shout_t *self)
+{
+    adts_data_t *adts_data = (adts_data_t *)self->format_data;
+    free(adts_data);
+}
@@ -24,6 +24,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* LIBSHOUT_MP3_SCAN_SCALAR builds the plain scanner only, to compare */
+#if defined(LIBSHOUT_MP3_SCAN_SCALAR)
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#   define MP3_SCAN_SSE2
+#elif defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define MP3_SCAN_NEON
+#endif
+
 #include <shout/shout.h>
 #include "shout_private.h"
 
@@ -31,17 +41,22 @@
  * MP3 frame handling courtesy of Scott Manley - may he always be Manley.
  */
 
-#define MPEG_MODE_MONO 3
+/* APE tags larger than this are taken for garbage */
+#define LIBSHOUT_APE_TAG_MAX (16*1024*1024)
 
 /* -- local datatypes -- */
 typedef struct {
     unsigned int    frames;
     /* the number of samples for the current frame */
-    int             frame_samples;
+    unsigned int    frame_samples;
     /* the samplerate of the current frame */
-    int             frame_samplerate;
+    unsigned int    frame_samplerate;
+    /* part of a microsecond not yet added to senttime, in 1/samplerate */
+    unsigned int    time_rest;
     /* how many bytes for the rest of this frame */
     unsigned int    frame_left;
+    /* how many bytes for the rest of this tag */
+    size_t          tag_left;
     /* is the header bridged?? */
     int             header_bridges;
     /* put part of header here if it spans a boundary */
@@ -49,57 +64,69 @@ typedef struct {
 } mp3_data_t;
 
 typedef struct {
-    int syncword;
-    int layer;
-    int version;
-    int error_protection;
-    int bitrate_index;
-    int samplerate_index;
-    int padding;
-    int extension;
-    int mode;
-    int mode_ext;
-    int copyright;
-    int original;
-    int emphasis;
-    int stereo;
-    int bitrate;
     unsigned int samplerate;
     unsigned int samples;
     unsigned int framesize;
 } mp3_header_t;
 
 /* -- const data -- */
-static const unsigned int bitrate[3][3][16] =
+/* frame size in bytes without padding,
+ * by version, layer (II, III), samplerate and bitrate index
+ */
+static const unsigned short framesize[3][2][3][16] =
 {
     {
-        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
-        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0 },
-        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 }
+        {
+            { 0, 104, 156, 182, 208, 261, 313, 365, 417, 522, 626, 731, 835, 1044, 1253, 0 },
+            { 0, 96, 144, 168, 192, 240, 288, 336, 384, 480, 576, 672, 768, 960, 1152, 0 },
+            { 0, 144, 216, 252, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1440, 1728, 0 }
+        }, {
+            { 0, 104, 130, 156, 182, 208, 261, 313, 365, 417, 522, 626, 731, 835, 1044, 0 },
+            { 0, 96, 120, 144, 168, 192, 240, 288, 336, 384, 480, 576, 672, 768, 960, 0 },
+            { 0, 144, 180, 216, 252, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1440, 0 }
+        }
     }, {
-        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
-        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
-        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+        {
+            { 0, 26, 52, 78, 104, 130, 156, 182, 208, 261, 313, 365, 417, 470, 522, 0 },
+            { 0, 24, 48, 72, 96, 120, 144, 168, 192, 240, 288, 336, 384, 432, 480, 0 },
+            { 0, 36, 72, 108, 144, 180, 216, 252, 288, 360, 432, 504, 576, 648, 720, 0 }
+        }, {
+            { 0, 26, 52, 78, 104, 130, 156, 182, 208, 261, 313, 365, 417, 470, 522, 0 },
+            { 0, 24, 48, 72, 96, 120, 144, 168, 192, 240, 288, 336, 384, 432, 480, 0 },
+            { 0, 36, 72, 108, 144, 180, 216, 252, 288, 360, 432, 504, 576, 648, 720, 0 }
+        }
     }, {
-        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
-        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
-        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+        {
+            { 0, 52, 104, 156, 208, 261, 313, 365, 417, 522, 626, 731, 835, 940, 1044, 0 },
+            { 0, 72, 144, 216, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1296, 1440, 0 },
+            { 0, 72, 144, 216, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1296, 1440, 0 }
+        }, {
+            { 0, 52, 104, 156, 208, 261, 313, 365, 417, 522, 626, 731, 835, 940, 1044, 0 },
+            { 0, 72, 144, 216, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1296, 1440, 0 },
+            { 0, 72, 144, 216, 288, 360, 432, 504, 576, 720, 864, 1008, 1152, 1296, 1440, 0 }
+        }
     }
 };
 
-static const unsigned int samplerate[3][4] =
+static const unsigned int samplerate[3][3] =
 {
-    { 44100, 48000, 32000, 0 },
-    { 22050, 24000, 16000, 0 },
-    { 11025, 8000, 8000, 0 }
+    { 44100, 48000, 32000 },
+    { 22050, 24000, 16000 },
+    { 11025, 8000, 8000 }
 };
 
+static const unsigned int samples[3] = { 1152, 576, 576 };
+
 /* -- static prototypes -- */
 static int  send_mp3(shout_t *self, const unsigned char *data, size_t len);
 static void close_mp3(shout_t *self);
 
-static void parse_header(mp3_header_t *mh, uint32_t header);
+static size_t mp3_tag_size(const unsigned char *p, size_t len);
+static int  mp3_xing(shout_t *self, uint32_t head, const unsigned char *p, size_t len, const mp3_header_t *mh);
+static ssize_t send_stitched(shout_t *self, const unsigned char *window, size_t bridges, const unsigned char *buff, size_t pos, size_t count);
+static void add_time(shout_t *self, mp3_data_t *mp3_data);
 static int  mp3_header(uint32_t head, mp3_header_t *mh);
+static size_t mp3_sync_scan(const unsigned char *buff, size_t pos, size_t len);
 
 int shout_open_mp3(shout_t *self)
 {
@@ -111,6 +138,7 @@ int shout_open_mp3(shout_t *self)
     self->format_data = mp3_data;
     self->send        = send_mp3;
     self->close       = close_mp3;
+    self->duration    = 0;
 
     return SHOUTERR_SUCCESS;
 }
@@ -122,10 +150,12 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
     uint32_t         head;
     int              ret, count;
     int              start, end, error, i;
-    unsigned char   *bridge_buff;
+    const unsigned char *p;
+    unsigned char    window[6];
+    size_t           bridges, tag;
     mp3_header_t     mh;
 
-    bridge_buff = NULL;
+    bridges     = 0;
     pos         = 0;
     start       = 0;
     error       = 0;
@@ -137,7 +167,7 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
     if (mp3_data->frame_left > 0) {
         /* is the rest of the frame here? */
         if (mp3_data->frame_left <= len) {
-            self->senttime += (int64_t)((double)mp3_data->frame_samples / (double)mp3_data->frame_samplerate * 1000000);
+            add_time(self, mp3_data);
             mp3_data->frames++;
             pos += mp3_data->frame_left;
             mp3_data->frame_left = 0;
@@ -147,21 +177,31 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
         }
     }
 
-    /* header was over the boundary, so build a new build a new buffer */
-    if (mp3_data->header_bridges) {
-        bridge_buff = (unsigned char*)malloc(len + mp3_data->header_bridges);
-        if (bridge_buff == NULL) {
-            return self->error = SHOUTERR_MALLOC;
+    /* finish the previous tag */
+    if (mp3_data->tag_left > 0) {
+        if (mp3_data->tag_left <= len) {
+            pos += mp3_data->tag_left;
+            mp3_data->tag_left = 0;
+        } else {
+            mp3_data->tag_left -= len;
+            pos = len;
         }
 
-        bridge_buff[0] = mp3_data->header_bridge[0];
-        bridge_buff[1] = mp3_data->header_bridge[1];
-        bridge_buff[2] = mp3_data->header_bridge[2];
+        if (self->strip_tags)
+            start = pos;
+    }
 
-        memcpy(&bridge_buff[mp3_data->header_bridges], buff, len);
+    /* header was over the boundary, so stitch the kept bytes to the
+     * start of this buffer. Positions below are counted from the first
+     * kept byte, those before bridges are read from the window.
+     */
+    if (mp3_data->header_bridges) {
+        bridges = mp3_data->header_bridges;
 
-        buff = bridge_buff;
-        len += mp3_data->header_bridges;
+        memcpy(window, mp3_data->header_bridge, bridges);
+        memcpy(&window[bridges], buff, len < 3 ? len : 3);
+
+        len += bridges;
         end = len - 1;
 
         mp3_data->header_bridges = 0;
@@ -172,10 +212,11 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
      */
     while ((pos + 4) <= len) {
         /* find mp3 header */
-        head = (buff[pos] << 24) |
-               (buff[pos + 1] << 16) |
-               (buff[pos + 2] << 8) |
-               (buff[pos + 3]);
+        p = pos < bridges ? &window[pos] : &buff[pos - bridges];
+        head = (p[0] << 24) |
+               (p[1] << 16) |
+               (p[2] << 8) |
+               (p[3]);
 
         /* is this a valid header? */
         if (mp3_header(head, &mh)) {
@@ -185,18 +226,54 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
                 error = 0;
             }
 
+            if (mh.samplerate != mp3_data->frame_samplerate)
+                mp3_data->time_rest = 0;
             mp3_data->frame_samples     = mh.samples;
             mp3_data->frame_samplerate  = mh.samplerate;
 
+            /* a Xing/Info frame holds no audio */
+            if (pos >= bridges && mp3_xing(self, head, &buff[pos - bridges], len - pos, &mh))
+                mp3_data->frame_samples = 0;
+
+            /* every frame can be dropped on its own */
+            shout_connection_mark_frame(self->connection, pos - start, (uint64_t)mp3_data->frame_samples * 1000000 / mh.samplerate, 1);
+
             /* do we have a complete frame in this buffer? */
             if (len - pos >= mh.framesize) {
-                self->senttime += (int64_t)((double)mp3_data->frame_samples / (double)mp3_data->frame_samplerate * 1000000);
+                add_time(self, mp3_data);
                 mp3_data->frames++;
                 pos += mh.framesize;
             } else {
                 mp3_data->frame_left = mh.framesize - (len - pos);
                 pos = len;
             }
+        } else if (pos >= bridges && (tag = mp3_tag_size(&buff[pos - bridges], len - pos)) > 0) {
+            /* a tag is skipped as a whole, either sent with the frames or dropped */
+            if (self->strip_tags) {
+                if (!error) {
+                    count = pos - start;
+                    if (count > 0) {
+                        ret = send_stitched(self, window, bridges, buff, start, count);
+                    } else {
+                        ret = 0;
+                    }
+
+                    if (ret != count)
+                        return self->error = SHOUTERR_SOCKET;
+                }
+                start = len - pos >= tag ? pos + tag : len;
+            } else if (error) {
+                start = pos;
+            }
+            end = len - 1;
+            error = 0;
+
+            if (len - pos >= tag) {
+                pos += tag;
+            } else {
+                mp3_data->tag_left = tag - (len - pos);
+                pos = len;
+            }
         } else {
             /* there was an error
             ** so we send all the valid data up to this point
@@ -206,18 +283,19 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
                 end = pos - 1;
                 count = end - start + 1;
                 if (count > 0) {
-                    ret = shout_send_raw(self, &buff[start], count);
+                    ret = send_stitched(self, window, bridges, buff, start, count);
                 } else {
                     ret = 0;
                 }
 
-                if (ret != count) {
-                    if (bridge_buff != NULL)
-                        free(bridge_buff);
+                if (ret != count)
                     return self->error = SHOUTERR_SOCKET;
-                }
             }
-            pos++;
+            if (pos + 1 < bridges) {
+                pos++;
+            } else {
+                pos = bridges + mp3_sync_scan(buff, pos + 1 - bridges, len - bridges);
+            }
         }
     }
 
@@ -227,7 +305,7 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
 
         i = 0;
         while (pos < len) {
-            mp3_data->header_bridge[i] = buff[pos];
+            mp3_data->header_bridge[i] = pos < bridges ? window[pos] : buff[pos - bridges];
             pos++;
             i++;
         }
@@ -238,13 +316,10 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
         /* if there's no errors, lets send the frames */
         count = end - start + 1;
         if (count > 0)
-            ret = shout_send_raw(self, &buff[start], count);
+            ret = send_stitched(self, window, bridges, buff, start, count);
         else
             ret = 0;
 
-        if (bridge_buff != NULL)
-            free(bridge_buff);
-
         if (ret == count) {
             return self->error = SHOUTERR_SUCCESS;
         } else {
@@ -252,68 +327,213 @@ static int send_mp3(shout_t* self, const unsigned char* buff, size_t len)
         }
     }
 
-    if (bridge_buff != NULL)
-        free(bridge_buff);
-
     return self->error = SHOUTERR_SUCCESS;
 }
 
-static void parse_header(mp3_header_t *mh, uint32_t header)
+/* Returns the size of the ID3v2 or APE tag starting at p, 0 if there is none */
+static size_t mp3_tag_size(const unsigned char *p, size_t len)
 {
-    mh->syncword    = (header >> 20) & 0x0fff;
-    mh->version     = ((header >> 19) & 0x01) ? 0 : 1;
-
-    if ((mh->syncword & 0x01) == 0)
-        mh->version = 2;
-
-    mh->layer               = 3 - ((header >> 17) & 0x03);
-    mh->error_protection    = ((header >> 16) & 0x01) ? 0 : 1;
-    mh->bitrate_index       = (header >> 12) & 0x0F;
-    mh->samplerate_index    = (header >> 10) & 0x03;
-    mh->padding             = (header >> 9) & 0x01;
-    mh->extension           = (header >> 8) & 0x01;
-    mh->mode                = (header >> 6) & 0x03;
-    mh->mode_ext            = (header >> 4) & 0x03;
-    mh->copyright           = (header >> 3) & 0x01;
-    mh->original            = (header >> 2) & 0x01;
-    mh->emphasis            = header & 0x03;
-
-    mh->stereo      = (mh->mode == MPEG_MODE_MONO) ? 1 : 2;
-    mh->bitrate     = bitrate[mh->version][mh->layer][mh->bitrate_index];
-    mh->samplerate  = samplerate[mh->version][mh->samplerate_index];
-
-    if (mh->version == 0) {
-        mh->samples = 1152;
+    uint32_t size, flags;
+
+    /* ID3v2: "ID3", version, flags and a syncsafe size not counting the
+     * header and footer
+     */
+    if (len >= 10 && p[0] == 'I' && p[1] == 'D' && p[2] == '3') {
+        if (p[3] == 0xFF || p[4] == 0xFF || ((p[6] | p[7] | p[8] | p[9]) & 0x80))
+            return 0;
+
+        size = ((uint32_t)p[6] << 21) | ((uint32_t)p[7] << 14) | ((uint32_t)p[8] << 7) | p[9];
+        return 10 + (size_t)size + ((p[5] & 0x10) ? 10 : 0);
+    }
+
+    /* APE: "APETAGEX", version, size counting items and footer, item count
+     * and flags, all little endian. A header is followed by the items and
+     * the footer, a footer alone comes after the items.
+     */
+    if (len >= 32 && memcmp(p, "APETAGEX", 8) == 0) {
+        size  = p[12] | ((uint32_t)p[13] << 8) | ((uint32_t)p[14] << 16) | ((uint32_t)p[15] << 24);
+        flags = p[20] | ((uint32_t)p[21] << 8) | ((uint32_t)p[22] << 16) | ((uint32_t)p[23] << 24);
+
+        if (size < 32 || size > LIBSHOUT_APE_TAG_MAX)
+            return 0;
+
+        return (flags & 0x20000000) ? 32 + (size_t)size : 32;
+    }
+
+    return 0;
+}
+
+/* Checks for a Xing/Info frame and takes the total duration from it.
+ * p points to the frame header, len bytes are available.
+ */
+static int mp3_xing(shout_t *self, uint32_t head, const unsigned char *p, size_t len, const mp3_header_t *mh)
+{
+    size_t   offset;
+    uint32_t frames;
+    int      mono = ((head >> 6) & 0x03) == 3;
+
+    /* only layer III has them, right after the side info */
+    if (((head >> 17) & 0x03) != 1)
+        return 0;
+
+    if (((head >> 19) & 0x03) == 3) {
+        offset = 4 + (mono ? 17 : 32);
     } else {
-        mh->samples = 576;
+        offset = 4 + (mono ? 9 : 17);
     }
 
-    if (mh->samplerate)
-        mh->framesize = (mh->samples * mh->bitrate * 1000 / mh->samplerate) / 8 + mh->padding;
+    if (offset + 12 > len || offset + 12 > mh->framesize)
+        return 0;
+
+    p += offset;
+    if (memcmp(p, "Xing", 4) != 0 && memcmp(p, "Info", 4) != 0)
+        return 0;
+
+    /* the frame count is present if the lowest flag is set */
+    if (p[7] & 0x01) {
+        frames = ((uint32_t)p[8] << 24) | ((uint32_t)p[9] << 16) | ((uint32_t)p[10] << 8) | p[11];
+        self->duration = (uint64_t)frames * mh->samples * 1000000 / mh->samplerate;
+    }
+
+    return 1;
+}
+
+/* Sends count bytes from pos, counted like in send_mp3(): the first bridges
+ * bytes come from the window, the rest from the caller's buffer.
+ */
+static ssize_t send_stitched(shout_t *self, const unsigned char *window, size_t bridges, const unsigned char *buff, size_t pos, size_t count)
+{
+    ssize_t ret;
+    size_t  n;
+
+    if (pos < bridges) {
+        n = bridges - pos;
+        if (n > count)
+            n = count;
+
+        ret = shout_send_raw(self, &window[pos], n);
+        if (ret != (ssize_t)n || n == count)
+            return ret;
+
+        ret = shout_send_raw(self, buff, count - n);
+        if (ret < 0)
+            return ret;
+
+        return ret + n;
+    }
+
+    return shout_send_raw(self, &buff[pos - bridges], count);
+}
+
+/* Adds the duration of the current frame to senttime. The remainder is
+ * carried over so there is no drift however long the stream runs.
+ */
+static void add_time(shout_t *self, mp3_data_t *mp3_data)
+{
+    uint64_t usec = (uint64_t)mp3_data->frame_samples * 1000000 + mp3_data->time_rest;
+
+    self->senttime      += usec / mp3_data->frame_samplerate;
+    mp3_data->time_rest  = usec % mp3_data->frame_samplerate;
+}
+
+/* Returns the position of the next possible frame header at or after pos:
+ * a 0xFF byte followed by one with its top three bits set, which is where
+ * the sync word starts. If there is none, len - 3 is returned, leaving the
+ * last bytes to be kept for the next call.
+ */
+static size_t mp3_sync_scan(const unsigned char *buff, size_t pos, size_t len)
+{
+    const unsigned char *p;
+    size_t last;
+
+    if (len < 4)
+        return pos;
+
+    /* last position a whole header fits at */
+    last = len - 4;
+
+    /* skip 16 positions at a time, the scalar loop below finds the exact one */
+#if defined(MP3_SCAN_SSE2)
+    {
+        const __m128i ff = _mm_set1_epi8((char)0xFF);
+        const __m128i e0 = _mm_set1_epi8((char)0xE0);
+
+        while (pos + 17 <= len) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(buff + pos));
+            __m128i b = _mm_loadu_si128((const __m128i *)(buff + pos + 1));
+            __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(a, ff), _mm_cmpeq_epi8(_mm_and_si128(b, e0), e0));
+
+            if (_mm_movemask_epi8(hit))
+                break;
+            pos += 16;
+        }
+    }
+#elif defined(MP3_SCAN_NEON)
+    {
+        const uint8x16_t ff = vdupq_n_u8(0xFF);
+        const uint8x16_t e0 = vdupq_n_u8(0xE0);
+
+        while (pos + 17 <= len) {
+            uint8x16_t a = vld1q_u8(buff + pos);
+            uint8x16_t b = vld1q_u8(buff + pos + 1);
+            uint64x2_t hit = vreinterpretq_u64_u8(vandq_u8(vceqq_u8(a, ff), vceqq_u8(vandq_u8(b, e0), e0)));
+
+            if (vgetq_lane_u64(hit, 0) | vgetq_lane_u64(hit, 1))
+                break;
+            pos += 16;
+        }
+    }
+#endif
+
+    while (pos <= last) {
+        p = memchr(buff + pos, 0xFF, last + 1 - pos);
+        if (!p)
+            break;
+        pos = p - buff;
+        if ((buff[pos + 1] & 0xE0) == 0xE0)
+            return pos;
+        pos++;
+    }
+
+    return len - 3;
 }
 
 /* mp3 frame parsing stuff */
 static int mp3_header(uint32_t head, mp3_header_t *mh)
 {
-    /* fill out the header struct */
-    parse_header(mh, head);
+    unsigned int version, layer, samplerate_index;
 
-    /* check for syncword */
-    if ((mh->syncword & 0x0ffe) != 0x0ffe)
+    /* check for syncword, most positions fail here */
+    if ((head & 0xFFE00000) != 0xFFE00000)
         return 0;
 
-    /* check that layer is valid */
-    if (mh->layer == 0)
-        return 0;
+    switch ((head >> 19) & 0x03) {
+        case 3: version = 0; break; /* MPEG 1 */
+        case 2: version = 1; break; /* MPEG 2 */
+        case 0: version = 2; break; /* MPEG 2.5 */
+        default: return 0;
+    }
 
-    /* make sure bitrate is sane */
-    if (mh->bitrate == 0)
+    /* layer I is not supported */
+    switch ((head >> 17) & 0x03) {
+        case 2: layer = 0; break;   /* layer II */
+        case 1: layer = 1; break;   /* layer III */
+        default: return 0;
+    }
+
+    samplerate_index = (head >> 10) & 0x03;
+    if (samplerate_index == 3)
         return 0;
 
-    /* make sure samplerate is sane */
-    if (mh->samplerate == 0)
+    /* a zero entry means a free format or invalid bitrate */
+    mh->framesize = framesize[version][layer][samplerate_index][(head >> 12) & 0x0F];
+    if (mh->framesize == 0)
         return 0;
 
+    mh->framesize   += (head >> 9) & 0x01;
+    mh->samplerate   = samplerate[version][samplerate_index];
+    mh->samples      = samples[version];
+
     return 1;
 }
 
@@ -42,6 +42,10 @@ typedef struct {
     ogg_sync_state  oy;
     ogg_codec_t    *codecs;
     char            bos;
+    /* set while header pages are seen, they are kept for a reconnect */
+    char            headers;
+    /* set until the first data after shout_open() has been checked */
+    char            replay;
 } ogg_data_t;
 
 /* -- static prototypes -- */
@@ -51,6 +55,7 @@ static int  open_codec(ogg_codec_t *codec, ogg_page *page);
 static void free_codec(ogg_codec_t *codec);
 static void free_codecs(ogg_data_t *ogg_data);
 static int  send_page(shout_t *self, ogg_page *page);
+static int  send_headers(shout_t *self, const unsigned char *data, size_t len);
 
 typedef int (*codec_open_t)(ogg_codec_t *codec, ogg_page *page);
 
@@ -79,6 +84,7 @@ int shout_open_ogg(shout_t *self)
 
     ogg_sync_init(&ogg_data->oy);
     ogg_data->bos = 1;
+    ogg_data->replay = self->stream_header.len > 0;
 
     self->send  = send_ogg;
     self->close = close_ogg;
@@ -92,6 +98,13 @@ static int send_ogg(shout_t *self, const unsigned char *data, size_t len)
     ogg_codec_t *codec;
     char        *buffer;
     ogg_page     page;
+    int64_t      prevtime;
+
+    if (ogg_data->replay) {
+        ogg_data->replay = 0;
+        if ((self->error = send_headers(self, data, len)) != SHOUTERR_SUCCESS)
+            return self->error;
+    }
 
     buffer = ogg_sync_buffer(&ogg_data->oy, len);
     if (!buffer)
@@ -100,9 +113,12 @@ static int send_ogg(shout_t *self, const unsigned char *data, size_t len)
     ogg_sync_wrote(&ogg_data->oy, len);
 
     while (ogg_sync_pageout(&ogg_data->oy, &page) == 1) {
+        prevtime = self->senttime;
+
         if (ogg_page_bos(&page)) {
             if (!ogg_data->bos) {
                 free_codecs(ogg_data);
+                shout_stream_header_reset(self);
                 ogg_data->bos = 1;
             }
 
@@ -140,6 +156,19 @@ static int send_ogg(shout_t *self, const unsigned char *data, size_t len)
             }
         }
 
+        /* header pages and pages continuing a packet must never be dropped */
+        shout_connection_mark_frame(self->connection, 0, self->senttime - prevtime,
+                !ogg_page_bos(&page) && !ogg_page_continued(&page) && ogg_page_granulepos(&page) > 0);
+
+        /* headers run from the BOS pages up to the first page with a position */
+        if (ogg_page_bos(&page) || (ogg_data->headers && ogg_page_granulepos(&page) <= 0)) {
+            ogg_data->headers = 1;
+            shout_stream_header_add(self, page.header, page.header_len);
+            shout_stream_header_add(self, page.body, page.body_len);
+        } else {
+            ogg_data->headers = 0;
+        }
+
         if ((self->error = send_page(self, &page)) != SHOUTERR_SUCCESS) {
             return self->error;
         }
@@ -219,3 +248,30 @@ static int send_page(shout_t *self, ogg_page *page)
 
     return SHOUTERR_SUCCESS;
 }
+
+/* A stream continued after shout_close() and shout_open() lacks its
+ * headers. Unless it starts with a BOS page, run the headers kept from
+ * before through the parser first, which also sets up the codecs again.
+ */
+static int send_headers(shout_t *self, const unsigned char *data, size_t len)
+{
+    char    *headers;
+    ssize_t  headers_len;
+    int      ret;
+
+    if (len >= 6 && memcmp(data, "OggS", 4) == 0 && (data[5] & 0x02)) {
+        shout_stream_header_reset(self);
+        return SHOUTERR_SUCCESS;
+    }
+
+    headers_len = shout_queue_collect(self->stream_header.head, &headers);
+    if (headers_len < 0)
+        return headers_len;
+
+    /* they are kept again as they are parsed */
+    shout_stream_header_reset(self);
+    ret = send_ogg(self, (const unsigned char *)headers, headers_len);
+    free(headers);
+
+    return ret;
+}
@@ -79,6 +79,13 @@ typedef struct _webm_t {
     webm_parsing_state parsing_state;
     uint64_t copy_len;
 
+    /* set once the first cluster starts, everything before
+     * it is kept as the stream header for a reconnect
+     */
+    bool header_done;
+    /* set until the first data after shout_open() has been checked */
+    bool replay;
+
     /* buffer state */
     size_t input_write_position;
     size_t input_read_position;
@@ -112,6 +119,7 @@ static size_t copy_possible(const void *src_base,
                             size_t *target_position,
                             size_t target_len);
 static int flush_output(shout_t *self, webm_t *webm);
+static int send_headers(shout_t *self, webm_t *webm, const unsigned char *data, size_t len);
 
 static ssize_t ebml_parse_tag(unsigned char *buffer,
                               unsigned char *buffer_end,
@@ -138,6 +146,7 @@ int shout_open_webm(shout_t *self)
 
     /* configure shout state */
     self->format_data = webm_filter;
+    webm_filter->replay = self->stream_header.len > 0;
 
     self->send = send_webm;
     self->close = close_webm;
@@ -150,6 +159,12 @@ static int send_webm(shout_t *self, const unsigned char *data, size_t len)
     webm_t *webm = (webm_t *) self->format_data;
     size_t input_progress = 0;
 
+    if (webm->replay) {
+        webm->replay = false;
+        if (send_headers(self, webm, data, len) != SHOUTERR_SUCCESS)
+            return self->error;
+    }
+
     self->error = SHOUTERR_SUCCESS;
 
     while (input_progress < len && self->error == SHOUTERR_SUCCESS) {
@@ -263,6 +278,7 @@ static int webm_process_tag(shout_t *self, webm_t *webm)
     ssize_t track_number_length;
     uint64_t track_number;
     uint64_t timestamp_scale;
+    uint64_t previous_timestamp = webm->latest_timestamp;
 
     uint64_t to_copy;
 
@@ -291,10 +307,24 @@ static int webm_process_tag(shout_t *self, webm_t *webm)
     /* handle tag appropriately */
 
     switch (tag_id) {
+        case WEBM_EBML_ID:
+            /* a new stream starts */
+            shout_stream_header_reset(self);
+            webm->header_done = false;
+            break;
+
         case WEBM_SEGMENT_ID:
+            /* open containers to process children */
+            to_copy = tag_length;
+            break;
+
         case WEBM_CLUSTER_ID:
             /* open containers to process children */
             to_copy = tag_length;
+            webm->header_done = true;
+            /* clusters are the unit the write queue may drop,
+             * their duration is added as their blocks are seen */
+            shout_connection_mark_frame(self->connection, webm->output_position, 0, 1);
             break;
 
         case WEBM_SEGMENT_INFO_ID:
@@ -387,6 +417,9 @@ static int webm_process_tag(shout_t *self, webm_t *webm)
             break;
     }
 
+    if (webm->latest_timestamp > previous_timestamp)
+        shout_connection_extend_frame(self->connection, ((webm->latest_timestamp - previous_timestamp) * webm->timestamp_scale) / 1000);
+
     /* queue copying */
 
     if (to_copy > 0) {
@@ -405,6 +438,9 @@ static int webm_output(shout_t *self, webm_t *webm, const unsigned char *data, s
 {
     size_t output_progress = 0;
 
+    if (!webm->header_done)
+        shout_stream_header_add(self, data, len);
+
     while (output_progress < len && self->error == SHOUTERR_SUCCESS)
     {
         copy_possible(data, &output_progress, len,
@@ -472,6 +508,34 @@ static int flush_output(shout_t *self, webm_t *webm)
     return self->error;
 }
 
+/* A stream continued after shout_close() and shout_open() lacks its
+ * headers. Unless it starts with an EBML header, run the headers kept
+ * from before through the parser first.
+ */
+static int send_headers(shout_t *self, webm_t *webm, const unsigned char *data, size_t len)
+{
+    static const unsigned char ebml_magic[4] = {0x1A, 0x45, 0xDF, 0xA3};
+    char    *headers;
+    ssize_t  headers_len;
+
+    if (len >= sizeof(ebml_magic) && memcmp(data, ebml_magic, sizeof(ebml_magic)) == 0)
+        return self->error = SHOUTERR_SUCCESS;
+
+    headers_len = shout_queue_collect(self->stream_header.head, &headers);
+    if (headers_len < 0)
+        return self->error = headers_len;
+
+    /* they are kept again as they are parsed */
+    shout_stream_header_reset(self);
+    send_webm(self, (const unsigned char *)headers, headers_len);
+    free(headers);
+
+    /* the headers are complete, whatever follows is stream data */
+    webm->header_done = true;
+
+    return self->error;
+}
+
 /* -- EBML helper functions -- */
 
 /* Try to parse an EBML tag at the given location, returning the
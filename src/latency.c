@@ -0,0 +1,108 @@
+/* -*- c-basic-offset: 8; -*- */
+/* latency.c: process wide latency histograms of connection setup
+ *
+ *  Copyright (C) 2026 the Icecast team <team@icecast.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this library; if not, write to the Free
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <string.h>
+
+#include <shout/shout.h>
+#include "shout_private.h"
+
+/* Values below SHOUT_LATENCY_LINEAR get a bucket each. Above, every power
+ * of two range is split into SHOUT_LATENCY_SUB linear buckets, so the
+ * relative error stays below 1/SHOUT_LATENCY_SUB. The last bucket also
+ * takes everything too large for the others.
+ */
+#define SHOUT_LATENCY_LINEAR_BITS   3
+#define SHOUT_LATENCY_LINEAR        (1U << SHOUT_LATENCY_LINEAR_BITS)
+#define SHOUT_LATENCY_SUB_BITS      2
+#define SHOUT_LATENCY_SUB           (1U << SHOUT_LATENCY_SUB_BITS)
+
+static uint64_t         shout_latency_counts[SHOUT_LATENCY__MAX][SHOUT_LATENCY_BUCKETS];
+static _shout_util_mutex_t shout_latency_lock = _SHOUT_UTIL_MUTEX_INITIALIZER;
+
+static size_t shout_latency_bucket(uint64_t value)
+{
+    unsigned int log = 0;
+    size_t bucket;
+
+    if (value < SHOUT_LATENCY_LINEAR)
+        return value;
+
+    while ((value >> log) > 1)
+        log++;
+
+    bucket = SHOUT_LATENCY_LINEAR + (log - SHOUT_LATENCY_LINEAR_BITS) * SHOUT_LATENCY_SUB +
+             ((value >> (log - SHOUT_LATENCY_SUB_BITS)) & (SHOUT_LATENCY_SUB - 1));
+
+    if (bucket >= SHOUT_LATENCY_BUCKETS)
+        bucket = SHOUT_LATENCY_BUCKETS - 1;
+
+    return bucket;
+}
+
+void shout_latency_record(unsigned int phase, uint64_t value)
+{
+    if (phase >= SHOUT_LATENCY__MAX)
+        return;
+
+    _shout_util_mutex_lock(&shout_latency_lock);
+    shout_latency_counts[phase][shout_latency_bucket(value)]++;
+    _shout_util_mutex_unlock(&shout_latency_lock);
+}
+
+int shout_get_latency_histogram(unsigned int phase, uint64_t counts[SHOUT_LATENCY_BUCKETS])
+{
+    if (phase >= SHOUT_LATENCY__MAX || !counts)
+        return SHOUTERR_INSANE;
+
+    _shout_util_mutex_lock(&shout_latency_lock);
+    memcpy(counts, shout_latency_counts[phase], sizeof(shout_latency_counts[phase]));
+    _shout_util_mutex_unlock(&shout_latency_lock);
+
+    return SHOUTERR_SUCCESS;
+}
+
+uint64_t shout_get_latency_bucket_limit(size_t bucket)
+{
+    size_t range;
+    size_t sub;
+
+    if (bucket < SHOUT_LATENCY_LINEAR)
+        return bucket + 1;
+
+    /* the last bucket has no upper limit */
+    if (bucket >= SHOUT_LATENCY_BUCKETS - 1)
+        return ~(uint64_t)0;
+
+    range = (bucket - SHOUT_LATENCY_LINEAR) / SHOUT_LATENCY_SUB + SHOUT_LATENCY_LINEAR_BITS;
+    sub = (bucket - SHOUT_LATENCY_LINEAR) % SHOUT_LATENCY_SUB;
+
+    return ((uint64_t)1 << range) + ((uint64_t)(sub + 1) << (range - SHOUT_LATENCY_SUB_BITS));
+}
+
+void shout_reset_latency_histograms(void)
+{
+    _shout_util_mutex_lock(&shout_latency_lock);
+    memset(shout_latency_counts, 0, sizeof(shout_latency_counts));
+    _shout_util_mutex_unlock(&shout_latency_lock);
+}
@@ -0,0 +1,589 @@
+/* -*- c-basic-offset: 8; -*- */
+/* loop.c: Event loop driving many nonblocking connections at once.
+ *
+ *  Copyright (C) 2026 the Icecast team <team@icecast.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this library; if not, write to the Free
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#   include <unistd.h>
+#elif defined(HAVE_POLL_H)
+#   include <poll.h>
+#endif
+
+#include <shout/shout.h>
+#include "shout_private.h"
+
+/* max number of events fetched from the kernel per shout_loop_iter() */
+#define SHOUT_LOOP_MAX_EVENTS   64
+
+typedef struct shout_loop_entry_tag shout_loop_entry_t;
+
+struct shout_loop_entry_tag {
+    shout_t                *shout;
+    shout_loop_callback_t   callback;
+    void                   *userdata;
+
+    /* the connection we last saw on the instance */
+    shout_connection_t     *con;
+    /* socket registered with the backend and its events */
+    sock_t                  registered;
+    int                     registered_events;
+
+    /* events reported by the backend, SHOUT_IO_* */
+    int                     revents;
+    /* time the connection wants to be iterated at, 0 for none */
+    uint64_t                deadline;
+
+    int                     connected;
+    int                     queued;
+    int                     failed;
+    int                     removed;
+
+    shout_loop_entry_t     *next;
+};
+
+struct shout_loop {
+#ifdef HAVE_SYS_EPOLL_H
+    int                 epfd;
+#elif defined(HAVE_POLL_H)
+    struct pollfd      *pollfds;
+    shout_loop_entry_t **pollentries;
+    size_t              pollfds_len;
+#endif
+    shout_loop_entry_t *entries;
+    size_t              len;
+    int                 dispatching;
+#ifdef HAVE_LIBURING
+    /* ring shared by the connections, NULL if the kernel does not support it */
+    shout_uring_t      *uring;
+#endif
+};
+
+shout_loop_t *shout_loop_new(void)
+{
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_POLL_H)
+    return NULL;
+#else
+    shout_loop_t *loop;
+
+    loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+#endif
+
+#ifdef HAVE_LIBURING
+    loop->uring = shout_uring_new();
+#ifdef HAVE_SYS_EPOLL_H
+    if (loop->uring) {
+        struct epoll_event ev;
+
+        /* readable once completions are waiting, data.ptr NULL tells it from the entries */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shout_uring_get_fd(loop->uring), &ev) != 0) {
+            shout_uring_free(loop->uring);
+            loop->uring = NULL;
+        }
+    }
+#endif
+#endif
+
+    return loop;
+#endif
+}
+
+#ifdef HAVE_LIBURING
+/* ring for the connections of the instances in the loop, may be NULL */
+shout_uring_t *shout_loop_get_uring(shout_loop_t *loop)
+{
+    return loop->uring;
+}
+#endif
+
+static void shout_loop_entry_free(shout_loop_entry_t *entry)
+{
+    free(entry);
+}
+
+void shout_loop_free(shout_loop_t *loop)
+{
+    shout_loop_entry_t *entry;
+
+    if (!loop)
+        return;
+
+    while ((entry = loop->entries)) {
+        loop->entries = entry->next;
+        if (!entry->removed && entry->shout->loop == loop) {
+            if (entry->con) {
+#ifdef HAVE_LIBURING
+                shout_connection_set_uring(entry->con, NULL);
+#endif
+                shout_connection_set_external_io(entry->con, 0);
+            }
+            entry->shout->loop = NULL;
+        }
+        shout_loop_entry_free(entry);
+    }
+
+#ifdef HAVE_LIBURING
+    shout_uring_free(loop->uring);
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    close(loop->epfd);
+#elif defined(HAVE_POLL_H)
+    free(loop->pollfds);
+    free(loop->pollentries);
+#endif
+
+    free(loop);
+}
+
+int shout_loop_add(shout_loop_t *loop, shout_t *shout, shout_loop_callback_t callback, void *userdata)
+{
+    shout_loop_entry_t *entry;
+
+    if (!loop || !shout)
+        return SHOUTERR_INSANE;
+
+    if (shout->loop)
+        return shout->error = SHOUTERR_BUSY;
+
+    if (shout_get_nonblocking(shout) != SHOUT_BLOCKING_NONE)
+        return shout->error = SHOUTERR_INSANE;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return shout->error = SHOUTERR_MALLOC;
+
+    entry->shout = shout;
+    entry->callback = callback;
+    entry->userdata = userdata;
+    entry->registered = SOCK_ERROR;
+
+    entry->next = loop->entries;
+    loop->entries = entry;
+    loop->len++;
+
+    shout->loop = loop;
+
+    return shout->error = SHOUTERR_SUCCESS;
+}
+
+/* Returns true if any other entry has the socket registered. */
+static int shout_loop_socket_in_use(shout_loop_t *loop, shout_loop_entry_t *self, sock_t socket)
+{
+    shout_loop_entry_t *entry;
+
+    for (entry = loop->entries; entry; entry = entry->next) {
+        if (entry != self && entry->registered == socket)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void shout_loop_backend_update(shout_loop_t *loop, shout_loop_entry_t *entry, sock_t socket, int events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    /* We do not keep idle sockets in the set, as EPOLLHUP would be reported
+     * over and over again without anyone reading or writing.
+     */
+    if (!events)
+        socket = SOCK_ERROR;
+
+    if (entry->registered != SOCK_ERROR && entry->registered != socket) {
+        /* the socket may already be closed and its number reused by another entry */
+        if (!shout_loop_socket_in_use(loop, entry, entry->registered))
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->registered, NULL);
+        entry->registered = SOCK_ERROR;
+        entry->registered_events = 0;
+    }
+
+    if (socket == SOCK_ERROR)
+        return;
+
+    if (entry->registered == socket && entry->registered_events == events)
+        return;
+
+    ev.events = 0;
+    if (events & SHOUT_IO_READ)
+        ev.events |= EPOLLIN;
+    if (events & SHOUT_IO_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = entry;
+
+    if (entry->registered == socket) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, socket, &ev) == 0) {
+            entry->registered_events = events;
+            return;
+        }
+        /* closed and reopened behind our back, the kernel dropped it from the set */
+    }
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, socket, &ev) == 0 ||
+        (errno == EEXIST && epoll_ctl(loop->epfd, EPOLL_CTL_MOD, socket, &ev) == 0)) {
+        entry->registered = socket;
+        entry->registered_events = events;
+    } else {
+        entry->registered = SOCK_ERROR;
+    }
+#elif defined(HAVE_POLL_H)
+    (void)loop;
+
+    /* poll() needs no registration, the set is built on every iteration */
+    if (!events)
+        socket = SOCK_ERROR;
+
+    entry->registered = socket;
+    entry->registered_events = events;
+#else
+    /* no backend, shout_loop_new() never returns a loop */
+    (void)loop;
+    (void)socket;
+    (void)events;
+
+    entry->registered = SOCK_ERROR;
+    entry->registered_events = 0;
+#endif
+}
+
+int shout_loop_remove(shout_loop_t *loop, shout_t *shout)
+{
+    shout_loop_entry_t **link;
+    shout_loop_entry_t *entry;
+
+    if (!loop || !shout)
+        return SHOUTERR_INSANE;
+
+    for (link = &(loop->entries); (entry = *link); link = &(entry->next)) {
+        if (entry->shout == shout && !entry->removed)
+            break;
+    }
+
+    if (!entry)
+        return shout->error = SHOUTERR_INSANE;
+
+    shout_loop_backend_update(loop, entry, SOCK_ERROR, 0);
+    if (shout->connection) {
+#ifdef HAVE_LIBURING
+        shout_connection_set_uring(shout->connection, NULL);
+#endif
+        shout_connection_set_external_io(shout->connection, 0);
+    }
+    shout->loop = NULL;
+    loop->len--;
+
+    if (loop->dispatching) {
+        /* shout_loop_iter() still walks the list, free it once it is done */
+        entry->removed = 1;
+    } else {
+        *link = entry->next;
+        shout_loop_entry_free(entry);
+    }
+
+    return shout->error = SHOUTERR_SUCCESS;
+}
+
+static void shout_loop_sync(shout_loop_t *loop, shout_loop_entry_t *entry, uint64_t now, int *timeout)
+{
+    sock_t  socket = SOCK_ERROR;
+    int     events = 0;
+    int     entry_timeout = -1;
+
+    if (entry->shout->connection != entry->con) {
+        /* opened, closed or reopened by the application. The new socket
+         * may have been given the number of the old one, which the kernel
+         * dropped from the set on close, so never carry the registration over.
+         */
+        shout_loop_backend_update(loop, entry, SOCK_ERROR, 0);
+        entry->con = entry->shout->connection;
+        entry->connected = 0;
+        entry->queued = 0;
+        entry->failed = 0;
+    }
+
+    if (!entry->con && entry->shout->reconnecting) {
+        /* come back once the next attempt is due */
+        entry_timeout = entry->shout->reconnect_at > now ? (int)(entry->shout->reconnect_at - now) : 0;
+    } else if (entry->con && !entry->failed) {
+        if (!entry->con->io_external)
+            shout_connection_set_external_io(entry->con, 1);
+#ifdef HAVE_LIBURING
+        if (entry->con->uring != loop->uring)
+            shout_connection_set_uring(entry->con, loop->uring);
+#endif
+        if (shout_connection_get_pollinfo(entry->con, entry->shout, &socket, &events, &entry_timeout) != SHOUTERR_SUCCESS) {
+            socket = SOCK_ERROR;
+            entry_timeout = -1;
+        }
+        if (entry->connected)
+            entry->queued = entry->con->wqueue.len > 0;
+#ifdef HAVE_LIBURING
+        /* completions reaped while another connection cancelled its requests */
+        if (entry->con->uring_ready)
+            entry_timeout = 0;
+#endif
+    }
+
+    shout_loop_backend_update(loop, entry, socket, events);
+
+    if (entry_timeout < 0) {
+        entry->deadline = 0;
+        return;
+    }
+
+    entry->deadline = now + entry_timeout;
+    if (*timeout < 0 || entry_timeout < *timeout)
+        *timeout = entry_timeout;
+}
+
+static void shout_loop_drive(shout_loop_t *loop, shout_loop_entry_t *entry)
+{
+    shout_t            *shout = entry->shout;
+    shout_connection_t *con = entry->con;
+    int                 status;
+    int                 ret;
+
+    ret = shout_process_io(shout, entry->revents);
+    entry->revents = 0;
+    entry->deadline = 0;
+
+    /* the instance may have been closed by a callback on the way */
+    if (shout->connection != con)
+        return;
+
+    switch (ret) {
+        case SHOUTERR_CONNECTED:
+        case SHOUTERR_SUCCESS:
+        case SHOUTERR_BUSY:
+        case SHOUTERR_RETRY:
+            /* waiting to reconnect */
+            if (!con)
+                return;
+            if (!entry->connected) {
+                if (con->current_message_state != SHOUT_MSGSTATE_SENDING1)
+                    return;
+                entry->connected = 1;
+                entry->queued = con->wqueue.len > 0;
+                status = SHOUTERR_CONNECTED;
+            } else {
+                if (!entry->queued || con->wqueue.len)
+                    return;
+                entry->queued = 0;
+                status = SHOUTERR_SUCCESS;
+            }
+        break;
+        default:
+            entry->failed = 1;
+            status = ret;
+        break;
+    }
+
+    if (entry->callback)
+        entry->callback(loop, shout, status, entry->userdata);
+}
+
+static int shout_loop_wait(shout_loop_t *loop, int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event  events[SHOUT_LOOP_MAX_EVENTS];
+    shout_loop_entry_t *entry;
+    int                 ret;
+    int                 i;
+
+    ret = epoll_wait(loop->epfd, events, SHOUT_LOOP_MAX_EVENTS, timeout);
+    if (ret < 0)
+        return errno == EINTR ? SHOUTERR_SUCCESS : SHOUTERR_SOCKET;
+
+    for (i = 0; i < ret; i++) {
+        entry = events[i].data.ptr;
+        /* the ring, its completions are reaped by shout_loop_iter() */
+        if (!entry)
+            continue;
+        if (events[i].events & EPOLLIN)
+            entry->revents |= SHOUT_IO_READ;
+        if (events[i].events & EPOLLOUT)
+            entry->revents |= SHOUT_IO_WRITE;
+        if (events[i].events & (EPOLLERR|EPOLLHUP))
+            entry->revents |= SHOUT_IO_ERROR;
+    }
+
+    return SHOUTERR_SUCCESS;
+#elif defined(HAVE_POLL_H)
+    shout_loop_entry_t *entry;
+    size_t              len = 0;
+    size_t              size = loop->len + 1;
+    size_t              i;
+    int                 ret;
+
+    /* one more for the ring */
+    if (loop->pollfds_len < size) {
+        struct pollfd *pollfds = realloc(loop->pollfds, sizeof(*pollfds) * size);
+        shout_loop_entry_t **pollentries;
+
+        if (!pollfds)
+            return SHOUTERR_MALLOC;
+        loop->pollfds = pollfds;
+
+        pollentries = realloc(loop->pollentries, sizeof(*pollentries) * size);
+        if (!pollentries)
+            return SHOUTERR_MALLOC;
+        loop->pollentries = pollentries;
+
+        loop->pollfds_len = size;
+    }
+
+    for (entry = loop->entries; entry; entry = entry->next) {
+        if (entry->removed || entry->registered == SOCK_ERROR)
+            continue;
+        loop->pollfds[len].fd = entry->registered;
+        loop->pollfds[len].events = 0;
+        loop->pollfds[len].revents = 0;
+        if (entry->registered_events & SHOUT_IO_READ)
+            loop->pollfds[len].events |= POLLIN;
+        if (entry->registered_events & SHOUT_IO_WRITE)
+            loop->pollfds[len].events |= POLLOUT;
+        loop->pollentries[len] = entry;
+        len++;
+    }
+
+#ifdef HAVE_LIBURING
+    if (loop->uring) {
+        /* its completions are reaped by shout_loop_iter() */
+        loop->pollfds[len].fd = shout_uring_get_fd(loop->uring);
+        loop->pollfds[len].events = POLLIN;
+        loop->pollfds[len].revents = 0;
+        loop->pollentries[len] = NULL;
+        len++;
+    }
+#endif
+
+    ret = poll(loop->pollfds, len, timeout);
+    if (ret < 0)
+        return errno == EINTR ? SHOUTERR_SUCCESS : SHOUTERR_SOCKET;
+
+    for (i = 0; i < len && ret; i++) {
+        short revents = loop->pollfds[i].revents;
+
+        if (!revents)
+            continue;
+        ret--;
+
+        entry = loop->pollentries[i];
+        if (!entry)
+            continue;
+        if (revents & POLLIN)
+            entry->revents |= SHOUT_IO_READ;
+        if (revents & POLLOUT)
+            entry->revents |= SHOUT_IO_WRITE;
+        if (revents & (POLLERR|POLLHUP|POLLNVAL))
+            entry->revents |= SHOUT_IO_ERROR;
+    }
+
+    return SHOUTERR_SUCCESS;
+#else
+    (void)loop;
+    (void)timeout;
+
+    return SHOUTERR_UNSUPPORTED;
+#endif
+}
+
+int shout_loop_iter(shout_loop_t *loop, int timeout)
+{
+    shout_loop_entry_t **link;
+    shout_loop_entry_t *entry;
+    uint64_t            now;
+    int                 count = 0;
+    int                 ret;
+
+    if (!loop)
+        return SHOUTERR_INSANE;
+
+    now = timing_get_time();
+    for (entry = loop->entries; entry; entry = entry->next)
+        shout_loop_sync(loop, entry, now, &timeout);
+
+#ifdef HAVE_LIBURING
+    /* everything prepared since the last iteration goes in at once */
+    if (loop->uring)
+        shout_uring_submit(loop->uring);
+#endif
+
+    ret = shout_loop_wait(loop, timeout);
+    if (ret != SHOUTERR_SUCCESS)
+        return ret;
+
+#ifdef HAVE_LIBURING
+    if (loop->uring) {
+        shout_uring_reap(loop->uring);
+        for (entry = loop->entries; entry; entry = entry->next) {
+            if (entry->con && entry->con->uring_ready) {
+                entry->con->uring_ready = 0;
+                entry->revents |= SHOUT_IO_WRITE;
+            }
+        }
+    }
+#endif
+
+    now = timing_get_time();
+    loop->dispatching = 1;
+    for (entry = loop->entries; entry; entry = entry->next) {
+        /* skip instances closed or reopened by a callback */
+        if (entry->removed || entry->con != entry->shout->connection)
+            continue;
+        if (!entry->con && !entry->shout->reconnecting)
+            continue;
+        if (!entry->revents && !(entry->deadline && entry->deadline <= now))
+            continue;
+        shout_loop_drive(loop, entry);
+        count++;
+    }
+    loop->dispatching = 0;
+
+    /* free entries removed by callbacks */
+    link = &(loop->entries);
+    while ((entry = *link)) {
+        if (entry->removed) {
+            *link = entry->next;
+            shout_loop_entry_free(entry);
+        } else {
+            link = &(entry->next);
+        }
+    }
+
+    return count;
+}
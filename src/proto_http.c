@@ -43,6 +43,127 @@ typedef enum {
     STATE_POKE
 } shout_http_protocol_state_t;
 
+/* Server capabilities learned by earlier connections are kept for
+ * SHOUT_HTTP_CAPS_TTL so reconnects can skip the probing round trips. */
+#define SHOUT_HTTP_CAPS_TTL     (300*1000) /* [ms] */
+#define SHOUT_HTTP_CAPS_ENTRIES 64
+/* capabilities of the server itself, the others are state of a connection */
+#define SHOUT_HTTP_CAPS_SERVER  (LIBSHOUT_CAP_SOURCE|LIBSHOUT_CAP_PUT|LIBSHOUT_CAP_GET|LIBSHOUT_CAP_POST|\
+                                 LIBSHOUT_CAP_OPTIONS|LIBSHOUT_CAP_CHUNKED|LIBSHOUT_CAP_100CONTINUE|LIBSHOUT_CAP_UPGRADETLS)
+
+typedef struct {
+    char        host[256];
+    int         port;
+    uint32_t    caps;
+    int         tls_mode; /* SHOUT_TLS_DISABLED, SHOUT_TLS_RFC2817 or SHOUT_TLS_RFC2818 */
+    uint64_t    stamp;
+} shout_http_caps_entry_t;
+
+static shout_http_caps_entry_t  shout_http_caps_cache[SHOUT_HTTP_CAPS_ENTRIES];
+static _shout_util_mutex_t      shout_http_caps_lock = _SHOUT_UTIL_MUTEX_INITIALIZER;
+
+/* Must be called with the lock held. */
+static shout_http_caps_entry_t *shout_http_caps_find(const char *host, int port)
+{
+    size_t i;
+
+    for (i = 0; i < SHOUT_HTTP_CAPS_ENTRIES; i++) {
+        if (shout_http_caps_cache[i].stamp && shout_http_caps_cache[i].port == port &&
+            strcmp(shout_http_caps_cache[i].host, host) == 0)
+            return &(shout_http_caps_cache[i]);
+    }
+
+    return NULL;
+}
+
+static int shout_http_caps_lookup(shout_t *self, uint32_t *caps, int *tls_mode)
+{
+    shout_http_caps_entry_t *entry;
+    int found = 0;
+
+    if (!self->host)
+        return 0;
+
+    _shout_util_mutex_lock(&shout_http_caps_lock);
+    entry = shout_http_caps_find(self->host, self->port);
+    if (entry) {
+        if ((timing_get_time() - entry->stamp) < SHOUT_HTTP_CAPS_TTL) {
+            *caps = entry->caps;
+            *tls_mode = entry->tls_mode;
+            found = 1;
+        } else {
+            entry->stamp = 0;
+        }
+    }
+    _shout_util_mutex_unlock(&shout_http_caps_lock);
+
+    return found;
+}
+
+static void shout_http_caps_store(shout_t *self, shout_connection_t *connection)
+{
+    shout_http_caps_entry_t *entry;
+    size_t i;
+
+    if (!self->host || strlen(self->host) >= sizeof(entry->host))
+        return;
+
+    _shout_util_mutex_lock(&shout_http_caps_lock);
+    entry = shout_http_caps_find(self->host, self->port);
+    if (!entry) {
+        /* replace the oldest entry */
+        entry = &(shout_http_caps_cache[0]);
+        for (i = 1; i < SHOUT_HTTP_CAPS_ENTRIES; i++) {
+            if (shout_http_caps_cache[i].stamp < entry->stamp)
+                entry = &(shout_http_caps_cache[i]);
+        }
+        strcpy(entry->host, self->host);
+        entry->port = self->port;
+    }
+    entry->caps = connection->server_caps & SHOUT_HTTP_CAPS_SERVER;
+#ifdef HAVE_OPENSSL
+    if (connection->tls) {
+        entry->tls_mode = connection->selected_tls_mode == SHOUT_TLS_RFC2818 ? SHOUT_TLS_RFC2818 : SHOUT_TLS_RFC2817;
+    } else
+#endif
+    entry->tls_mode = SHOUT_TLS_DISABLED;
+    entry->stamp = timing_get_time();
+    _shout_util_mutex_unlock(&shout_http_caps_lock);
+}
+
+static void shout_http_caps_forget(shout_t *self)
+{
+    shout_http_caps_entry_t *entry;
+
+    if (!self->host)
+        return;
+
+    _shout_util_mutex_lock(&shout_http_caps_lock);
+    entry = shout_http_caps_find(self->host, self->port);
+    if (entry)
+        entry->stamp = 0;
+    _shout_util_mutex_unlock(&shout_http_caps_lock);
+}
+
+#ifdef HAVE_OPENSSL
+/* Selects RFC 2818 for a server cached as needing it. Called before the
+ * connection is made, so there is no plain connection first.
+ */
+void shout_http_select_cached_tlsmode(shout_t *self, shout_connection_t *connection)
+{
+    uint32_t caps;
+    int tls_mode;
+
+    if (connection->selected_tls_mode != SHOUT_TLS_AUTO && connection->selected_tls_mode != SHOUT_TLS_AUTO_NO_PLAIN)
+        return;
+
+    if (!shout_http_caps_lookup(self, &caps, &tls_mode) || tls_mode != SHOUT_TLS_RFC2818)
+        return;
+
+    shout_connection_select_tlsmode(connection, SHOUT_TLS_RFC2818);
+}
+#endif
+
 static char *shout_http_basic_authorization(shout_t *self)
 {
     char *out, *in;
@@ -244,6 +365,67 @@ static shout_connection_return_state_t shout_create_http_request_generic(shout_t
     return ret == SHOUTERR_SUCCESS ? SHOUT_RS_DONE : SHOUT_RS_ERROR;
 }
 
+/* Uses cached server capabilities to skip straight to the source request.
+ * Returns SHOUT_RS_DONE if the request can be created now, or
+ * SHOUT_RS_NOTNOW if the connection needs to be set up again first.
+ */
+static shout_connection_return_state_t shout_create_http_request__apply_cache(shout_t *self, shout_connection_t *connection)
+{
+    uint32_t caps;
+    int tls_mode;
+    int have_tls = 0;
+
+    if (connection->server_caps & (LIBSHOUT_CAP_GOTCAPS|LIBSHOUT_CAP_CHALLENGED))
+        return SHOUT_RS_DONE;
+
+    if (!shout_http_caps_lookup(self, &caps, &tls_mode))
+        return SHOUT_RS_DONE;
+
+#ifdef HAVE_OPENSSL
+    have_tls = connection->tls != NULL;
+#endif
+
+    if (have_tls) {
+        if (tls_mode == SHOUT_TLS_DISABLED)
+            return SHOUT_RS_DONE;
+    } else {
+        switch (connection->selected_tls_mode) {
+            case SHOUT_TLS_DISABLED:
+            case SHOUT_TLS_AUTO:
+            case SHOUT_TLS_AUTO_NO_PLAIN:
+            case SHOUT_TLS_RFC2817:
+            break;
+            default:
+                return SHOUT_RS_DONE;
+            break;
+        }
+
+        if (tls_mode == SHOUT_TLS_DISABLED) {
+            if (connection->selected_tls_mode != SHOUT_TLS_DISABLED && connection->selected_tls_mode != SHOUT_TLS_AUTO)
+                return SHOUT_RS_DONE;
+        } else if (connection->selected_tls_mode == SHOUT_TLS_DISABLED) {
+            return SHOUT_RS_DONE;
+        }
+    }
+
+    connection->server_caps |= caps | LIBSHOUT_CAP_GOTCAPS | LIBSHOUT_CAP_CHALLENGED | LIBSHOUT_CAP_CACHED;
+
+    if (!have_tls && tls_mode == SHOUT_TLS_RFC2818) {
+        /* reconnect with TLS right away instead of probing for it */
+        shout_connection_select_tlsmode(connection, SHOUT_TLS_RFC2818);
+        return shout_parse_http_select_next_state(self, connection, 0, STATE_SOURCE);
+    }
+
+    if (!have_tls && tls_mode == SHOUT_TLS_RFC2817) {
+        /* after the upgrade the source request follows as we are challenged */
+        connection->current_protocol_state = STATE_UPGRADE;
+    } else {
+        connection->current_protocol_state = STATE_SOURCE;
+    }
+
+    return SHOUT_RS_DONE;
+}
+
 static shout_connection_return_state_t shout_create_http_request(shout_t *self, shout_connection_t *connection)
 {
     const shout_http_plan_t *plan = connection->plan;
@@ -253,6 +435,12 @@ static shout_connection_return_state_t shout_create_http_request(shout_t *self,
         return SHOUT_RS_ERROR;
     }
 
+    if (plan->is_source && connection->current_protocol_state == STATE_CHALLENGE) {
+        shout_connection_return_state_t ret = shout_create_http_request__apply_cache(self, connection);
+        if (ret != SHOUT_RS_DONE)
+            return ret;
+    }
+
 #ifdef HAVE_OPENSSL
     if (!connection->tls) {
         /* Why not try Upgrade? */
@@ -340,7 +528,7 @@ static shout_connection_return_state_t shout_get_http_response(shout_t *self, sh
     /* work from the back looking for \r?\n\r?\n. Anything else means more
      * is coming.
      */
-    for (queue = connection->rqueue.head; queue->next; queue = queue->next) ;
+    queue = connection->rqueue.tail;
     pc = (char*)queue->data + queue->len - 1;
     blen = queue->len;
     while (blen) {
@@ -539,6 +727,7 @@ static shout_connection_return_state_t shout_parse_http_response(shout_t *self,
         if ((code == 100 || (code >= 200 && code < 300)) && connection->current_protocol_state == STATE_SOURCE) {
             httpp_destroy(parser);
             free(header);
+            shout_http_caps_store(self, connection);
             connection->current_message_state = SHOUT_MSGSTATE_SENDING1;
             connection->target_message_state = SHOUT_MSGSTATE_WAITING1;
             return SHOUT_RS_DONE;
@@ -624,6 +813,11 @@ failure:
             break;
         }
     }
+
+    /* the server may have changed, probe again next time */
+    if (connection->server_caps & LIBSHOUT_CAP_CACHED)
+        shout_http_caps_forget(self);
+
     shout_connection_set_error(connection, SHOUTERR_NOLOGIN);
     return SHOUT_RS_ERROR;
 }
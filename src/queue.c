@@ -32,6 +32,64 @@
 #include <shout/shout.h>
 #include "shout_private.h"
 
+/* largest chunk of caller memory a single reference node covers */
+#define SHOUT_QUEUE_REF_MAX     (1U << 30)
+
+static shout_buf_t *shout_queue_page_new(shout_queue_t *queue)
+{
+    shout_buf_t *buf;
+
+    if (queue->pool) {
+        buf = queue->pool;
+        queue->pool = buf->next;
+        queue->pool_len--;
+        buf->len = 0;
+        buf->pos = 0;
+        buf->zerocopy_pending = 0;
+        buf->prev = NULL;
+        buf->next = NULL;
+        return buf;
+    }
+
+    buf = calloc(1, sizeof(shout_buf_t) + SHOUT_BUFSIZE);
+    if (!buf)
+        return NULL;
+
+    buf->data = buf->storage;
+
+    return buf;
+}
+
+static void shout_queue_page_release(shout_queue_t *queue, shout_buf_t *buf)
+{
+    if (SHOUT_BUF_IS_REF(buf)) {
+        if (buf->release)
+            buf->release(buf->release_userdata);
+        free(buf);
+        return;
+    }
+
+    if (queue->pool_len >= SHOUT_QUEUE_POOL_MAX) {
+        free(buf);
+        return;
+    }
+
+    buf->next = queue->pool;
+    queue->pool = buf;
+    queue->pool_len++;
+}
+
+static void shout_queue_append(shout_queue_t *queue, shout_buf_t *buf)
+{
+    buf->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = buf;
+    } else {
+        queue->head = buf;
+    }
+    queue->tail = buf;
+}
+
 /* queue data in pages of SHOUT_BUFSIZE bytes */
 int shout_queue_data(shout_queue_t *queue, const unsigned char *data, size_t len)
 {
@@ -41,24 +99,16 @@ int shout_queue_data(shout_queue_t *queue, const unsigned char *data, size_t len
     if (!len)
         return SHOUTERR_SUCCESS;
 
-    if (!queue->len) {
-        queue->head = calloc(1, sizeof(shout_buf_t));
-        if (!queue->head)
-            return SHOUTERR_MALLOC;
-    }
-
-    for (buf = queue->head; buf->next; buf = buf->next) ;
-
     /* Maybe any added data should be freed if we hit a malloc error?
      * Otherwise it'd be impossible to tell where to start requeueing.
      * (As if anyone ever tried to recover from a malloc error.) */
     while (len > 0) {
-        if (buf->len == SHOUT_BUFSIZE) {
-            buf->next = calloc(1, sizeof(shout_buf_t));
-            if (!buf->next)
+        buf = queue->tail;
+        if (!buf || SHOUT_BUF_IS_REF(buf) || buf->len == SHOUT_BUFSIZE) {
+            buf = shout_queue_page_new(queue);
+            if (!buf)
                 return SHOUTERR_MALLOC;
-            buf->next->prev = buf;
-            buf = buf->next;
+            shout_queue_append(queue, buf);
         }
 
         plen = len > SHOUT_BUFSIZE - buf->len ? SHOUT_BUFSIZE - buf->len : len;
@@ -71,6 +121,181 @@ int shout_queue_data(shout_queue_t *queue, const unsigned char *data, size_t len
     return SHOUTERR_SUCCESS;
 }
 
+/* queue a reference to caller owned memory, release is called with userdata
+ * once all of it has been consumed or the queue is freed. On error nothing
+ * is queued and release has been called already */
+int shout_queue_ref(shout_queue_t *queue, const unsigned char *data, size_t len, shout_release_t release, void *userdata)
+{
+    shout_buf_t *head = NULL;
+    shout_buf_t *tail = NULL;
+    shout_buf_t *buf;
+    size_t       total = len;
+    size_t       plen;
+
+    if (!len) {
+        if (release)
+            release(userdata);
+        return SHOUTERR_SUCCESS;
+    }
+
+    /* huge buffers are split, only the last node releases the memory.
+     * All nodes are allocated before any of them is queued. */
+    while (len > 0) {
+        buf = calloc(1, sizeof(shout_buf_t));
+        if (!buf) {
+            while (head) {
+                buf = head->next;
+                free(head);
+                head = buf;
+            }
+            if (release)
+                release(userdata);
+            return SHOUTERR_MALLOC;
+        }
+
+        plen = len > SHOUT_QUEUE_REF_MAX ? SHOUT_QUEUE_REF_MAX : len;
+        buf->data = (unsigned char*)data;
+        buf->len = plen;
+        if (plen == len) {
+            buf->release = release;
+            buf->release_userdata = userdata;
+        }
+        buf->prev = tail;
+        if (tail) {
+            tail->next = buf;
+        } else {
+            head = buf;
+        }
+        tail = buf;
+
+        data += plen;
+        len -= plen;
+    }
+
+    head->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = head;
+    } else {
+        queue->head = head;
+    }
+    queue->tail = tail;
+    queue->len += total;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* mark len bytes from the head of the queue as consumed,
+ * len must not be larger than what is left in the head page */
+void shout_queue_advance(shout_queue_t *queue, size_t len)
+{
+    shout_buf_t *buf = queue->head;
+
+    if (!buf)
+        return;
+
+    buf->pos += len;
+    queue->len -= len;
+
+    if (buf->pos < buf->len)
+        return;
+
+    queue->head = buf->next;
+    if (queue->head) {
+        queue->head->prev = NULL;
+    } else {
+        queue->tail = NULL;
+    }
+
+    if (buf->zerocopy_pending) {
+        /* the kernel still references the data, keep it until completion */
+        buf->next = NULL;
+        buf->prev = queue->inflight_tail;
+        if (queue->inflight_tail) {
+            queue->inflight_tail->next = buf;
+        } else {
+            queue->inflight = buf;
+        }
+        queue->inflight_tail = buf;
+        return;
+    }
+
+    shout_queue_page_release(queue, buf);
+}
+
+/* remove len bytes starting offset bytes after the current read position.
+ * Returns SHOUTERR_BUSY if the range touches caller owned memory or data
+ * the kernel may still read, in which case the queue is left untouched. */
+int shout_queue_cut(shout_queue_t *queue, size_t offset, size_t len)
+{
+    shout_buf_t *first;
+    shout_buf_t *buf;
+    shout_buf_t *next;
+    size_t       avail;
+    size_t       left;
+    size_t       n;
+
+    if (offset + len > queue->len)
+        return SHOUTERR_INSANE;
+
+    /* find the page the range starts in */
+    for (first = queue->head; first && offset >= (avail = first->len - first->pos); first = first->next)
+        offset -= avail;
+
+    for (buf = first, left = len + offset; buf && left; buf = buf->next) {
+        if (SHOUT_BUF_IS_REF(buf) || buf->zerocopy_pending)
+            return SHOUTERR_BUSY;
+        avail = buf->len - buf->pos;
+        left -= avail < left ? avail : left;
+    }
+
+    for (buf = first, left = len; buf && left; buf = next) {
+        next = buf->next;
+        avail = buf->len - buf->pos;
+        n = avail - offset;
+        if (n > left)
+            n = left;
+
+        if (n == avail) {
+            /* whole page */
+            if (buf->prev) {
+                buf->prev->next = buf->next;
+            } else {
+                queue->head = buf->next;
+            }
+            if (buf->next) {
+                buf->next->prev = buf->prev;
+            } else {
+                queue->tail = buf->prev;
+            }
+            shout_queue_page_release(queue, buf);
+        } else {
+            memmove(buf->data + buf->pos + offset, buf->data + buf->pos + offset + n, avail - offset - n);
+            buf->len -= n;
+        }
+
+        left -= n;
+        offset = 0;
+    }
+
+    queue->len -= len;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* release buffers whose zerocopy sends before id done have completed */
+void shout_queue_complete(shout_queue_t *queue, uint32_t done)
+{
+    shout_buf_t *buf;
+
+    while ((buf = queue->inflight) && (int32_t)(buf->zerocopy_id - done) < 0) {
+        queue->inflight = buf->next;
+        if (!queue->inflight)
+            queue->inflight_tail = NULL;
+        buf->zerocopy_pending = 0;
+        shout_queue_page_release(queue, buf);
+    }
+}
+
 int shout_queue_str(shout_connection_t *self, const char *str)
 {
     return shout_queue_data(&self->wqueue, (const unsigned char*)str, strlen(str));
@@ -120,9 +345,28 @@ void shout_queue_free(shout_queue_t *queue)
     while (queue->head) {
         prev = queue->head;
         queue->head = queue->head->next;
+        if (SHOUT_BUF_IS_REF(prev) && prev->release)
+            prev->release(prev->release_userdata);
         free(prev);
     }
+    queue->tail = NULL;
     queue->len = 0;
+
+    while (queue->inflight) {
+        prev = queue->inflight;
+        queue->inflight = queue->inflight->next;
+        if (SHOUT_BUF_IS_REF(prev) && prev->release)
+            prev->release(prev->release_userdata);
+        free(prev);
+    }
+    queue->inflight_tail = NULL;
+
+    while (queue->pool) {
+        prev = queue->pool;
+        queue->pool = queue->pool->next;
+        free(prev);
+    }
+    queue->pool_len = 0;
 }
 
 /* collect nodes of a queue into a single buffer */
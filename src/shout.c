@@ -33,6 +33,12 @@
 #   include <strings.h>
 #endif
 #include <errno.h>
+#ifdef HAVE_POLL_H
+#   include <poll.h>
+#elif defined(HAVE_WINSOCK2_H)
+/* the flags of WSAPoll(), from Windows Vista on */
+#   include <winsock2.h>
+#endif
 
 #include <shout/shout.h>
 
@@ -51,9 +57,33 @@
 #   define inline         _inline
 #endif
 
+/* poll(2) event flags as used by shout_get_pollfd() and shout_process(),
+ * only for systems that have no poll() at all. The values are the
+ * traditional System V ones.
+ */
+#ifndef POLLIN
+#   define POLLIN   0x0001
+#endif
+#ifndef POLLOUT
+#   define POLLOUT  0x0004
+#endif
+#ifndef POLLERR
+#   define POLLERR  0x0008
+#endif
+#ifndef POLLHUP
+#   define POLLHUP  0x0010
+#endif
+
 /* -- local prototypes -- */
 static int shout_cb_connection_callback(shout_connection_t *con, shout_event_t event, void *userdata, va_list ap);
 static int try_connect(shout_t *self);
+static void shout_stats_add(shout_stats_t *to, const shout_stats_t *from);
+static void shout_drop_connection(shout_t *self);
+static int shout_reconnect__wanted(shout_t *self);
+static int shout_reconnect__begin(shout_t *self);
+static int shout_reconnect__iter(shout_t *self);
+static ssize_t shout_reconnect__buffer(shout_t *self, const unsigned char *data, size_t len);
+static void shout_reconnect__stop(shout_t *self);
 
 /* -- static data -- */
 static int _initialized = 0;
@@ -74,6 +104,10 @@ void shout_shutdown(void)
     if (!_initialized)
         return;
 
+#ifdef HAVE_OPENSSL
+    shout_tls_cache_free();
+#endif
+    shout_dns_cache_free();
     sock_shutdown();
     _initialized = 0;
 }
@@ -142,6 +176,9 @@ void shout_free(shout_t *self)
     if (!self)
         return;
 
+    if (self->loop)
+        shout_loop_remove(self->loop, self);
+
     if (!self->connection)
         return;
 
@@ -162,6 +199,9 @@ void shout_free(shout_t *self)
     if (self->meta)
         _shout_util_dict_free (self->meta);
 
+    shout_queue_free(&(self->reconnect_buffer));
+    shout_queue_free(&(self->stream_header));
+
 #ifdef HAVE_OPENSSL
     if (self->ca_directory)
         free(self->ca_directory);
@@ -181,7 +221,8 @@ int shout_open(shout_t *self)
     /* sanity check */
     if (!self)
         return SHOUTERR_INSANE;
-    if (self->connection)
+    /* a stream that failed to reconnect still needs shout_close() */
+    if (self->connection || self->reconnecting || self->send)
         return SHOUTERR_CONNECTED;
     if (!self->host || !self->password || !self->port)
         return self->error = SHOUTERR_INSANE;
@@ -197,18 +238,21 @@ int shout_close(shout_t *self)
     if (!self)
         return SHOUTERR_INSANE;
 
-    if (!self->connection)
+    if (!self->connection && !self->reconnecting && !self->send)
         return self->error = SHOUTERR_UNCONNECTED;
 
-    if (self->connection && self->connection->current_message_state == SHOUT_MSGSTATE_SENDING1 && self->close) {
+    /* the format stays open while reconnecting and after a reconnect failed */
+    if (self->send && self->close) {
         self->close(self);
         self->format_data = NULL;
         self->send = NULL;
         self->close = NULL;
     }
 
-    shout_connection_unref(self->connection);
-    self->connection = NULL;
+    /* the stream header is kept, the stream may go on after shout_open() */
+    shout_reconnect__stop(self);
+
+    shout_drop_connection(self);
     self->starttime = 0;
     self->senttime = 0;
 
@@ -220,14 +264,45 @@ int shout_send(shout_t *self, const unsigned char *data, size_t len)
     if (!self)
         return SHOUTERR_INSANE;
 
-    if (!self->connection || self->connection->current_message_state != SHOUT_MSGSTATE_SENDING1)
+    if (!self->reconnecting && (!self->connection || self->connection->current_message_state != SHOUT_MSGSTATE_SENDING1))
         return self->error = SHOUTERR_UNCONNECTED;
 
     if (self->starttime <= 0)
         self->starttime = timing_get_time();
 
-    if (!len)
-        return shout_connection_iter(self->connection, self);
+    if (!len) {
+        int ret;
+
+        if (self->reconnecting)
+            return shout_reconnect__iter(self);
+
+        ret = shout_connection_iter(self->connection, self);
+        if (ret == SHOUTERR_SOCKET && shout_reconnect__wanted(self)) {
+            ret = shout_reconnect__begin(self);
+            if (ret == SHOUTERR_SUCCESS)
+                ret = shout_reconnect__iter(self);
+        }
+        return ret;
+    }
+
+    if (!self->reconnecting && self->queue_limit && shout_connection_queue_full(self->connection) > 0) {
+        int ret;
+
+        switch (self->queue_limit_policy) {
+            case SHOUT_QUEUE_POLICY_ERROR:
+                return self->error = SHOUTERR_QUEUEFULL;
+            break;
+            case SHOUT_QUEUE_POLICY_BLOCK:
+                ret = shout_connection_wait_queue(self->connection, self);
+                if (ret == SHOUTERR_BUSY)
+                    return self->error = SHOUTERR_BUSY;
+                if (ret != SHOUTERR_SUCCESS) {
+                    shout_connection_transfer_error(self->connection, self);
+                    return self->error = ret;
+                }
+            break;
+        }
+    }
 
     return self->send(self, data, len);
 }
@@ -239,23 +314,236 @@ ssize_t shout_send_raw(shout_t *self, const unsigned char *data, size_t len)
     if (!self)
         return SHOUTERR_INSANE;
 
+    if (self->reconnecting)
+        return shout_reconnect__buffer(self, data, len);
+
     if (!self->connection || self->connection->current_message_state != SHOUT_MSGSTATE_SENDING1)
         return SHOUTERR_UNCONNECTED;
 
+    /* data is not taken by a connection known to be lost */
+    if (shout_reconnect__wanted(self)) {
+        ret = shout_reconnect__begin(self);
+        if (ret != SHOUTERR_SUCCESS)
+            return self->error = ret;
+        return shout_reconnect__buffer(self, data, len);
+    }
+
     ret = shout_connection_send(self->connection, self, data, len);
+    if (ret < 0 && shout_reconnect__wanted(self)) {
+        /* the data was queued before the connection failed */
+        ret = shout_reconnect__begin(self);
+        if (ret != SHOUTERR_SUCCESS)
+            return self->error = ret;
+        ret = shout_reconnect__iter(self);
+        if (ret != SHOUTERR_SUCCESS)
+            return self->error = ret;
+        return len;
+    }
     if (ret < 0)
        shout_connection_transfer_error(self->connection, self);
     return ret;
 }
 
+int shout_send_zc(shout_t *self, const void *buf, size_t len, void (*release)(void *userdata), void *userdata)
+{
+    int ret;
+
+    if (!self || (!buf && len)) {
+        if (release)
+            release(userdata);
+        return SHOUTERR_INSANE;
+    }
+
+    if (!self->reconnecting && (!self->connection || self->connection->current_message_state != SHOUT_MSGSTATE_SENDING1)) {
+        if (release)
+            release(userdata);
+        return self->error = SHOUTERR_UNCONNECTED;
+    }
+
+    if (!self->reconnecting) {
+        ret = shout_connection_send_ref(self->connection, self, buf, len, release, userdata);
+        if (ret != SHOUTERR_SOCKET || !shout_reconnect__wanted(self)) {
+            if (ret != SHOUTERR_SUCCESS)
+               shout_connection_transfer_error(self->connection, self);
+            /* only a socket error leaves the buffer with us */
+            if (ret == SHOUTERR_SOCKET && release)
+                release(userdata);
+            return self->error = ret;
+        }
+
+        /* the buffer was not taken, keep a copy for the new connection */
+        ret = shout_reconnect__begin(self);
+        if (ret != SHOUTERR_SUCCESS) {
+            if (release)
+                release(userdata);
+            return self->error = ret;
+        }
+    }
+
+    ret = shout_reconnect__buffer(self, buf, len) < 0 ? self->error : SHOUTERR_SUCCESS;
+    if (release)
+        release(userdata);
+    return self->error = ret;
+}
+
 ssize_t shout_queuelen(shout_t *self)
 {
     if (!self)
         return -1;
 
+    if (self->reconnecting) {
+        /* what is queued on the connection until it is ready is protocol data */
+        return self->reconnect_buffer.len;
+    }
+
     return shout_connection_get_sendq(self->connection, self);
 }
 
+int shout_set_queue_limit(shout_t *self, size_t limit, unsigned int unit, unsigned int policy)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (unit > SHOUT_QUEUE_UNIT_MS || policy > SHOUT_QUEUE_POLICY_DROP_NEWEST)
+        return self->error = SHOUTERR_INSANE;
+
+    self->queue_limit = limit;
+    self->queue_limit_unit = unit;
+    self->queue_limit_policy = policy;
+
+    if (self->connection)
+        shout_connection_set_queue_limit(self->connection, limit, unit, policy);
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_get_queue_limit(shout_t *self, size_t *limit, unsigned int *unit, unsigned int *policy)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (limit)
+        *limit = self->queue_limit;
+    if (unit)
+        *unit = self->queue_limit_unit;
+    if (policy)
+        *policy = self->queue_limit_policy;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_set_queue_watermarks(shout_t *self, size_t high, size_t low)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (high && low >= high)
+        return self->error = SHOUTERR_INSANE;
+
+    self->queue_high = high;
+    self->queue_low = low;
+
+    if (self->connection)
+        shout_connection_set_queue_watermarks(self->connection, high, low);
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_get_queue_watermarks(shout_t *self, size_t *high, size_t *low)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (high)
+        *high = self->queue_high;
+    if (low)
+        *low = self->queue_low;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_set_reconnect(shout_t *self, unsigned int attempts, unsigned int delay_min, unsigned int delay_max, size_t buffer)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (attempts && (!delay_min || delay_min > delay_max || !buffer))
+        return self->error = SHOUTERR_INSANE;
+
+    self->reconnect_attempts = attempts;
+    self->reconnect_delay_min = delay_min;
+    self->reconnect_delay_max = delay_max;
+    self->reconnect_buffer_max = buffer;
+
+    if (self->connection)
+        shout_connection_set_salvage(self->connection, attempts > 0);
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_get_reconnect(shout_t *self, unsigned int *attempts, unsigned int *delay_min, unsigned int *delay_max, size_t *buffer)
+{
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (attempts)
+        *attempts = self->reconnect_attempts;
+    if (delay_min)
+        *delay_min = self->reconnect_delay_min;
+    if (delay_max)
+        *delay_max = self->reconnect_delay_max;
+    if (buffer)
+        *buffer = self->reconnect_buffer_max;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+/* Formats keep the codec headers of the stream here, so a new connection
+ * can be sent them before the data that follows.
+ */
+int shout_stream_header_add(shout_t *self, const unsigned char *data, size_t len)
+{
+    if (self->stream_header.len + len > LIBSHOUT_STREAM_HEADER_MAX) {
+        /* not headers as we know them, do not replay them at all */
+        shout_stream_header_reset(self);
+        return SHOUTERR_INSANE;
+    }
+
+    return shout_queue_data(&(self->stream_header), data, len);
+}
+
+void shout_stream_header_reset(shout_t *self)
+{
+    shout_queue_free(&(self->stream_header));
+}
+
+int shout_get_stats(shout_t *self, shout_stats_t *stats)
+{
+    int ret;
+
+    if (!self || !stats)
+        return SHOUTERR_INSANE;
+
+    if (!self->connects) {
+        memset(stats, 0, sizeof(*stats));
+        return self->error = SHOUTERR_UNCONNECTED;
+    }
+
+    if (self->connection) {
+        ret = shout_connection_get_stats(self->connection, stats);
+        if (ret != SHOUTERR_SUCCESS)
+            return self->error = ret;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+
+    /* add the connections before this one */
+    shout_stats_add(stats, &(self->stats));
+    stats->connects = self->connects;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
 
 void shout_sync(shout_t *self)
 {
@@ -285,6 +573,104 @@ int shout_delay(shout_t *self)
     return self->senttime / 1000 - (timing_get_time() - self->starttime);
 }
 
+int shout_get_pollfd(shout_t *self, int *fd, short *events, uint64_t *timeout_ms)
+{
+    sock_t  socket;
+    int     io_events;
+    int     timeout;
+    int     ret;
+
+    if (!self || !fd || !events || !timeout_ms)
+        return SHOUTERR_INSANE;
+
+    if (self->nonblocking != SHOUT_BLOCKING_NONE)
+        return self->error = SHOUTERR_INSANE;
+
+    if (self->reconnecting && !self->connection) {
+        /* waiting for the next attempt */
+        uint64_t now = timing_get_time();
+
+        *fd = -1;
+        *events = 0;
+        *timeout_ms = self->reconnect_at > now ? self->reconnect_at - now : 0;
+        return self->error = SHOUTERR_SUCCESS;
+    }
+
+    if (!self->connection)
+        return self->error = SHOUTERR_UNCONNECTED;
+
+    ret = shout_connection_get_pollinfo(self->connection, self, &socket, &io_events, &timeout);
+    if (ret != SHOUTERR_SUCCESS)
+        return self->error = ret;
+
+    /* from now on the caller waits for I/O on our behalf */
+    shout_connection_set_external_io(self->connection, 1);
+
+    *fd = socket;
+    *events = 0;
+    if (io_events & SHOUT_IO_READ)
+        *events |= POLLIN;
+    if (io_events & SHOUT_IO_WRITE)
+        *events |= POLLOUT;
+    *timeout_ms = timeout < 0 ? SHOUT_POLL_TIMEOUT_NONE : (uint64_t)timeout;
+
+    return self->error = SHOUTERR_SUCCESS;
+}
+
+int shout_process(shout_t *self, short revents)
+{
+    int events = 0;
+
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    if (revents & POLLIN)
+        events |= SHOUT_IO_READ;
+    if (revents & POLLOUT)
+        events |= SHOUT_IO_WRITE;
+    if (revents & (POLLERR|POLLHUP))
+        events |= SHOUT_IO_ERROR;
+
+    return shout_process_io(self, events);
+}
+
+int shout_process_io(shout_t *self, int events)
+{
+    shout_connection_t *connection;
+    int ret;
+
+    if (!self)
+        return SHOUTERR_INSANE;
+
+    connection = self->connection;
+    if (!connection && !self->reconnecting)
+        return self->error = SHOUTERR_UNCONNECTED;
+
+    if (connection) {
+        shout_connection_set_external_io(connection, 1);
+        shout_connection_set_io_ready(connection, events);
+    }
+
+    if (self->reconnecting) {
+        ret = shout_reconnect__iter(self);
+    } else if (connection->current_message_state != SHOUT_MSGSTATE_SENDING1) {
+        ret = shout_get_connected(self);
+    } else {
+        ret = shout_connection_iter(connection, self);
+        if (ret == SHOUTERR_SOCKET && shout_reconnect__wanted(self)) {
+            ret = shout_reconnect__begin(self);
+            if (ret == SHOUTERR_SUCCESS)
+                ret = shout_reconnect__iter(self);
+        }
+    }
+
+    /* readiness is only valid for this very call */
+    if (self->connection == connection)
+        shout_connection_set_io_ready(connection, 0);
+
+    return self->error = ret;
+}
+
 shout_metadata_t *shout_metadata_new(void)
 {
     return _shout_util_dict_new();
@@ -493,6 +879,8 @@ const char *shout_get_error(shout_t *self)
         return "TLS connection can not be established because of bad certificate";
     case SHOUTERR_RETRY:
         return "Please retry current operation.";
+    case SHOUTERR_QUEUEFULL:
+        return "Write queue is full";
     default:
         return "Unknown error";
     }
@@ -510,6 +898,13 @@ int shout_get_connected(shout_t *self)
     if (!self)
         return SHOUTERR_INSANE;
 
+    /* the stream stays open while reconnecting */
+    if (self->reconnecting) {
+        if ((rc = shout_reconnect__iter(self)) == SHOUTERR_SUCCESS)
+            return SHOUTERR_CONNECTED;
+        return rc;
+    }
+
     if (self->connection && self->connection->current_message_state == SHOUT_MSGSTATE_SENDING1)
         return SHOUTERR_CONNECTED;
     if (self->connection && self->connection->current_message_state != SHOUT_MSGSTATE_SENDING1) {
@@ -941,6 +1336,17 @@ static const char *shout_get_mimetype(unsigned int format, unsigned int usage, c
                 return "audio/mpeg";
             }
         break;
+        case SHOUT_FORMAT_AAC:
+            /* as for MP3 only audio is valid */
+            if (usage == SHOUT_USAGE_AUDIO) {
+                return "audio/aac";
+            }
+        break;
+        case SHOUT_FORMAT_AACPLUS:
+            if (usage == SHOUT_USAGE_AUDIO) {
+                return "audio/aacp";
+            }
+        break;
         case SHOUT_FORMAT_WEBM:
             if (is_audio(usage)) {
                 return "audio/webm";
@@ -983,6 +1389,10 @@ int shout_set_content_format(shout_t *self, unsigned int format, unsigned int us
         return self->error = SHOUTERR_UNSUPPORTED;
     }
 
+    /* headers of another format are of no use */
+    if (format != self->format)
+        shout_stream_header_reset(self);
+
     self->format = format;
     self->usage  = usage;
 
@@ -1282,6 +1692,52 @@ int shout_control(shout_t *self, shout_control_t control, ...)
             ret = SHOUTERR_UNSUPPORTED;
         break;
 #endif
+        case SHOUT_CONTROL_GET_DIRECT_WRITE_BYTES:
+            if (self->connection) {
+                uint64_t *bytes = va_arg(ap, uint64_t *);
+                ret = shout_connection_control(self->connection, control, bytes);
+            } else {
+                ret = SHOUTERR_UNCONNECTED;
+            }
+        break;
+        case SHOUT_CONTROL_SET_ZEROCOPY: {
+            int enable = va_arg(ap, int) ? 1 : 0;
+
+            if (self->connection) {
+                ret = shout_connection_control(self->connection, control, enable);
+            } else {
+                /* probe for support, the connection is configured by try_connect() */
+                shout_connection_t probe;
+                memset(&probe, 0, sizeof(probe));
+                ret = shout_connection_control(&probe, control, enable);
+            }
+            if (ret == SHOUTERR_SUCCESS)
+                self->zerocopy = enable;
+        }
+        break;
+        case SHOUT_CONTROL_SET_KTLS:
+#ifdef SHOUT_HAVE_KTLS
+            self->ktls = va_arg(ap, int) ? 1 : 0;
+            ret = SHOUTERR_SUCCESS;
+#else
+            ret = SHOUTERR_UNSUPPORTED;
+#endif
+        break;
+        case SHOUT_CONTROL_SET_STRIP_TAGS:
+            self->strip_tags = va_arg(ap, int) ? 1 : 0;
+            ret = SHOUTERR_SUCCESS;
+        break;
+        case SHOUT_CONTROL_GET_DURATION: {
+            uint64_t *ms = va_arg(ap, uint64_t *);
+
+            if (ms) {
+                *ms = self->duration / 1000;
+                ret = SHOUTERR_SUCCESS;
+            } else {
+                ret = SHOUTERR_INSANE;
+            }
+        }
+        break;
         case SHOUT_CONTROL__MIN:
         case SHOUT_CONTROL__MAX:
             ret = SHOUTERR_INSANE;
@@ -1330,6 +1786,10 @@ static int shout_cb_connection_callback(shout_connection_t *con, shout_event_t e
         case SHOUT_EVENT_TLS_CHECK_PEER_CERTIFICATE:
             return shout_call_callback(self, event, con);
         break;
+        case SHOUT_EVENT_QUEUE_HIGH:
+        case SHOUT_EVENT_QUEUE_LOW:
+            return shout_call_callback(self, event, va_arg(ap, size_t));
+        break;
         case SHOUT_EVENT__MIN:
         case SHOUT_EVENT__MAX:
             return SHOUTERR_INSANE;
@@ -1368,11 +1828,29 @@ static int try_connect(shout_t *self)
         self->connection = shout_connection_new(self, impl, &(self->source_plan));
         if (!self->connection)
             return self->error = SHOUTERR_MALLOC;
+        self->connects++;
 
         shout_connection_set_callback(self->connection, shout_cb_connection_callback, self);
+        if (self->loop)
+            shout_connection_set_external_io(self->connection, 1);
+#ifdef HAVE_LIBURING
+        /* so the connect already goes through the ring */
+        if (self->loop)
+            shout_connection_set_uring(self->connection, shout_loop_get_uring(self->loop));
+#endif
+        if (self->zerocopy)
+            shout_connection_control(self->connection, SHOUT_CONTROL_SET_ZEROCOPY, 1);
+        if (self->queue_high)
+            shout_connection_set_queue_watermarks(self->connection, self->queue_high, self->queue_low);
+        if (self->queue_limit)
+            shout_connection_set_queue_limit(self->connection, self->queue_limit, self->queue_limit_unit, self->queue_limit_policy);
+        if (self->reconnect_attempts)
+            shout_connection_set_salvage(self->connection, 1);
 
 #ifdef HAVE_OPENSSL
         shout_connection_select_tlsmode(self->connection, self->tls_mode);
+        if (impl == shout_http_impl)
+            shout_http_select_cached_tlsmode(self, self->connection);
 #endif
         self->connection->target_message_state = SHOUT_MSGSTATE_SENDING1;
         shout_connection_connect(self->connection, self);
@@ -1390,6 +1868,10 @@ static int try_connect(shout_t *self)
             case SHOUT_FORMAT_MP3:
                 rc = self->error = shout_open_mp3(self);
                 break;
+            case SHOUT_FORMAT_AAC:
+            case SHOUT_FORMAT_AACPLUS:
+                rc = self->error = shout_open_adts(self);
+                break;
             case SHOUT_FORMAT_WEBM:
             case SHOUT_FORMAT_MATROSKA:
                 rc = self->error = shout_open_webm(self);
@@ -1406,3 +1888,223 @@ static int try_connect(shout_t *self)
 
     return ret;
 }
+
+/* Adds the counters in from to those in to, but the current queue length. */
+static void shout_stats_add(shout_stats_t *to, const shout_stats_t *from)
+{
+    to->bytes_queued += from->bytes_queued;
+    to->bytes_written += from->bytes_written;
+    to->bytes_direct += from->bytes_direct;
+    to->bytes_dropped += from->bytes_dropped;
+    to->frames_dropped += from->frames_dropped;
+    to->write_calls += from->write_calls;
+    to->write_busy += from->write_busy;
+    if (from->queue_peak > to->queue_peak)
+        to->queue_peak = from->queue_peak;
+    to->wait_time += from->wait_time;
+    to->time_connecting += from->time_connecting;
+    to->time_tls += from->time_tls;
+    to->time_handshake += from->time_handshake;
+    to->time_streaming += from->time_streaming;
+}
+
+/* Closes the connection, keeping its counters for shout_get_stats(). */
+static void shout_drop_connection(shout_t *self)
+{
+    shout_stats_t stats;
+
+    if (!self->connection)
+        return;
+
+    memset(&stats, 0, sizeof(stats));
+    if (shout_connection_get_stats(self->connection, &stats) == SHOUTERR_SUCCESS)
+        shout_stats_add(&(self->stats), &stats);
+
+    shout_connection_unref(self->connection);
+    self->connection = NULL;
+}
+
+/* Whether the connection was lost while streaming and should be replaced. */
+static int shout_reconnect__wanted(shout_t *self)
+{
+    return self->reconnect_attempts && !self->reconnecting && self->connection &&
+           self->connection->current_message_state == SHOUT_MSGSTATE_SENDING1 &&
+           shout_connection_get_error(self->connection) == SHOUTERR_SOCKET;
+}
+
+/* Drops the lost connection, keeping the data it did not write yet. */
+static int shout_reconnect__begin(shout_t *self)
+{
+    int ret;
+
+    ret = shout_connection_salvage(self->connection, &(self->reconnect_buffer));
+    if (ret != SHOUTERR_SUCCESS) {
+        shout_queue_free(&(self->reconnect_buffer));
+        return ret;
+    }
+
+    shout_drop_connection(self);
+    self->reconnecting = 1;
+    self->reconnect_tries = 0;
+    self->reconnect_at = timing_get_time();
+
+    return SHOUTERR_SUCCESS;
+}
+
+static void shout_reconnect__stop(shout_t *self)
+{
+    self->reconnecting = 0;
+    shout_queue_free(&(self->reconnect_buffer));
+}
+
+/* Whether queue starts with the stream header, e.g. as the outage began
+ * right at the start of the stream. It must not be sent twice then.
+ */
+static int shout_reconnect__has_header(shout_t *self, shout_queue_t *queue)
+{
+    shout_buf_t *header = self->stream_header.head;
+    shout_buf_t *data = queue->head;
+    size_t hpos, dpos, len;
+
+    if (!header || !data || queue->len < self->stream_header.len)
+        return 0;
+
+    /* the whole header has to match, it may be split up differently */
+    hpos = header->pos;
+    dpos = data->pos;
+    while (header) {
+        if (hpos == header->len) {
+            header = header->next;
+            if (header)
+                hpos = header->pos;
+            continue;
+        }
+
+        if (dpos == data->len) {
+            data = data->next;
+            if (!data)
+                return 0;
+            dpos = data->pos;
+            continue;
+        }
+
+        len = header->len - hpos;
+        if (len > data->len - dpos)
+            len = data->len - dpos;
+
+        if (memcmp(header->data + hpos, data->data + dpos, len) != 0)
+            return 0;
+
+        hpos += len;
+        dpos += len;
+    }
+
+    return 1;
+}
+
+/* Sends the stream header and the buffered data over the new connection. */
+static int shout_reconnect__replay(shout_t *self)
+{
+    shout_queue_t held = self->reconnect_buffer;
+    shout_buf_t *buf = NULL;
+    ssize_t sent = 0;
+    int ret = SHOUTERR_SUCCESS;
+
+    memset(&(self->reconnect_buffer), 0, sizeof(self->reconnect_buffer));
+    self->reconnecting = 0;
+
+    /* the held data is not marked, marks made meanwhile do not fit it */
+    shout_connection_drop_pending_frames(self->connection);
+
+    if (!shout_reconnect__has_header(self, &held)) {
+        for (buf = self->stream_header.head; buf && sent >= 0; buf = buf->next)
+            sent = shout_connection_send(self->connection, self, buf->data + buf->pos, buf->len - buf->pos);
+    }
+
+    for (buf = held.head; buf && sent >= 0; buf = buf->next)
+        sent = shout_connection_send(self->connection, self, buf->data + buf->pos, buf->len - buf->pos);
+
+    if (sent < 0) {
+        ret = shout_connection_get_error(self->connection);
+        if (ret == SHOUTERR_SOCKET) {
+            /* lost again, buf is the first buffer the connection did not take */
+            ret = shout_reconnect__begin(self);
+            for (; buf && ret == SHOUTERR_SUCCESS; buf = buf->next)
+                ret = shout_queue_data(&(self->reconnect_buffer), buf->data + buf->pos, buf->len - buf->pos);
+        }
+    }
+
+    shout_queue_free(&held);
+
+    return ret;
+}
+
+/* Drives a reconnect. Returns SHOUTERR_SUCCESS while it is in progress or
+ * once done, or the error of the last attempt if all of them failed.
+ */
+static int shout_reconnect__iter(shout_t *self)
+{
+    uint64_t delay;
+    unsigned int i;
+    int ret;
+
+    if (!self->reconnecting)
+        return SHOUTERR_SUCCESS;
+
+    if (!self->connection) {
+        if (timing_get_time() < self->reconnect_at)
+            return SHOUTERR_SUCCESS;
+        self->reconnect_tries++;
+    }
+
+    ret = try_connect(self);
+
+    if (self->connection) {
+        if (self->connection->current_message_state == SHOUT_MSGSTATE_SENDING1)
+            return self->error = shout_reconnect__replay(self);
+
+        if (ret == SHOUTERR_SUCCESS || ret == SHOUTERR_BUSY || ret == SHOUTERR_RETRY)
+            return SHOUTERR_SUCCESS;
+    }
+
+    shout_drop_connection(self);
+
+    if (self->reconnect_tries >= self->reconnect_attempts) {
+        /* the format stays open until shout_close() */
+        shout_reconnect__stop(self);
+        return self->error = ret;
+    }
+
+    /* exponential backoff */
+    delay = self->reconnect_delay_min;
+    for (i = 1; i < self->reconnect_tries && delay < self->reconnect_delay_max; i++)
+        delay *= 2;
+    if (delay > self->reconnect_delay_max)
+        delay = self->reconnect_delay_max;
+    self->reconnect_at = timing_get_time() + delay;
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* Keeps data while reconnecting and drives the reconnect. */
+static ssize_t shout_reconnect__buffer(shout_t *self, const unsigned char *data, size_t len)
+{
+    int ret;
+
+    if (self->reconnect_buffer.len + len > self->reconnect_buffer_max) {
+        /* the outage lasts too long, give up */
+        shout_drop_connection(self);
+        shout_reconnect__stop(self);
+        return self->error = SHOUTERR_SOCKET;
+    }
+
+    ret = shout_queue_data(&(self->reconnect_buffer), data, len);
+    if (ret != SHOUTERR_SUCCESS)
+        return self->error = ret;
+
+    ret = shout_reconnect__iter(self);
+    if (ret != SHOUTERR_SUCCESS)
+        return self->error = ret;
+
+    return len;
+}
@@ -43,6 +43,9 @@
 
 #ifdef HAVE_OPENSSL
 #   include <openssl/ssl.h>
+#   if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#       define SHOUT_HAVE_KTLS
+#   endif
 #endif
 
 #define LIBSHOUT_DEFAULT_HOST       "localhost"
@@ -69,32 +72,101 @@
 #define LIBSHOUT_CAP_CHUNKED     0x00000100UL
 #define LIBSHOUT_CAP_100CONTINUE 0x00000200UL
 #define LIBSHOUT_CAP_UPGRADETLS  0x00010000UL
+#define LIBSHOUT_CAP_CACHED      0x10000000UL /* capabilities were taken from the cache */
 #define LIBSHOUT_CAP_REQAUTH     0x20000000UL /* requires authentication */
 #define LIBSHOUT_CAP_CHALLENGED  0x40000000UL
 #define LIBSHOUT_CAP_GOTCAPS     0x80000000UL
 
 #define LIBSHOUT_MAX_RETRY       3
 
+/* largest stream header kept for a reconnect, see shout_stream_header_add() */
+#define LIBSHOUT_STREAM_HEADER_MAX  (1024*1024)
+
 #define SHOUT_BUFSIZE 4096
 
+/* I/O events as used by the connection layer (shout_connection_get_pollinfo()) */
+#define SHOUT_IO_READ            0x0001
+#define SHOUT_IO_WRITE           0x0002
+#define SHOUT_IO_ERROR           0x0004
+
 typedef struct _shout_tls shout_tls_t;
 
+typedef void (*shout_release_t)(void *userdata);
+
 typedef struct _shout_buf {
-    unsigned char   data[SHOUT_BUFSIZE];
+    /* points to storage for pages, or to caller owned memory for references */
+    unsigned char  *data;
     unsigned int    len;
     unsigned int    pos;
 
+    /* called once a reference has been written or dropped */
+    shout_release_t release;
+    void           *release_userdata;
+
+    /* set while the kernel may still read the data (MSG_ZEROCOPY, io_uring) */
+    int             zerocopy_pending;
+    /* id of the last zerocopy send that included this buffer */
+    uint32_t        zerocopy_id;
+
     struct  _shout_buf *prev;
     struct  _shout_buf *next;
+
+    /* SHOUT_BUFSIZE bytes for pages, empty for references */
+    unsigned char   storage[];
 } shout_buf_t;
 
+#define SHOUT_BUF_IS_REF(buf)   ((buf)->data != (buf)->storage)
+
+/* number of spare pages kept per queue for reuse */
+#define SHOUT_QUEUE_POOL_MAX    16
+
 typedef struct {
     shout_buf_t     *head;
+    shout_buf_t     *tail;
     size_t           len;
+
+    /* spare pages, linked by next */
+    shout_buf_t     *pool;
+    size_t           pool_len;
+
+    /* written buffers waiting for zerocopy completion, oldest first */
+    shout_buf_t     *inflight;
+    shout_buf_t     *inflight_tail;
 } shout_queue_t;
 
+/* state of a frame known to the connection */
+typedef enum {
+    /* marked by the format, data not yet passed to shout_connection_send() */
+    SHOUT_FRAME_PENDING = 0,
+    SHOUT_FRAME_QUEUED,
+    SHOUT_FRAME_DROPPED
+} shout_frame_state_t;
+
+/* A frame (or page, or cluster) boundary as marked by the format layer.
+ * A frame extends up to the next frame's offset.
+ */
+typedef struct {
+    shout_frame_state_t state;
+    /* stream offset while pending, queue offset once passed */
+    uint64_t            offset;
+    uint64_t            duration; /* [us] */
+    int                 droppable;
+    /* set while duration is included in queued_duration */
+    int                 accounted;
+} shout_frame_t;
+
+/* MSG_ZEROCOPY state of a connection */
+#define SHOUT_ZEROCOPY_OFF      0
+#define SHOUT_ZEROCOPY_WANTED   1
+#define SHOUT_ZEROCOPY_ACTIVE   2
+
+/* connection attempts running at once while racing the addresses of a host */
+#define SHOUT_RACE_MAX          4
+
 typedef enum {
     SHOUT_SOCKSTATE_UNCONNECTED = 0,
+    SHOUT_SOCKSTATE_RESOLVING,
+    SHOUT_SOCKSTATE_RACING,
     SHOUT_SOCKSTATE_CONNECTING,
     SHOUT_SOCKSTATE_CONNECTED,
     SHOUT_SOCKSTATE_TLS_CONNECTING,
@@ -119,6 +191,15 @@ typedef enum {
     SHOUT_MSGSTATE_PARSED_FINAL
 } shout_connect_message_state_t;
 
+/* Phases of a connection as reported by shout_get_stats() */
+typedef enum {
+    SHOUT_PHASE_CONNECTING = 0,
+    SHOUT_PHASE_TLS,
+    SHOUT_PHASE_HANDSHAKE,
+    SHOUT_PHASE_STREAMING,
+    SHOUT_PHASE__MAX
+} shout_connection_phase_t;
+
 typedef enum {
     SHOUT_RS_DONE,
     SHOUT_RS_TIMEOUT,
@@ -142,6 +223,27 @@ typedef struct {
 
 typedef struct shout_connection_tag shout_connection_t;
 
+/* Addresses of a host, as numeric strings (see dns.c) */
+typedef struct {
+    int     family;
+    char    host[64];
+} shout_dns_addr_t;
+
+typedef struct {
+    int                 refc;
+    size_t              count;
+    shout_dns_addr_t    addr[];
+} shout_dns_result_t;
+
+typedef struct shout_dns_request_tag shout_dns_request_t;
+
+#ifdef HAVE_LIBURING
+typedef struct shout_uring shout_uring_t;
+#endif
+
+/* Resolves host into a new result, see shout_dns_set_resolver() */
+typedef int (*shout_dns_resolver_t)(const char *host, shout_dns_result_t **result);
+
 typedef struct {
     shout_connection_return_state_t (*msg_create)(shout_t *self, shout_connection_t *connection);
     shout_connection_return_state_t (*msg_get)(shout_t *self, shout_connection_t *connection);
@@ -149,6 +251,18 @@ typedef struct {
     shout_connection_return_state_t (*protocol_iter)(shout_t *self, shout_connection_t *connection);
 } shout_protocol_impl_t;
 
+/* Moves bytes over an established connection. read, write and
+ * recoverable follow the sock_*() conventions.
+ */
+typedef struct {
+    const char *name;
+    ssize_t (*read)(shout_connection_t *con, void *buf, size_t len);
+    ssize_t (*write)(shout_connection_t *con, const void *buf, size_t len);
+    int     (*recoverable)(shout_connection_t *con);
+    /* optional, writes as much of con->wqueue as possible at once */
+    shout_connection_return_state_t (*flush)(shout_connection_t *con);
+} shout_transport_t;
+
 typedef int (*shout_connection_callback_t)(shout_connection_t *con, shout_event_t event, void *userdata, va_list ap);
 
 struct shout_connection_tag {
@@ -171,13 +285,27 @@ struct shout_connection_tag {
 
     int                             nonblocking;
 
+    /* set if an external event loop waits for I/O on our behalf */
+    int                             io_external;
+    /* events (SHOUT_IO_*) reported ready by the external event loop */
+    int                             io_ready;
+
     shout_connection_callback_t callback;
     void        *callback_userdata;
 
 #ifdef HAVE_OPENSSL
     shout_tls_t   *tls;
 #endif
+    /* name resolution while in SHOUT_SOCKSTATE_RESOLVING */
+    shout_dns_request_t *dns;
+    /* happy eyeballs while in SHOUT_SOCKSTATE_RACING */
+    shout_dns_result_t *race_addrs;
+    size_t         race_next;
+    uint64_t       race_next_start;
+    sock_t         race_socket[SHOUT_RACE_MAX];
+    size_t         race_newest;
     sock_t         socket;
+    const shout_transport_t *transport;
     shout_queue_t  rqueue;
     shout_queue_t  wqueue;
 
@@ -188,6 +316,86 @@ struct shout_connection_tag {
     /* server capabilities (LIBSHOUT_CAP_*) */
     uint32_t server_caps;
 
+    /* bytes written straight from the caller's buffer, bypassing wqueue */
+    uint64_t direct_bytes;
+
+    /* write queue limit (SHOUT_QUEUE_*), limit of 0 means no limit */
+    size_t   queue_limit;
+    unsigned int queue_limit_unit;
+    unsigned int queue_limit_policy;
+
+    /* track frames even without a limit, see shout_connection_salvage() */
+    int      salvage;
+
+    /* statistics, see shout_get_stats() */
+    uint64_t bytes_queued;
+    uint64_t bytes_written;
+    uint64_t write_calls;
+    uint64_t write_busy;
+    size_t   queue_peak;
+    uint64_t wait_time; /* [ms] */
+    uint64_t phase_time[SHOUT_PHASE__MAX]; /* [ms] */
+    uint64_t phase_since;
+    shout_connection_phase_t phase;
+
+    /* setup latency tracking, see latency.c */
+    shout_connect_socket_state_t    tracked_socket_state;
+    shout_connect_message_state_t   tracked_message_state;
+    uint64_t latency_connect;   /* start of the TCP connect */
+    uint64_t latency_tls;       /* start of the TLS handshake */
+    uint64_t latency_handshake; /* end of the socket setup */
+    uint64_t latency_request;   /* start of the current request */
+    int      latency_done;
+
+    /* SHOUT_EVENT_QUEUE_HIGH/LOW watermarks in bytes, high of 0 disables them */
+    size_t   queue_high;
+    size_t   queue_low;
+    int      queue_above_high;
+
+    /* bytes ever passed to shout_connection_send(), including dropped ones */
+    uint64_t stream_offset;
+    /* bytes ever written or queued */
+    uint64_t queue_offset;
+
+    /* frame marks, a ring of frames_size entries, oldest first.
+     * The first frames_passed of them are no longer pending.
+     */
+    shout_frame_t *frames;
+    size_t   frames_size;
+    size_t   frames_head;
+    size_t   frames_len;
+    size_t   frames_passed;
+    /* set while the data of the current frame is being dropped */
+    int      frames_dropping;
+    /* sum of the durations of the frames in the queue [us] */
+    uint64_t queued_duration;
+
+    uint64_t dropped_bytes;
+    uint64_t dropped_frames;
+
+    /* MSG_ZEROCOPY (SHOUT_ZEROCOPY_*) and completion tracking */
+    int      zerocopy;
+    uint32_t zerocopy_next; /* id of the next zerocopy send */
+    uint32_t zerocopy_done; /* all sends before this id have completed */
+
+    /* set while the last call of the kTLS transport was a read */
+    int      ktls_reading;
+
+#ifdef HAVE_LIBURING
+    /* ring of the event loop, requests are submitted with its next iteration */
+    shout_uring_t  *uring;
+    /* pages sent by the chain in flight, see uring.c */
+    unsigned int    uring_sends;
+    /* set while a connect is in flight */
+    int             uring_connecting;
+    /* its struct addrinfo, the kernel reads it only once it is submitted */
+    void           *uring_addr;
+    /* set by completions until the event loop picked them up */
+    int             uring_ready;
+    /* SHOUTERR_* of a failed send, reported by the next flush */
+    int             uring_error;
+#endif
+
     int error;
 };
 
@@ -241,6 +449,45 @@ struct shout {
     shout_connection_t *connection;
     int             nonblocking;
 
+    /* event loop this instance is registered with, if any */
+    shout_loop_t   *loop;
+
+    /* use MSG_ZEROCOPY for large writes if supported */
+    int             zerocopy;
+
+    /* let the kernel encrypt TLS records if supported */
+    int             ktls;
+
+    /* drop ID3v2 and APE tags from MP3 streams instead of sending them */
+    int             strip_tags;
+
+    /* write queue limit (SHOUT_QUEUE_*) */
+    size_t          queue_limit;
+    unsigned int    queue_limit_unit;
+    unsigned int    queue_limit_policy;
+
+    /* write queue watermarks */
+    size_t          queue_high;
+    size_t          queue_low;
+
+    /* number of connections opened */
+    uint64_t        connects;
+    /* counters of the connections closed so far */
+    shout_stats_t   stats;
+
+    /* automatic reconnect, see shout_set_reconnect() */
+    unsigned int    reconnect_attempts;
+    unsigned int    reconnect_delay_min; /* [ms] */
+    unsigned int    reconnect_delay_max; /* [ms] */
+    size_t          reconnect_buffer_max;
+    int             reconnecting;
+    unsigned int    reconnect_tries;
+    uint64_t        reconnect_at;
+    /* data to send once reconnected */
+    shout_queue_t   reconnect_buffer;
+    /* codec headers of the stream, kept by the format for a reconnect */
+    shout_queue_t   stream_header;
+
     void *format_data;
     int (*send)(shout_t* self, const unsigned char* buff, size_t len);
     void (*close)(shout_t* self);
@@ -249,16 +496,25 @@ struct shout {
     uint64_t starttime;
     /* amount of data we've sent (in microseconds) */
     uint64_t senttime;
+    /* total duration announced by the stream (in microseconds), 0 if unknown */
+    uint64_t duration;
 
     int error;
 };
 
 /* helper functions */
 const char *shout_get_mimetype_from_self(shout_t *self);
+int         shout_process_io(shout_t *self, int events /* SHOUT_IO_* */);
+int         shout_stream_header_add(shout_t *self, const unsigned char *data, size_t len);
+void        shout_stream_header_reset(shout_t *self);
 
 int     shout_queue_data(shout_queue_t *queue, const unsigned char *data, size_t len);
+int     shout_queue_ref(shout_queue_t *queue, const unsigned char *data, size_t len, shout_release_t release, void *userdata);
 int     shout_queue_str(shout_connection_t *self, const char *str);
 int     shout_queue_printf(shout_connection_t *self, const char *fmt, ...);
+void    shout_queue_advance(shout_queue_t *queue, size_t len);
+void    shout_queue_complete(shout_queue_t *queue, uint32_t done);
+int     shout_queue_cut(shout_queue_t *queue, size_t offset, size_t len);
 void    shout_queue_free(shout_queue_t *queue);
 ssize_t shout_queue_collect(shout_buf_t *queue, char **buf);
 
@@ -281,13 +537,30 @@ int                 shout_connection_get_wait_timeout_happened(shout_connection_
 int                 shout_connection_connect(shout_connection_t *con, shout_t *shout);
 int                 shout_connection_disconnect(shout_connection_t *con);
 ssize_t             shout_connection_send(shout_connection_t *con, shout_t *shout, const void *buf, size_t len);
+int                 shout_connection_set_queue_limit(shout_connection_t *con, size_t limit, unsigned int unit, unsigned int policy);
+int                 shout_connection_get_stats(shout_connection_t *con, shout_stats_t *stats);
+int                 shout_connection_set_queue_watermarks(shout_connection_t *con, size_t high, size_t low);
+int                 shout_connection_queue_full(shout_connection_t *con); /* returns SHOUTERR_* or > 0 for true */
+int                 shout_connection_wait_queue(shout_connection_t *con, shout_t *shout);
+int                 shout_connection_mark_frame(shout_connection_t *con, size_t at /* bytes after the data sent so far */, uint64_t duration /* [us] */, int droppable);
+int                 shout_connection_drop_pending_frames(shout_connection_t *con);
+int                 shout_connection_extend_frame(shout_connection_t *con, uint64_t duration /* [us] */);
+int                 shout_connection_send_ref(shout_connection_t *con, shout_t *shout, const void *buf, size_t len, shout_release_t release, void *userdata);
 ssize_t             shout_connection_get_sendq(shout_connection_t *con, shout_t *shout);
+int                 shout_connection_set_salvage(shout_connection_t *con, int salvage);
+int                 shout_connection_salvage(shout_connection_t *con, shout_queue_t *queue);
 int                 shout_connection_starttls(shout_connection_t *con, shout_t *shout);
 int                 shout_connection_set_error(shout_connection_t *con, int error);
 int                 shout_connection_get_error(shout_connection_t *con);
 int                 shout_connection_transfer_error(shout_connection_t *con, shout_t *shout);
 int                 shout_connection_control(shout_connection_t *con, shout_control_t control, ...);
 int                 shout_connection_set_callback(shout_connection_t *con, shout_connection_callback_t callback, void *userdata);
+int                 shout_connection_set_external_io(shout_connection_t *con, int external);
+int                 shout_connection_set_io_ready(shout_connection_t *con, int events /* SHOUT_IO_* */);
+int                 shout_connection_get_pollinfo(shout_connection_t *con, shout_t *shout, sock_t *socket, int *events /* SHOUT_IO_* */, int *timeout /* [ms], -1 for none */);
+#ifdef HAVE_LIBURING
+int                 shout_connection_set_uring(shout_connection_t *con, shout_uring_t *uring);
+#endif
 
 #ifdef HAVE_OPENSSL
 typedef int (*shout_tls_callback_t)(shout_tls_t *tls, shout_event_t event, void *userdata, va_list ap);
@@ -298,23 +571,69 @@ int          shout_tls_close(shout_tls_t *tls);
 ssize_t      shout_tls_read(shout_tls_t *tls, void *buf, size_t len);
 ssize_t      shout_tls_write(shout_tls_t *tls, const void *buf, size_t len);
 int          shout_tls_recoverable(shout_tls_t *tls);
+int          shout_tls_get_want(shout_tls_t *tls); /* returns SHOUT_IO_* */
 int          shout_tls_get_peer_certificate(shout_tls_t *tls, char **buf);
 int          shout_tls_get_peer_certificate_chain(shout_tls_t *tls, char **buf);
 int          shout_tls_set_callback(shout_tls_t *tls, shout_tls_callback_t callback, void *userdata);
+void         shout_tls_cache_free(void);
+int          shout_tls_ktls_send(shout_tls_t *tls); /* true if the kernel encrypts what is written to the socket */
 #endif
 
+/* dns.c */
+int                     shout_dns_lookup(const char *host, shout_dns_result_t **result);
+shout_dns_request_t    *shout_dns_request_new(const char *host);
+void                    shout_dns_request_free(shout_dns_request_t *req);
+sock_t                  shout_dns_request_get_fd(shout_dns_request_t *req);
+int                     shout_dns_request_get_result(shout_dns_request_t *req, shout_dns_result_t **result);
+void                    shout_dns_result_ref(shout_dns_result_t *result);
+void                    shout_dns_result_unref(shout_dns_result_t *result);
+void                    shout_dns_set_resolver(shout_dns_resolver_t resolver);
+void                    shout_dns_cache_free(void);
+
+#ifdef HAVE_LIBURING
+/* loop.c */
+shout_uring_t  *shout_loop_get_uring(shout_loop_t *loop);
+
+/* uring.c */
+shout_uring_t  *shout_uring_new(void);
+void            shout_uring_free(shout_uring_t *uring);
+sock_t          shout_uring_get_fd(shout_uring_t *uring);
+int             shout_uring_submit(shout_uring_t *uring);
+void            shout_uring_reap(shout_uring_t *uring);
+sock_t          shout_uring_connect(shout_connection_t *con, const char *host, int port);
+void            shout_uring_cancel(shout_connection_t *con);
+#endif
+
+/* latency.c */
+void shout_latency_record(unsigned int phase /* SHOUT_LATENCY_* */, uint64_t value /* [ms] */);
+
 /* protocols */
+extern const shout_transport_t *shout_transport_socket;
+#ifdef HAVE_OPENSSL
+extern const shout_transport_t *shout_transport_tls;
+#endif
+#ifdef SHOUT_HAVE_KTLS
+extern const shout_transport_t *shout_transport_ktls;
+#endif
+#ifdef HAVE_LIBURING
+extern const shout_transport_t *shout_transport_uring;
+#endif
+
 extern const shout_protocol_impl_t *shout_http_impl;
 extern const shout_protocol_impl_t *shout_xaudiocast_impl;
 extern const shout_protocol_impl_t *shout_icy_impl;
 extern const shout_protocol_impl_t *shout_roaraudio_impl;
 
+#ifdef HAVE_OPENSSL
+void shout_http_select_cached_tlsmode(shout_t *self, shout_connection_t *connection);
+#endif
 shout_connection_return_state_t shout_get_xaudiocast_response(shout_t *self, shout_connection_t *connection);
 shout_connection_return_state_t shout_parse_xaudiocast_response(shout_t *self, shout_connection_t *connection);
 
 /* containers */
 int shout_open_ogg(shout_t *self);
 int shout_open_mp3(shout_t *self);
+int shout_open_adts(shout_t *self);
 int shout_open_webm(shout_t *self);
 
 #endif /* __LIBSHOUT_SHOUT_PRIVATE_H__ */
@@ -24,6 +24,7 @@
 #endif
 
 #include <string.h>
+#include <stdio.h>
 
 #include <shout/shout.h>
 #include "shout_private.h"
@@ -32,14 +33,45 @@
 #   include <ctype.h>
 #endif
 
+/* max number of sessions kept per context */
+#define SHOUT_TLS_SESSIONS_MAX  64
+/* max number of contexts kept while no connection uses them */
+#define SHOUT_TLS_CTX_IDLE_MAX  8
+
+typedef struct shout_tls_session_tag shout_tls_session_t;
+struct shout_tls_session_tag {
+    char                *host;
+    int                  port;
+    SSL_SESSION         *session;
+    shout_tls_session_t *next;
+};
+
+/* SSL_CTX shared by all connections with the same configuration.
+ * Up to SHOUT_TLS_CTX_IDLE_MAX contexts stay cached once unused so their
+ * sessions can be resumed, the least recently used ones are freed. */
+typedef struct shout_tls_ctx_tag shout_tls_ctx_t;
+struct shout_tls_ctx_tag {
+    char                *key;
+    SSL_CTX             *ssl_ctx;
+    size_t               refc;
+    shout_tls_session_t *sessions;
+    size_t               sessions_len;
+    shout_tls_ctx_t     *next;
+};
+
+static shout_tls_ctx_t      *shout_tls_ctx_cache;
+static _shout_util_mutex_t   shout_tls_lock = _SHOUT_UTIL_MUTEX_INITIALIZER;
+
 struct _shout_tls {
-    SSL_CTX     *ssl_ctx;
+    shout_tls_ctx_t *ctx;
     SSL         *ssl;
     int          ssl_ret;
     int          cert_error;
     /* only pointers into self, don't need to free them */
     sock_t       socket;
+    int          ktls;
     const char  *host;
+    int          port;
     const char  *ca_directory;
     const char  *ca_file;
     const char  *allowed_ciphers;
@@ -76,6 +108,8 @@ shout_tls_t *shout_tls_new(shout_t *self, sock_t socket)
 
     tls->socket             = socket;
     tls->host               = self->host;
+    tls->port               = self->port;
+    tls->ktls               = self->ktls;
     tls->ca_directory       = self->ca_directory;
     tls->ca_file            = self->ca_file;
     tls->allowed_ciphers    = self->allowed_ciphers;
@@ -84,8 +118,90 @@ shout_tls_t *shout_tls_new(shout_t *self, sock_t socket)
     return tls;
 }
 
-static inline int tls_setup(shout_tls_t *tls)
+/* Must be called with the lock held. */
+static shout_tls_session_t **shout_tls_session_find(shout_tls_ctx_t *ctx, const char *host, int port)
+{
+    shout_tls_session_t **next;
+
+    for (next = &(ctx->sessions); *next; next = &((*next)->next)) {
+        if ((*next)->port == port && strcmp((*next)->host, host) == 0)
+            return next;
+    }
+
+    return NULL;
+}
+
+static void shout_tls_session_free(shout_tls_session_t *session)
+{
+    SSL_SESSION_free(session->session);
+    free(session->host);
+    free(session);
+}
+
+static void shout_tls_session_forget(shout_tls_t *tls)
+{
+    shout_tls_session_t **found;
+    shout_tls_session_t *session;
+
+    if (!tls->ctx || !tls->host)
+        return;
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    found = shout_tls_session_find(tls->ctx, tls->host, tls->port);
+    if (found) {
+        session = *found;
+        *found = session->next;
+        tls->ctx->sessions_len--;
+        shout_tls_session_free(session);
+    }
+    _shout_util_mutex_unlock(&shout_tls_lock);
+}
+
+/* Called by OpenSSL for every new session, including TLS 1.3 tickets
+ * received after the handshake. Takes over the reference to session.
+ */
+static int shout_tls_session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+    shout_tls_t *tls = SSL_get_app_data(ssl);
+    shout_tls_session_t **found;
+    shout_tls_session_t *entry;
+
+    if (!tls || !tls->ctx || !tls->host)
+        return 0;
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    found = shout_tls_session_find(tls->ctx, tls->host, tls->port);
+    if (found) {
+        entry = *found;
+        SSL_SESSION_free(entry->session);
+        entry->session = session;
+    } else if (tls->ctx->sessions_len < SHOUT_TLS_SESSIONS_MAX) {
+        entry = calloc(1, sizeof(*entry));
+        if (entry && !(entry->host = strdup(tls->host))) {
+            free(entry);
+            entry = NULL;
+        }
+        if (!entry) {
+            _shout_util_mutex_unlock(&shout_tls_lock);
+            return 0;
+        }
+        entry->port = tls->port;
+        entry->session = session;
+        entry->next = tls->ctx->sessions;
+        tls->ctx->sessions = entry;
+        tls->ctx->sessions_len++;
+    } else {
+        _shout_util_mutex_unlock(&shout_tls_lock);
+        return 0;
+    }
+    _shout_util_mutex_unlock(&shout_tls_lock);
+
+    return 1;
+}
+
+static SSL_CTX *shout_tls_ctx_create(shout_tls_t *tls)
 {
+    SSL_CTX *ssl_ctx;
     long ssl_opts = 0;
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -94,64 +210,232 @@ static inline int tls_setup(shout_tls_t *tls)
     SSLeay_add_all_algorithms();
     SSLeay_add_ssl_algorithms();
 
-    tls->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
+    ssl_ctx = SSL_CTX_new(TLSv1_client_method());
     ssl_opts |= SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3; // Disable SSLv2 and SSLv3
 #else
-    tls->ssl_ctx = SSL_CTX_new(TLS_client_method());
-    SSL_CTX_set_min_proto_version(tls->ssl_ctx, TLS1_VERSION);
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx)
+        SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
 #endif
 
 #ifdef SSL_OP_NO_COMPRESSION
     ssl_opts |= SSL_OP_NO_COMPRESSION;             // Never use compression
 #endif
 
-    if (!tls->ssl_ctx)
-        goto error;
+    if (!ssl_ctx)
+        return NULL;
 
     /* Even though this function is called set, it adds the
      * flags to the already existing flags (possibly default
      * flags already set by OpenSSL)!
      * Calling SSL_CTX_get_options is not needed here, therefore.
      */
-    SSL_CTX_set_options(tls->ssl_ctx, ssl_opts);
+    SSL_CTX_set_options(ssl_ctx, ssl_opts);
 
 
-    SSL_CTX_set_default_verify_paths(tls->ssl_ctx);
-    SSL_CTX_load_verify_locations(tls->ssl_ctx, tls->ca_file, tls->ca_directory);
+    SSL_CTX_set_default_verify_paths(ssl_ctx);
+    SSL_CTX_load_verify_locations(ssl_ctx, tls->ca_file, tls->ca_directory);
 
-    SSL_CTX_set_verify(tls->ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
 
     if (tls->client_certificate) {
-        if (SSL_CTX_use_certificate_file(tls->ssl_ctx, tls->client_certificate, SSL_FILETYPE_PEM) != 1)
+        if (SSL_CTX_use_certificate_file(ssl_ctx, tls->client_certificate, SSL_FILETYPE_PEM) != 1)
             goto error;
-        if (SSL_CTX_use_PrivateKey_file(tls->ssl_ctx, tls->client_certificate, SSL_FILETYPE_PEM) != 1)
+        if (SSL_CTX_use_PrivateKey_file(ssl_ctx, tls->client_certificate, SSL_FILETYPE_PEM) != 1)
             goto error;
         }
 
-    if (SSL_CTX_set_cipher_list(tls->ssl_ctx, tls->allowed_ciphers) <= 0)
+    if (SSL_CTX_set_cipher_list(ssl_ctx, tls->allowed_ciphers) <= 0)
         goto error;
 
-    SSL_CTX_set_mode(tls->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-    SSL_CTX_set_mode(tls->ssl_ctx, SSL_MODE_AUTO_RETRY);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+
+    /* sessions are kept per host by us, see shout_tls_session_new_cb() */
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, shout_tls_session_new_cb);
+
+    return ssl_ctx;
+
+error:
+    SSL_CTX_free(ssl_ctx);
+    return NULL;
+}
+
+/* Finds or creates the shared context for the configuration of tls. */
+static shout_tls_ctx_t *shout_tls_ctx_get(shout_tls_t *tls)
+{
+    shout_tls_ctx_t *ctx;
+    char *key;
+    size_t len;
+
+#define __str(x) ((x) ? (x) : "")
+#define __set(x) ((x) ? '+' : '-')
+    len = strlen(__str(tls->ca_directory)) + strlen(__str(tls->ca_file)) +
+          strlen(__str(tls->allowed_ciphers)) + strlen(__str(tls->client_certificate)) + 16;
+    key = malloc(len);
+    if (!key)
+        return NULL;
+    snprintf(key, len, "%c%s\n%c%s\n%c%s\n%c%s",
+             __set(tls->ca_directory), __str(tls->ca_directory),
+             __set(tls->ca_file), __str(tls->ca_file),
+             __set(tls->allowed_ciphers), __str(tls->allowed_ciphers),
+             __set(tls->client_certificate), __str(tls->client_certificate));
+#undef __set
+#undef __str
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    for (ctx = shout_tls_ctx_cache; ctx; ctx = ctx->next) {
+        if (strcmp(ctx->key, key) == 0) {
+            ctx->refc++;
+            _shout_util_mutex_unlock(&shout_tls_lock);
+            free(key);
+            return ctx;
+        }
+    }
+    _shout_util_mutex_unlock(&shout_tls_lock);
+
+    /* Loading the CA paths may take a while, so do it without the lock.
+     * Should two connections race here both contexts are kept.
+     */
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        free(key);
+        return NULL;
+    }
+
+    ctx->key = key;
+    ctx->refc = 1;
+    ctx->ssl_ctx = shout_tls_ctx_create(tls);
+    if (!ctx->ssl_ctx) {
+        /* do not cache failures, the files may be fixed later */
+        free(ctx->key);
+        free(ctx);
+        return NULL;
+    }
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    ctx->next = shout_tls_ctx_cache;
+    shout_tls_ctx_cache = ctx;
+    _shout_util_mutex_unlock(&shout_tls_lock);
+
+    return ctx;
+}
+
+static void shout_tls_ctx_free(shout_tls_ctx_t *ctx)
+{
+    shout_tls_session_t *session;
+
+    while ((session = ctx->sessions)) {
+        ctx->sessions = session->next;
+        shout_tls_session_free(session);
+    }
+    SSL_CTX_free(ctx->ssl_ctx);
+    free(ctx->key);
+    free(ctx);
+}
+
+static void shout_tls_ctx_release(shout_tls_ctx_t *ctx)
+{
+    shout_tls_ctx_t **next;
+    shout_tls_ctx_t *unused = NULL;
+    shout_tls_ctx_t *entry;
+    size_t idle = 0;
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    if (--ctx->refc) {
+        _shout_util_mutex_unlock(&shout_tls_lock);
+        return;
+    }
+
+    /* the list is kept in order of last use */
+    for (next = &shout_tls_ctx_cache; *next != ctx; next = &((*next)->next));
+    *next = ctx->next;
+    ctx->next = shout_tls_ctx_cache;
+    shout_tls_ctx_cache = ctx;
+
+    for (next = &shout_tls_ctx_cache; (entry = *next); ) {
+        if (entry->refc || ++idle <= SHOUT_TLS_CTX_IDLE_MAX) {
+            next = &(entry->next);
+            continue;
+        }
+        *next = entry->next;
+        entry->next = unused;
+        unused = entry;
+    }
+    _shout_util_mutex_unlock(&shout_tls_lock);
+
+    while ((entry = unused)) {
+        unused = entry->next;
+        shout_tls_ctx_free(entry);
+    }
+}
+
+/* Frees all cached contexts not in use, called by shout_shutdown(). */
+void shout_tls_cache_free(void)
+{
+    shout_tls_ctx_t **next;
+    shout_tls_ctx_t *ctx;
+
+    _shout_util_mutex_lock(&shout_tls_lock);
+    for (next = &shout_tls_ctx_cache; (ctx = *next); ) {
+        if (ctx->refc) {
+            next = &(ctx->next);
+            continue;
+        }
+
+        *next = ctx->next;
+        shout_tls_ctx_free(ctx);
+    }
+    _shout_util_mutex_unlock(&shout_tls_lock);
+}
+
+static inline int tls_setup(shout_tls_t *tls)
+{
+    shout_tls_session_t **found;
+
+    tls->ctx = shout_tls_ctx_get(tls);
+    if (!tls->ctx)
+        goto error;
 
-    tls->ssl = SSL_new(tls->ssl_ctx);
+    tls->ssl = SSL_new(tls->ctx->ssl_ctx);
     if (!tls->ssl)
         goto error;
 
     if (!SSL_set_fd(tls->ssl, tls->socket))
         goto error;
 
+    SSL_set_app_data(tls->ssl, tls);
+#ifdef SHOUT_HAVE_KTLS
+    /* OpenSSL only hands the keys to the kernel if it supports the cipher */
+    if (tls->ktls)
+        SSL_set_options(tls->ssl, SSL_OP_ENABLE_KTLS);
+#endif
     SSL_set_tlsext_host_name(tls->ssl, tls->host);
+
+    /* resume the last session with this server if there is one */
+    if (tls->host) {
+        _shout_util_mutex_lock(&shout_tls_lock);
+        found = shout_tls_session_find(tls->ctx, tls->host, tls->port);
+        if (found)
+            SSL_set_session(tls->ssl, (*found)->session);
+        _shout_util_mutex_unlock(&shout_tls_lock);
+    }
+
     SSL_set_connect_state(tls->ssl);
     tls->ssl_ret = SSL_connect(tls->ssl);
 
     return SHOUTERR_SUCCESS;
 
 error:
-    if (tls->ssl)
+    if (tls->ssl) {
         SSL_free(tls->ssl);
-    if (tls->ssl_ctx)
-        SSL_CTX_free(tls->ssl_ctx);
+        tls->ssl = NULL;
+    }
+    if (tls->ctx) {
+        shout_tls_ctx_release(tls->ctx);
+        tls->ctx = NULL;
+    }
     return SHOUTERR_UNSUPPORTED;
 }
 
@@ -223,8 +507,11 @@ static inline int tls_check_cert(shout_tls_t *tls)
         return SHOUTERR_TLSBADCERT;
 
     ret = shout_tls_emit(tls, SHOUT_EVENT_TLS_CHECK_PEER_CERTIFICATE);
-    if (ret != SHOUT_CALLBACK_PASS)
+    if (ret != SHOUT_CALLBACK_PASS) {
+        if (ret != SHOUTERR_SUCCESS)
+            shout_tls_session_forget(tls);
         return tls->cert_error = ret;
+    }
 
     do {
         if (SSL_get_verify_result(tls->ssl) != X509_V_OK)
@@ -247,6 +534,8 @@ static inline int tls_check_cert(shout_tls_t *tls)
     if (cert_ok) {
         tls->cert_error = SHOUTERR_SUCCESS;
     } else {
+        /* never resume a session with a peer we did not trust */
+        shout_tls_session_forget(tls);
         tls->cert_error = SHOUTERR_TLSBADCERT;
     }
     return tls->cert_error;
@@ -279,8 +568,8 @@ int shout_tls_close(shout_tls_t *tls)
         SSL_shutdown(tls->ssl);
         SSL_free(tls->ssl);
     }
-    if (tls->ssl_ctx)
-        SSL_CTX_free(tls->ssl_ctx);
+    if (tls->ctx)
+        shout_tls_ctx_release(tls->ctx);
     free(tls);
     return SHOUTERR_SUCCESS;
 }
@@ -295,6 +584,15 @@ ssize_t shout_tls_write(shout_tls_t *tls, const void *buf, size_t len)
     return tls->ssl_ret = SSL_write(tls->ssl, buf, len);
 }
 
+int shout_tls_ktls_send(shout_tls_t *tls)
+{
+#ifdef SHOUT_HAVE_KTLS
+    if (tls->ktls && tls->ssl && BIO_get_ktls_send(SSL_get_wbio(tls->ssl)))
+        return 1;
+#endif
+    return 0;
+}
+
 int shout_tls_recoverable(shout_tls_t *tls)
 {
     int error = SSL_get_error(tls->ssl, tls->ssl_ret);
@@ -303,6 +601,15 @@ int shout_tls_recoverable(shout_tls_t *tls)
     return 0;
 }
 
+int shout_tls_get_want(shout_tls_t *tls)
+{
+    if (!tls->ssl)
+        return SHOUT_IO_READ|SHOUT_IO_WRITE;
+    if (SSL_want_write(tls->ssl))
+        return SHOUT_IO_WRITE;
+    return SHOUT_IO_READ;
+}
+
 int          shout_tls_get_peer_certificate(shout_tls_t *tls, char **buf)
 {
     X509 *cert;
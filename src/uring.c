@@ -0,0 +1,331 @@
+/* -*- c-basic-offset: 8; -*- */
+/* uring.c: io_uring transport for connections driven by an event loop
+ *
+ *  Copyright (C) 2026 the Icecast team <team@icecast.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public
+ *  License along with this library; if not, write to the Free
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <liburing.h>
+
+#include <shout/shout.h>
+#include "shout_private.h"
+
+/* Every shout_loop_t owns a ring shared by all of its connections.
+ * Flushes and connects only prepare requests, shout_loop_iter() submits
+ * all of them with a single call and reaps the completions once the ring
+ * becomes readable. The loop is used from one thread only, so is the ring.
+ *
+ * A flush sends the queued pages as a chain of linked requests, one per
+ * page. The kernel runs a chain in order, but separate chains in any
+ * order, so a connection starts its next chain only once the last one
+ * completed. Pages stay in the queue until their send completed.
+ */
+
+/* number of entries of a ring */
+#define SHOUT_URING_ENTRIES     256
+/* max number of pages in a chain */
+#define SHOUT_URING_CHAIN_MAX   32
+
+/* The user data of a request is its connection with the kind of request
+ * in the low bits. Cancel requests have no connection.
+ */
+#define SHOUT_URING_OP_SEND     0x1
+#define SHOUT_URING_OP_CONNECT  0x2
+#define SHOUT_URING_OP_MASK     0x3
+
+struct shout_uring {
+    struct io_uring ring;
+};
+
+static inline void *shout_uring__data(shout_connection_t *con, uintptr_t op)
+{
+    return (void *)((uintptr_t)con | op);
+}
+
+shout_uring_t *shout_uring_new(void)
+{
+    shout_uring_t *uring;
+
+    uring = calloc(1, sizeof(*uring));
+    if (!uring)
+        return NULL;
+
+    /* fails on old kernels or if io_uring is disabled, callers fall back to sockets */
+    if (io_uring_queue_init(SHOUT_URING_ENTRIES, &(uring->ring), 0) != 0) {
+        free(uring);
+        return NULL;
+    }
+
+    return uring;
+}
+
+/* All connections must have been detached, see shout_connection_set_uring(). */
+void shout_uring_free(shout_uring_t *uring)
+{
+    if (!uring)
+        return;
+
+    io_uring_queue_exit(&(uring->ring));
+    free(uring);
+}
+
+sock_t shout_uring_get_fd(shout_uring_t *uring)
+{
+    return uring->ring.ring_fd;
+}
+
+int shout_uring_submit(shout_uring_t *uring)
+{
+    int ret;
+
+    if (!uring)
+        return SHOUTERR_INSANE;
+
+    do {
+        ret = io_uring_submit(&(uring->ring));
+    } while (ret == -EINTR);
+
+    return ret < 0 ? SHOUTERR_SOCKET : SHOUTERR_SUCCESS;
+}
+
+/* Gets a free entry, submitting what is prepared if the ring is full. */
+static struct io_uring_sqe *shout_uring__get_sqe(shout_uring_t *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe(&(uring->ring));
+    if (!sqe && shout_uring_submit(uring) == SHOUTERR_SUCCESS)
+        sqe = io_uring_get_sqe(&(uring->ring));
+
+    return sqe;
+}
+
+static void shout_uring__complete_send(shout_connection_t *con, int res)
+{
+    shout_buf_t *buf;
+
+    con->uring_sends--;
+    con->uring_ready = 1;
+
+    /* completions come in the order of the chain */
+    for (buf = con->wqueue.head; buf && !buf->zerocopy_pending; buf = buf->next);
+    if (!buf)
+        return;
+    buf->zerocopy_pending = 0;
+
+    if (res > 0 && buf == con->wqueue.head) {
+        /* short only if the kernel could not retry, the rest of the chain is cancelled */
+        shout_queue_advance(&(con->wqueue), res);
+        con->bytes_written += res;
+    } else if (res < 0 && res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+        if (con->uring_error == SHOUTERR_SUCCESS)
+            con->uring_error = SHOUTERR_SOCKET;
+    }
+}
+
+void shout_uring_reap(shout_uring_t *uring)
+{
+    struct io_uring_cqe *cqe;
+    shout_connection_t  *con;
+    uintptr_t            data;
+
+    if (!uring)
+        return;
+
+    while (io_uring_peek_cqe(&(uring->ring), &cqe) == 0) {
+        data = (uintptr_t)io_uring_cqe_get_data(cqe);
+        con = (shout_connection_t *)(data & ~(uintptr_t)SHOUT_URING_OP_MASK);
+
+        if (con) {
+            switch (data & SHOUT_URING_OP_MASK) {
+                case SHOUT_URING_OP_SEND:
+                    shout_uring__complete_send(con, cqe->res);
+                break;
+                case SHOUT_URING_OP_CONNECT:
+                    /* The result is picked up with sock_connected() like for
+                     * any socket. If the kernel gave up waiting, the socket is
+                     * still connecting and is watched by the loop as usual. */
+                    con->uring_connecting = 0;
+                    freeaddrinfo(con->uring_addr);
+                    con->uring_addr = NULL;
+                    if (cqe->res != -EINPROGRESS && cqe->res != -EALREADY && cqe->res != -EAGAIN)
+                        con->uring_ready = 1;
+                break;
+            }
+        }
+
+        io_uring_cqe_seen(&(uring->ring), cqe);
+    }
+}
+
+/* Creates a socket and prepares its connect. host must be numeric. */
+sock_t shout_uring_connect(shout_connection_t *con, const char *host, int port)
+{
+    struct addrinfo      hints;
+    struct addrinfo     *ai;
+    struct io_uring_sqe *sqe;
+    char                 service[16];
+    sock_t               sock;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &ai) != 0)
+        return SOCK_ERROR;
+
+    sock = socket(ai->ai_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        freeaddrinfo(ai);
+        return SOCK_ERROR;
+    }
+    sock_set_blocking(sock, SOCK_NONBLOCK);
+
+    sqe = shout_uring__get_sqe(con->uring);
+    if (!sqe) {
+        freeaddrinfo(ai);
+        close(sock);
+        return SOCK_ERROR;
+    }
+
+    io_uring_prep_connect(sqe, sock, ai->ai_addr, ai->ai_addrlen);
+    io_uring_sqe_set_data(sqe, shout_uring__data(con, SHOUT_URING_OP_CONNECT));
+    con->uring_connecting = 1;
+    con->uring_addr = ai;
+
+    return sock;
+}
+
+/* Cancels the requests of a connection and waits for their completions,
+ * so neither the connection nor its pages are referenced any longer.
+ * Pages whose send was cancelled stay in the queue.
+ */
+void shout_uring_cancel(shout_connection_t *con)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    while (con->uring_sends || con->uring_connecting) {
+        /* Cancelling the running send of a chain cancels the rest of it.
+         * Requests that completed meanwhile just fail the cancel. */
+        if (con->uring_sends && (sqe = shout_uring__get_sqe(con->uring))) {
+            io_uring_prep_cancel(sqe, shout_uring__data(con, SHOUT_URING_OP_SEND), 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+        if (con->uring_connecting && (sqe = shout_uring__get_sqe(con->uring))) {
+            io_uring_prep_cancel(sqe, shout_uring__data(con, SHOUT_URING_OP_CONNECT), 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+
+        ret = io_uring_submit_and_wait(&(con->uring->ring), 1);
+        if (ret < 0 && ret != -EINTR)
+            break;
+        shout_uring_reap(con->uring);
+    }
+
+    con->uring_ready = 0;
+}
+
+static ssize_t shout_transport_uring__read(shout_connection_t *con, void *buf, size_t len)
+{
+    return shout_transport_socket->read(con, buf, len);
+}
+
+/* Used for writes straight from the caller's buffer, which only happen
+ * with an empty queue and so with no send in flight.
+ */
+static ssize_t shout_transport_uring__write(shout_connection_t *con, const void *buf, size_t len)
+{
+    return shout_transport_socket->write(con, buf, len);
+}
+
+static int shout_transport_uring__recoverable(shout_connection_t *con)
+{
+    return shout_transport_socket->recoverable(con);
+}
+
+static shout_connection_return_state_t shout_transport_uring__flush(shout_connection_t *con)
+{
+    struct io_uring_sqe *sqe = NULL;
+    shout_buf_t         *buf;
+    unsigned int         space;
+    unsigned int         count;
+
+    if (con->uring_error != SHOUTERR_SUCCESS) {
+        shout_connection_set_error(con, con->uring_error);
+        return SHOUT_RS_ERROR;
+    }
+
+    if (!con->wqueue.len)
+        return SHOUT_RS_DONE;
+
+    if (con->uring_sends) {
+        shout_connection_set_error(con, SHOUTERR_BUSY);
+        return SHOUT_RS_NOTNOW;
+    }
+
+    /* a chain must not be split between two submissions */
+    space = io_uring_sq_space_left(&(con->uring->ring));
+    if (space < SHOUT_URING_CHAIN_MAX) {
+        shout_uring_submit(con->uring);
+        space = io_uring_sq_space_left(&(con->uring->ring));
+    }
+
+    for (count = 0, buf = con->wqueue.head; buf && count < SHOUT_URING_CHAIN_MAX && count < space; buf = buf->next, count++) {
+        sqe = io_uring_get_sqe(&(con->uring->ring));
+        /* MSG_WAITALL lets the kernel retry short sends instead of breaking the chain */
+        io_uring_prep_send(sqe, con->socket, buf->data + buf->pos, buf->len - buf->pos, MSG_WAITALL|MSG_NOSIGNAL);
+        io_uring_sqe_set_data(sqe, shout_uring__data(con, SHOUT_URING_OP_SEND));
+        sqe->flags |= IOSQE_IO_LINK;
+        buf->zerocopy_pending = 1;
+    }
+
+    if (!count) {
+        shout_connection_set_error(con, SHOUTERR_BUSY);
+        return SHOUT_RS_NOTNOW;
+    }
+
+    /* ends the chain, the next connection's requests start a new one */
+    sqe->flags &= ~IOSQE_IO_LINK;
+    con->uring_sends = count;
+    con->write_calls++;
+
+    shout_connection_set_error(con, SHOUTERR_BUSY);
+    return SHOUT_RS_NOTNOW;
+}
+
+static const shout_transport_t shout_transport_uring_real = {
+    .name = "io_uring",
+    .read = shout_transport_uring__read,
+    .write = shout_transport_uring__write,
+    .recoverable = shout_transport_uring__recoverable,
+    .flush = shout_transport_uring__flush
+};
+const shout_transport_t * shout_transport_uring = &shout_transport_uring_real;
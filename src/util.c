@@ -372,3 +372,21 @@ const char *_shout_util_dict_next(util_dict **dict, const char **key, const char
     *val = (*dict)->val;
     return *key;
 }
+
+void _shout_util_mutex_lock(_shout_util_mutex_t *mutex)
+{
+#ifndef NO_THREAD
+    pthread_mutex_lock(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+void _shout_util_mutex_unlock(_shout_util_mutex_t *mutex)
+{
+#ifndef NO_THREAD
+    pthread_mutex_unlock(mutex);
+#else
+    (void)mutex;
+#endif
+}
@@ -23,6 +23,10 @@
 #ifndef __LIBSHOUT_UTIL_H__
 #define __LIBSHOUT_UTIL_H__
 
+#ifndef NO_THREAD
+#   include <pthread.h>
+#endif
+
 /* String dictionary type, without support for NULL keys, or multiple
  * instances of the same key
  */
@@ -51,4 +55,16 @@ char 	*_shout_util_url_encode(const char *data);
 char 	*_shout_util_url_encode_resource(const char *data);
 int  	 _shout_util_read_header(int sock, char *buff, unsigned long len);
 
+/* Mutex for global state, does nothing without thread support */
+#ifndef NO_THREAD
+typedef pthread_mutex_t _shout_util_mutex_t;
+#define _SHOUT_UTIL_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#else
+typedef int _shout_util_mutex_t;
+#define _SHOUT_UTIL_MUTEX_INITIALIZER 0
+#endif
+
+void 	 _shout_util_mutex_lock(_shout_util_mutex_t *mutex);
+void 	 _shout_util_mutex_unlock(_shout_util_mutex_t *mutex);
+
 #endif /* __LIBSHOUT_UTIL_H__ */
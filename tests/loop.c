@@ -0,0 +1,233 @@
+/* -*- c-basic-offset: 8; -*-
+ * loop.c: Test of shout_loop_*() against a local dummy server.
+ * $Id$
+ *
+ * The callback closes and reopens the connection from within the loop a
+ * few times. The new socket usually gets the number of the old one, which
+ * the loop must register again for the connection to make any progress.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+int main()
+{
+    /* skipped */
+    return 77;
+}
+#else
+
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <shout/shout.h>
+
+#define REOPENS     4
+#define TIMEOUT     10
+
+typedef struct {
+    int     reopens;
+    int     sent;
+    int     done;
+    int     error;
+} state_t;
+
+/* Accepts clients, reads the request up to the empty line, accepts it
+ * and throws away whatever follows.
+ */
+static void server_client(int fd)
+{
+    char buff[4096];
+    size_t len = 0;
+
+    while (len < sizeof(buff) && read(fd, &buff[len], 1) == 1) {
+        len++;
+        if (len >= 2 && buff[len - 1] == '\n' && buff[len - 2] == '\n')
+            break;
+    }
+
+    if (write(fd, "OK\n", 3) != 3)
+        return;
+
+    while (read(fd, buff, sizeof(buff)) > 0);
+}
+
+static pid_t server_start(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pid_t pid;
+    int listener;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        return -1;
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 16) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) != 0) {
+        close(listener);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        signal(SIGCHLD, SIG_IGN);
+        while ((fd = accept(listener, NULL, NULL)) >= 0) {
+            if (fork() == 0) {
+                close(listener);
+                server_client(fd);
+                _exit(0);
+            }
+            close(fd);
+        }
+        _exit(0);
+    }
+
+    if (pid > 0)
+        setpgid(pid, pid);
+    close(listener);
+
+    return pid;
+}
+
+static void callback(shout_loop_t *loop, shout_t *shout, int status, void *userdata)
+{
+    static const unsigned char frame[4] = {0xff, 0xfb, 0x90, 0x00};
+    state_t *state = userdata;
+    int ret;
+
+    (void)loop;
+
+    switch (status) {
+        case SHOUTERR_CONNECTED:
+            if (state->reopens < REOPENS) {
+                state->reopens++;
+                shout_close(shout);
+                ret = shout_open(shout);
+                if (ret != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY) {
+                    printf("Reopen %d failed: %s\n", state->reopens, shout_get_error(shout));
+                    state->error = 1;
+                }
+                return;
+            }
+            /* make sure the socket is still watched for writing */
+            if (shout_send_raw(shout, frame, sizeof(frame)) != sizeof(frame)) {
+                printf("Send failed: %s\n", shout_get_error(shout));
+                state->error = 1;
+                return;
+            }
+            state->sent = 1;
+            if (!shout_queuelen(shout))
+                state->done = 1;
+        break;
+        case SHOUTERR_SUCCESS:
+            if (state->sent)
+                state->done = 1;
+        break;
+        default:
+            printf("Connection failed (%d): %s\n", status, shout_get_error(shout));
+            state->error = 1;
+        break;
+    }
+}
+
+int main(void)
+{
+    shout_loop_t *loop = NULL;
+    shout_t *shout = NULL;
+    state_t state;
+    time_t end;
+    pid_t server;
+    int port;
+    int ret = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    shout_init();
+    memset(&state, 0, sizeof(state));
+
+    server = server_start(&port);
+    if (server < 0) {
+        printf("Could not start the server\n");
+        shout_shutdown();
+        return 1;
+    }
+
+    loop = shout_loop_new();
+    if (!loop) {
+        /* no event backend on this system */
+        ret = 77;
+        goto out;
+    }
+
+    shout = shout_new();
+    if (!shout ||
+        shout_set_host(shout, "127.0.0.1") != SHOUTERR_SUCCESS ||
+        shout_set_port(shout, port) != SHOUTERR_SUCCESS ||
+        shout_set_protocol(shout, SHOUT_PROTOCOL_XAUDIOCAST) != SHOUTERR_SUCCESS ||
+        shout_set_format(shout, SHOUT_FORMAT_MP3) != SHOUTERR_SUCCESS ||
+        shout_set_password(shout, "hackme") != SHOUTERR_SUCCESS ||
+        shout_set_mount(shout, "/loop.mp3") != SHOUTERR_SUCCESS ||
+#if SHOUT_TLS
+        shout_set_tls(shout, SHOUT_TLS_DISABLED) != SHOUTERR_SUCCESS ||
+#endif
+        shout_set_nonblocking(shout, SHOUT_BLOCKING_NONE) != SHOUTERR_SUCCESS) {
+        printf("Error setting up: %s\n", shout ? shout_get_error(shout) : "out of memory");
+        goto out;
+    }
+
+    if (shout_loop_add(loop, shout, callback, &state) != SHOUTERR_SUCCESS) {
+        printf("Could not add to the loop: %s\n", shout_get_error(shout));
+        goto out;
+    }
+
+    ret = shout_open(shout);
+    if (ret != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY) {
+        printf("Open failed: %s\n", shout_get_error(shout));
+        ret = 1;
+        goto out;
+    }
+    ret = 1;
+
+    end = time(NULL) + TIMEOUT;
+    while (!state.done && !state.error && time(NULL) < end) {
+        if (shout_loop_iter(loop, 1000) < 0) {
+            printf("Loop failed\n");
+            goto out;
+        }
+    }
+
+    if (state.done && !state.error) {
+        ret = 0;
+    } else if (!state.error) {
+        printf("Stalled after %d reopens\n", state.reopens);
+    }
+
+out:
+    if (shout && loop)
+        shout_loop_remove(loop, shout);
+    shout_loop_free(loop);
+    if (shout)
+        shout_free(shout);
+    kill(-server, SIGTERM);
+    waitpid(server, NULL, 0);
+    shout_shutdown();
+
+    return ret;
+}
+#endif
@@ -0,0 +1,419 @@
+/* -*- c-basic-offset: 8; -*-
+ * mp3.c: Differential test of the MP3 format handler.
+ * $Id$
+ *
+ * send_mp3() reads a header that spans two buffers through a small window
+ * instead of copying both into a new buffer. This runs it and a version
+ * that still copies side by side over random streams cut into random
+ * pieces and checks that both hand the same bytes to shout_send_raw(),
+ * mark the same frames and count the same time.
+ *
+ * The format handler is built into this program, shout_send_raw() and
+ * shout_connection_mark_frame() are replaced by ones that record.
+ */
+
+#include "format_mp3.c"
+
+#define ITERATIONS  500
+#define STREAM_MAX  (256*1024)
+
+typedef struct {
+    unsigned char  *data;
+    size_t          len;
+    uint64_t       *marks;
+    size_t          marks_len;
+} capture_t;
+
+static capture_t *capture;
+
+ssize_t shout_send_raw(shout_t *self, const unsigned char *data, size_t len)
+{
+    (void)self;
+
+    memcpy(capture->data + capture->len, data, len);
+    capture->len += len;
+
+    return len;
+}
+
+int shout_connection_mark_frame(shout_connection_t *con, size_t at, uint64_t duration, int droppable)
+{
+    (void)con;
+    (void)droppable;
+
+    if (capture->marks_len + 2 <= STREAM_MAX) {
+        capture->marks[capture->marks_len++] = capture->len + at;
+        capture->marks[capture->marks_len++] = duration;
+    }
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* send_mp3() as it was before the window: the kept bytes are copied in
+ * front of the data into a new buffer, everything else is the same.
+ */
+static int send_mp3_copy(shout_t *self, const unsigned char *data, size_t len)
+{
+    mp3_data_t      *mp3_data = (mp3_data_t*)self->format_data;
+    unsigned char   *bridge_buff = NULL;
+    const unsigned char *buff = data;
+    unsigned long    pos = 0;
+    uint32_t         head;
+    int              ret, count;
+    int              start = 0, end = len - 1, error = 0, i;
+    size_t           bridges = 0, tag;
+    mp3_header_t     mh;
+
+    memset(&mh, 0, sizeof(mh));
+
+    if (mp3_data->frame_left > 0) {
+        if (mp3_data->frame_left <= len) {
+            add_time(self, mp3_data);
+            mp3_data->frames++;
+            pos += mp3_data->frame_left;
+            mp3_data->frame_left = 0;
+        } else {
+            mp3_data->frame_left -= len;
+            pos = len;
+        }
+    }
+
+    if (mp3_data->tag_left > 0) {
+        if (mp3_data->tag_left <= len) {
+            pos += mp3_data->tag_left;
+            mp3_data->tag_left = 0;
+        } else {
+            mp3_data->tag_left -= len;
+            pos = len;
+        }
+
+        if (self->strip_tags)
+            start = pos;
+    }
+
+    if (mp3_data->header_bridges) {
+        bridges = mp3_data->header_bridges;
+        bridge_buff = malloc(len + bridges);
+        if (!bridge_buff)
+            return self->error = SHOUTERR_MALLOC;
+
+        memcpy(bridge_buff, mp3_data->header_bridge, bridges);
+        memcpy(&bridge_buff[bridges], data, len);
+
+        buff = bridge_buff;
+        len += bridges;
+        end = len - 1;
+
+        mp3_data->header_bridges = 0;
+    }
+
+    while ((pos + 4) <= len) {
+        head = ((uint32_t)buff[pos] << 24) |
+               (buff[pos + 1] << 16) |
+               (buff[pos + 2] << 8) |
+               (buff[pos + 3]);
+
+        if (mp3_header(head, &mh)) {
+            if (error) {
+                start = pos;
+                end = len - 1;
+                error = 0;
+            }
+
+            if (mh.samplerate != mp3_data->frame_samplerate)
+                mp3_data->time_rest = 0;
+            mp3_data->frame_samples     = mh.samples;
+            mp3_data->frame_samplerate  = mh.samplerate;
+
+            /* the window only ever held the header, not what follows */
+            if (pos >= bridges && mp3_xing(self, head, &buff[pos], len - pos, &mh))
+                mp3_data->frame_samples = 0;
+
+            shout_connection_mark_frame(self->connection, pos - start, (uint64_t)mp3_data->frame_samples * 1000000 / mh.samplerate, 1);
+
+            if (len - pos >= mh.framesize) {
+                add_time(self, mp3_data);
+                mp3_data->frames++;
+                pos += mh.framesize;
+            } else {
+                mp3_data->frame_left = mh.framesize - (len - pos);
+                pos = len;
+            }
+        } else if (pos >= bridges && (tag = mp3_tag_size(&buff[pos], len - pos)) > 0) {
+            if (self->strip_tags) {
+                if (!error) {
+                    count = pos - start;
+                    ret = count > 0 ? shout_send_raw(self, &buff[start], count) : 0;
+                    if (ret != count) {
+                        free(bridge_buff);
+                        return self->error = SHOUTERR_SOCKET;
+                    }
+                }
+                start = len - pos >= tag ? pos + tag : len;
+            } else if (error) {
+                start = pos;
+            }
+            end = len - 1;
+            error = 0;
+
+            if (len - pos >= tag) {
+                pos += tag;
+            } else {
+                mp3_data->tag_left = tag - (len - pos);
+                pos = len;
+            }
+        } else {
+            if (!error) {
+                error = 1;
+                end = pos - 1;
+                count = end - start + 1;
+                ret = count > 0 ? shout_send_raw(self, &buff[start], count) : 0;
+                if (ret != count) {
+                    free(bridge_buff);
+                    return self->error = SHOUTERR_SOCKET;
+                }
+            }
+            pos = mp3_sync_scan(buff, pos + 1, len);
+        }
+    }
+
+    if ((pos > (len - 4)) && (pos < len)) {
+        end = pos - 1;
+
+        i = 0;
+        while (pos < len) {
+            mp3_data->header_bridge[i] = buff[pos];
+            pos++;
+            i++;
+        }
+        mp3_data->header_bridges = i;
+    }
+
+    ret = count = 0;
+    if (!error) {
+        count = end - start + 1;
+        if (count > 0)
+            ret = shout_send_raw(self, &buff[start], count);
+    }
+
+    free(bridge_buff);
+
+    return self->error = ret == count ? SHOUTERR_SUCCESS : SHOUTERR_SOCKET;
+}
+
+static unsigned int rnd(unsigned int n)
+{
+    return (unsigned int)rand() % n;
+}
+
+static void fill(unsigned char *p, size_t len)
+{
+    size_t i;
+
+    /* plenty of 0xFF bytes to make false syncs */
+    for (i = 0; i < len; i++)
+        p[i] = rnd(8) ? rand() : 0xFF;
+}
+
+/* Appends a frame with a valid header, sometimes a Xing or Info frame. */
+static size_t gen_frame(unsigned char *p, size_t left)
+{
+    static const unsigned int versions[3] = {3, 2, 0};
+    unsigned int version = rnd(3);
+    unsigned int layer = rnd(2);
+    unsigned int srate = rnd(3);
+    unsigned int bitrate = 1 + rnd(14);
+    unsigned int pad = rnd(2);
+    unsigned int mode = rnd(4);
+    size_t len = framesize[version][layer][srate][bitrate] + pad;
+    size_t offset;
+
+    if (len > left)
+        len = left;
+
+    fill(p, len);
+    if (len < 4)
+        return len;
+
+    p[0] = 0xFF;
+    p[1] = 0xE0 | (versions[version] << 3) | ((layer ? 1 : 2) << 1) | rnd(2);
+    p[2] = (bitrate << 4) | (srate << 2) | (pad << 1) | rnd(2);
+    p[3] = (mode << 6) | rnd(64);
+
+    if (layer && !rnd(8)) {
+        if (version == 0) {
+            offset = 4 + (mode == 3 ? 17 : 32);
+        } else {
+            offset = 4 + (mode == 3 ? 9 : 17);
+        }
+        if (offset + 12 <= len) {
+            memcpy(&p[offset], rnd(2) ? "Xing" : "Info", 4);
+            p[offset + 7] = rnd(2);
+            p[offset + 8] = 0;
+            p[offset + 9] = 0;
+            p[offset + 10] = rnd(256);
+            p[offset + 11] = rnd(256);
+        }
+    }
+
+    return len;
+}
+
+/* Appends an ID3v2 or APE tag, now and then a broken one. */
+static size_t gen_tag(unsigned char *p, size_t left)
+{
+    size_t size = rnd(4096);
+    size_t len;
+
+    if (rnd(2)) {
+        len = 10 + size + (rnd(2) ? 10 : 0);
+        if (len > left)
+            len = left;
+        fill(p, len);
+        if (len < 10)
+            return len;
+        memcpy(p, "ID3", 3);
+        p[3] = 4;
+        p[4] = 0;
+        p[5] = len - size > 10 ? 0x10 : 0;
+        p[6] = 0;
+        p[7] = (size >> 14) & 0x7F;
+        p[8] = (size >> 7) & 0x7F;
+        p[9] = size & 0x7F;
+        if (!rnd(16))
+            p[8] |= 0x80;
+    } else {
+        size += 32;
+        len = rnd(2) ? 32 + size : 32;
+        if (len > left)
+            len = left;
+        fill(p, len);
+        if (len < 32)
+            return len;
+        memcpy(p, "APETAGEX", 8);
+        p[12] = size & 0xFF;
+        p[13] = (size >> 8) & 0xFF;
+        p[14] = 0;
+        p[15] = 0;
+        p[20] = p[21] = p[22] = 0;
+        p[23] = len > 32 ? 0x20 : 0;
+        if (!rnd(16))
+            p[15] = 0x7F;
+    }
+
+    return len;
+}
+
+static size_t gen_stream(unsigned char *p, size_t len)
+{
+    size_t pos = 0;
+    unsigned int kind;
+
+    while (pos < len) {
+        kind = rnd(16);
+        if (kind < 12) {
+            pos += gen_frame(&p[pos], len - pos);
+        } else if (kind < 14) {
+            pos += gen_tag(&p[pos], len - pos);
+        } else {
+            kind = rnd(64);
+            if (kind > len - pos)
+                kind = len - pos;
+            fill(&p[pos], kind);
+            pos += kind;
+        }
+    }
+
+    return pos;
+}
+
+static int run(unsigned int seed, unsigned char *stream, capture_t *out)
+{
+    shout_t  shout[2];
+    size_t   len;
+    size_t   pos;
+    size_t   chunk;
+    int      ret[2];
+    int      i;
+
+    srand(seed);
+    len = gen_stream(stream, rnd(STREAM_MAX));
+
+    memset(shout, 0, sizeof(shout));
+    for (i = 0; i < 2; i++) {
+        out[i].len = 0;
+        out[i].marks_len = 0;
+        shout[i].strip_tags = seed & 1;
+        if (shout_open_mp3(&shout[i]) != SHOUTERR_SUCCESS)
+            return -1;
+    }
+
+    for (pos = 0; pos < len; pos += chunk) {
+        /* now and then a piece smaller than a header */
+        chunk = rnd(8) ? rnd(5000) : rnd(7);
+        if (chunk > len - pos)
+            chunk = len - pos;
+
+        capture = &out[0];
+        ret[0] = send_mp3(&shout[0], stream + pos, chunk);
+        capture = &out[1];
+        ret[1] = send_mp3_copy(&shout[1], stream + pos, chunk);
+
+        if (ret[0] != ret[1]) {
+            printf("seed %u: returned %d and %d at %zu\n", seed, ret[0], ret[1], pos);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+        shout[i].close(&shout[i]);
+
+    if (out[0].len != out[1].len || memcmp(out[0].data, out[1].data, out[0].len) != 0) {
+        printf("seed %u: sent %zu and %zu bytes that differ\n", seed, out[0].len, out[1].len);
+        return 1;
+    }
+
+    if (out[0].marks_len != out[1].marks_len || memcmp(out[0].marks, out[1].marks, out[0].marks_len * sizeof(uint64_t)) != 0) {
+        printf("seed %u: frame marks differ\n", seed);
+        return 1;
+    }
+
+    if (shout[0].senttime != shout[1].senttime || shout[0].duration != shout[1].duration) {
+        printf("seed %u: time differs\n", seed);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int iterations = argc > 1 ? (unsigned int)atoi(argv[1]) : ITERATIONS;
+    unsigned char *stream;
+    capture_t out[2];
+    unsigned int seed;
+    int ret = 0;
+    int i;
+
+    stream = malloc(STREAM_MAX);
+    for (i = 0; i < 2; i++) {
+        out[i].data = malloc(STREAM_MAX);
+        out[i].marks = malloc(STREAM_MAX * sizeof(uint64_t));
+        if (!out[i].data || !out[i].marks)
+            ret = -1;
+    }
+
+    for (seed = 0; seed < iterations && !ret; seed++)
+        ret = run(seed, stream, out);
+
+    if (ret < 0)
+        printf("Out of memory\n");
+
+    free(stream);
+    for (i = 0; i < 2; i++) {
+        free(out[i].data);
+        free(out[i].marks);
+    }
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+/* -*- c-basic-offset: 8; -*-
+ * resolver.c: Test of the name resolution cache with a stub resolver.
+ * $Id$
+ *
+ * The resolver is built into this program and gets a stub installed with
+ * shout_dns_set_resolver(), timing_get_time() is replaced by a clock the
+ * test sets. It checks that concurrent requests for a host share a single
+ * lookup, that results are cached for SHOUT_DNS_TTL and that failures are
+ * not cached at all.
+ */
+
+#ifdef _WIN32
+int main()
+{
+    /* skipped */
+    return 77;
+}
+#else
+
+#include "dns.c"
+
+#include <stdio.h>
+#include <poll.h>
+
+#define REQUESTS    16
+#define STUB_ADDR   "192.0.2.1"
+
+static uint64_t         now = 1000;
+static int              calls;
+#ifdef SHOUT_DNS_ASYNC
+static int              gate_open;
+static pthread_mutex_t  gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gate_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+uint64_t timing_get_time(void)
+{
+    return now;
+}
+
+/* Counts the calls and, with the gate closed, blocks until it opens. */
+static int stub_resolver(const char *host, shout_dns_result_t **result)
+{
+    shout_dns_result_t *res;
+
+#ifdef SHOUT_DNS_ASYNC
+    pthread_mutex_lock(&gate_lock);
+    calls++;
+    while (!gate_open)
+        pthread_cond_wait(&gate_cond, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+#else
+    calls++;
+#endif
+
+    if (strncmp(host, "fail.", 5) == 0)
+        return SHOUTERR_NOCONNECT;
+
+    res = calloc(1, sizeof(*res) + sizeof(res->addr[0]));
+    if (!res)
+        return SHOUTERR_MALLOC;
+
+    res->refc = 1;
+    res->count = 1;
+    res->addr[0].family = AF_INET;
+    strcpy(res->addr[0].host, STUB_ADDR);
+
+    *result = res;
+    return SHOUTERR_SUCCESS;
+}
+
+static int get_calls(void)
+{
+    int ret;
+
+#ifdef SHOUT_DNS_ASYNC
+    pthread_mutex_lock(&gate_lock);
+    ret = calls;
+    pthread_mutex_unlock(&gate_lock);
+#else
+    ret = calls;
+#endif
+
+    return ret;
+}
+
+#ifdef SHOUT_DNS_ASYNC
+static void set_gate(int open)
+{
+    pthread_mutex_lock(&gate_lock);
+    gate_open = open;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+}
+#endif
+
+/* Waits for the request and checks its outcome. */
+static int check_request(shout_dns_request_t *req, int expected)
+{
+    shout_dns_result_t *result = NULL;
+    struct pollfd pfd;
+    int ret;
+
+    while ((pfd.fd = shout_dns_request_get_fd(req)) != SOCK_ERROR) {
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 10000) != 1) {
+            printf("Request timed out\n");
+            return 1;
+        }
+    }
+
+    ret = shout_dns_request_get_result(req, &result);
+    if (ret != expected) {
+        printf("Request returned %d instead of %d\n", ret, expected);
+        if (ret == SHOUTERR_SUCCESS)
+            shout_dns_result_unref(result);
+        return 1;
+    }
+
+    if (ret == SHOUTERR_SUCCESS) {
+        ret = result->count != 1 || strcmp(result->addr[0].host, STUB_ADDR) != 0;
+        shout_dns_result_unref(result);
+        if (ret) {
+            printf("Wrong address\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef SHOUT_DNS_ASYNC
+/* Requests for a host while its lookup runs all wait for that lookup. */
+static int test_coalescing(void)
+{
+    shout_dns_request_t *req[REQUESTS];
+    int ret = 0;
+    int i;
+
+    set_gate(0);
+    for (i = 0; i < REQUESTS; i++) {
+        req[i] = shout_dns_request_new("coalesce.example");
+        if (!req[i]) {
+            printf("Could not create a request\n");
+            set_gate(1);
+            while (i--)
+                shout_dns_request_free(req[i]);
+            return 1;
+        }
+    }
+    set_gate(1);
+
+    for (i = 0; i < REQUESTS; i++) {
+        ret |= check_request(req[i], SHOUTERR_SUCCESS);
+        shout_dns_request_free(req[i]);
+    }
+
+    if (get_calls() != 1) {
+        printf("%d requests made %d lookups instead of one\n", REQUESTS, get_calls());
+        ret = 1;
+    }
+
+    return ret;
+}
+#endif
+
+/* A result is served from the cache until SHOUT_DNS_TTL has passed. */
+static int test_ttl(void)
+{
+    shout_dns_request_t *req;
+    shout_dns_result_t *result;
+    int start = get_calls();
+    int ret = 0;
+
+    if (shout_dns_lookup("ttl.example", &result) != SHOUTERR_SUCCESS) {
+        printf("Lookup failed\n");
+        return 1;
+    }
+    shout_dns_result_unref(result);
+
+    now += SHOUT_DNS_TTL - 1;
+    req = shout_dns_request_new("ttl.example");
+    if (!req || shout_dns_request_get_fd(req) != SOCK_ERROR) {
+        printf("Cached result is not ready right away\n");
+        ret = 1;
+    } else {
+        ret |= check_request(req, SHOUTERR_SUCCESS);
+    }
+    shout_dns_request_free(req);
+
+    if (get_calls() != start + 1) {
+        printf("Cached result was resolved again\n");
+        ret = 1;
+    }
+
+    now += 1;
+    if (shout_dns_lookup("ttl.example", &result) != SHOUTERR_SUCCESS) {
+        printf("Lookup failed\n");
+        return 1;
+    }
+    shout_dns_result_unref(result);
+
+    if (get_calls() != start + 2) {
+        printf("Expired result was still used\n");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+/* Failed lookups are tried again on the next request. */
+static int test_failure(void)
+{
+    shout_dns_request_t *req;
+    int start = get_calls();
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        req = shout_dns_request_new("fail.example");
+        if (!req) {
+            printf("Could not create a request\n");
+            return 1;
+        }
+        ret |= check_request(req, SHOUTERR_NOCONNECT);
+        shout_dns_request_free(req);
+    }
+
+    if (get_calls() != start + 2) {
+        printf("Failure was cached\n");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+int main(void)
+{
+    int ret = 0;
+
+    shout_dns_set_resolver(stub_resolver);
+
+#ifdef SHOUT_DNS_ASYNC
+    ret |= test_coalescing();
+#endif
+    ret |= test_ttl();
+    ret |= test_failure();
+
+    shout_dns_cache_free();
+    shout_dns_set_resolver(NULL);
+
+    return ret;
+}
+#endif
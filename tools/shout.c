@@ -103,6 +103,10 @@ static inline int string2format(const char *name, unsigned int *format)
         *format = SHOUT_FORMAT_MP3;
     } else if (strcmp(name, "webm") == 0) {
         *format = SHOUT_FORMAT_WEBM;
+    } else if (strcmp(name, "aac") == 0) {
+        *format = SHOUT_FORMAT_AAC;
+    } else if (strcmp(name, "aacp") == 0) {
+        *format = SHOUT_FORMAT_AACPLUS;
     } else {
         return -1;
     }
@@ -232,7 +236,7 @@ void usage_shout(const char *progname)
         "\n"
         "OPTIONS:\n"
         "General options:\n"
-        "  --format <format>                    set format {ogg|mp3|webm}\n"
+        "  --format <format>                    set format {ogg|mp3|webm|aac|aacp}\n"
         "  -H <host>, --host <host>             set host\n"
         "  -h, --help                           show this help\n"
         "  --mount <mountpoint>                 set mountpoint (e.g. \"/example.ogg\")\n"
@@ -665,6 +669,8 @@ static int getopts_shout(int argc, char *argv[], shout_t *shout)
                 format_usage = SHOUT_USAGE_UNKNOWN;
                 break;
             case SHOUT_FORMAT_MP3:
+            case SHOUT_FORMAT_AAC:
+            case SHOUT_FORMAT_AACPLUS:
                 format_usage = SHOUT_USAGE_AUDIO;
                 break;
             case SHOUT_FORMAT_WEBM: